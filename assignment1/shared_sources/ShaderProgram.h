@@ -30,6 +30,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 
 using namespace std;
 using namespace Eigen;      // enables writing "Vector3f" instead of "Eigen::Vector3f", etc.
@@ -55,7 +56,8 @@ public:
 
 	GLuint          getHandle(void) const { return m_glProgram; }
 	GLint           getAttribLoc(const string& name) const;
-	GLint           getUniformLoc(const string& name) const;
+	GLint           getUniformLoc(const string& name) const;   // from a table filled at link time
+	bool            bindUniformBlock(const string& name, GLuint binding);
 
     void            setUniform(int loc, int v) { if (loc >= 0) glUniform1i(loc, v); }
     void            setUniform(int loc, float v) { if (loc >= 0) glUniform1f(loc, v); }
@@ -104,6 +106,7 @@ private:
 	void            init(const string& vertexSource,
 						 GLenum geomInputType, GLenum geomOutputType, int geomVerticesOut, const string& geometrySource,
 						 const string& fragmentSource);
+	void            reflectUniforms(void);
 
 private:
 	ShaderProgram(const ShaderProgram&) = delete; // forbidden
@@ -114,4 +117,5 @@ private:
 	GLuint          m_glGeometryShader;
 	GLuint          m_glFragmentShader;
 	GLuint          m_glProgram;
+	std::unordered_map<string, GLint> m_uniformLocs;
 };
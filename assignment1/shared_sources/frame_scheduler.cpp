@@ -0,0 +1,95 @@
+#include "frame_scheduler.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+namespace
+{
+    // User and system time of all threads of the process, in seconds.
+    double processCpuSeconds()
+    {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+            return 0.0;
+        auto seconds = [](const FILETIME& t) { return (double(t.dwHighDateTime) * 4294967296.0 + double(t.dwLowDateTime)) * 1e-7; };
+        return seconds(kernel) + seconds(user);
+#else
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0.0;
+        return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + 1e-6 * double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#endif
+    }
+}
+
+void FrameScheduler::requestFrames(int count)
+{
+    m_requested = std::max(m_requested, count);
+}
+
+// Processes events until the given time. Input that arrives meanwhile asks for the frames
+// that let ImGui settle.
+void FrameScheduler::waitUntil(double time)
+{
+    for (double now = glfwGetTime(); now < time; now = glfwGetTime())
+    {
+        glfwWaitEventsTimeout(time - now);
+        if (glfwGetTime() < time - TimerSlack)
+            requestFrames(SettleFrames);
+    }
+}
+
+void FrameScheduler::waitForNextFrame()
+{
+    if (m_window_start < 0.0)
+    {
+        m_window_start = glfwGetTime();
+        m_window_cpu = processCpuSeconds();
+    }
+
+    for (;;)
+    {
+        double now = glfwGetTime();
+        if (m_animating || m_requested > 0)
+            break;
+        if (m_background && now >= m_last_frame + BackgroundInterval)
+            break;
+
+        double timeout = m_background ? m_last_frame + BackgroundInterval - now : IdleTimeout;
+        glfwWaitEventsTimeout(timeout);
+        // returning early means that an event arrived
+        if (glfwGetTime() < now + timeout - TimerSlack)
+            requestFrames(SettleFrames);
+    }
+
+    if (m_max_fps > 0.0f)
+        waitUntil(m_last_frame + 1.0 / m_max_fps);
+    glfwPollEvents();
+
+    if (m_requested > 0)
+        --m_requested;
+    m_last_frame = glfwGetTime();
+
+    ++m_window_frames;
+    double elapsed = m_last_frame - m_window_start;
+    if (elapsed >= 1.0)
+    {
+        double cpu = processCpuSeconds();
+        m_cpu_usage = float((cpu - m_window_cpu) / elapsed);
+        m_frame_rate = float(m_window_frames / elapsed);
+        m_window_start = m_last_frame;
+        m_window_cpu = cpu;
+        m_window_frames = 0;
+    }
+}
@@ -7,6 +7,8 @@
 #include "glad/gl_core_33.h"                // OpenGL
 #include "im3d.h"
 #include <fmt/core.h>
+#include <algorithm>
+#include <cstring>
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>             // Window manager
@@ -29,6 +31,18 @@ static GLuint g_Im3dShaderPoints;
 static GLuint g_Im3dShaderLines;
 static GLuint g_Im3dShaderTriangles;
 static AppData g_appData;
+
+// Draw lists are streamed through g_Im3dVertexBuffer as a ring of kIm3dFramesInFlight segments, one
+// per frame. A frame maps its segment unsynchronized, which is safe because the fence set after the
+// segment was last drawn from has been waited on, so the driver neither reallocates the storage
+// nor stalls on the draws of the previous frame. The segments only grow, by reallocating the whole
+// buffer, when a frame streams more than fits.
+static const int kIm3dFramesInFlight = 3;
+static GLsizeiptr g_Im3dSegmentBytes = 0;
+static GLsync g_Im3dSegmentFences[kIm3dFramesInFlight] = {};
+static int g_Im3dSegment = 0;
+static size_t g_Im3dBytesStreamed = 0;
+
 static Matrix4f g_modelToClip = Matrix4f::Zero();
 
 
@@ -39,6 +53,9 @@ namespace Im3d
     const char* GetGlEnumString(GLenum _enum);
     const char* GlGetString(GLenum _name);
 
+// Checking every call stalls the pipeline, so outside CS_C3100_GL_DEBUG builds the calls are
+// only made.
+#ifdef CS_C3100_GL_DEBUG
 #define glAssert(call) \
         do { \
             (call); \
@@ -47,6 +64,9 @@ namespace Im3d
                 fail(fmt::format("glAssert failed: {}, {}, {}, {}", #call, __FILE__, __LINE__, Im3d::GetGlEnumString(err))); \
             } \
         } while (0)
+#else
+#define glAssert(call) do { (call); } while (0)
+#endif
 } // namespace Im3d
 
 
@@ -136,6 +156,9 @@ void Im3d_Shutdown()
 {
     glAssert(glDeleteVertexArrays(1, &g_Im3dVertexArray));
     glAssert(glDeleteBuffers(1, &g_Im3dVertexBuffer));
+    for (GLsync& fence : g_Im3dSegmentFences)
+        if (fence)
+            glAssert(glDeleteSync(fence));
     glAssert(glDeleteProgram(g_Im3dShaderPoints));
     glAssert(glDeleteProgram(g_Im3dShaderLines));
     glAssert(glDeleteProgram(g_Im3dShaderTriangles));
@@ -231,7 +254,55 @@ void Im3d_EndFrame()
     glAssert(glDisable(GL_CULL_FACE));
 
     //glAssert(glViewport(0, 0, (GLsizei)g_Example->m_width, (GLsizei)g_Example->m_height));
-        
+
+    // Copy all draw lists of the frame into this frame's segment of the ring with one mapping.
+    GLsizeiptr frameBytes = 0;
+    for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
+        frameBytes += (GLsizeiptr)Im3d::GetDrawLists()[i].m_vertexCount * sizeof(Im3d::VertexData);
+    g_Im3dBytesStreamed = (size_t)frameBytes;
+
+    glAssert(glBindBuffer(GL_ARRAY_BUFFER, g_Im3dVertexBuffer));
+    GLsync& fence = g_Im3dSegmentFences[g_Im3dSegment];
+    if (frameBytes > g_Im3dSegmentBytes)
+    {
+     // grow to whole vertices so that every segment starts at a vertex; nothing can be in flight from the old storage
+        GLsizeiptr vertices = std::max<GLsizeiptr>(2 * frameBytes, 1 << 20) / sizeof(Im3d::VertexData);
+        g_Im3dSegmentBytes = vertices * sizeof(Im3d::VertexData);
+        glAssert(glBufferData(GL_ARRAY_BUFFER, kIm3dFramesInFlight * g_Im3dSegmentBytes, nullptr, GL_STREAM_DRAW));
+        for (GLsync& f : g_Im3dSegmentFences)
+            if (f)
+            {
+                glAssert(glDeleteSync(f));
+                f = nullptr;
+            }
+    }
+    else if (fence)
+    {
+     // normally signaled long ago, kIm3dFramesInFlight - 1 frames have been swapped since
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glAssert(glDeleteSync(fence));
+        fence = nullptr;
+    }
+
+    GLint segmentFirst = (GLint)(g_Im3dSegment * (g_Im3dSegmentBytes / sizeof(Im3d::VertexData)));
+    if (frameBytes > 0)
+    {
+        void* dst = nullptr;
+        glAssert(dst = glMapBufferRange(GL_ARRAY_BUFFER, g_Im3dSegment * g_Im3dSegmentBytes, frameBytes,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+        char* out = (char*)dst;
+        for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
+        {
+            const Im3d::DrawList& drawList = Im3d::GetDrawLists()[i];
+            size_t bytes = drawList.m_vertexCount * sizeof(Im3d::VertexData);
+            memcpy(out, drawList.m_vertexData, bytes);
+            out += bytes;
+        }
+        glAssert(glUnmapBuffer(GL_ARRAY_BUFFER));
+    }
+
+    GLint first = segmentFirst;
     for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
     {
         const Im3d::DrawList& drawList = Im3d::GetDrawLists()[i];
@@ -266,16 +337,19 @@ void Im3d_EndFrame()
         };
     
         glAssert(glBindVertexArray(g_Im3dVertexArray));
-        glAssert(glBindBuffer(GL_ARRAY_BUFFER, g_Im3dVertexBuffer));
-        glAssert(glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)drawList.m_vertexCount * sizeof(Im3d::VertexData), (GLvoid*)drawList.m_vertexData, GL_STREAM_DRAW));
     
         AppData& ad = GetAppData();
         glAssert(glUseProgram(sh));
         glAssert(glUniform2f(glGetUniformLocation(sh, "uViewport"), ad.m_viewportSize.x, ad.m_viewportSize.y));
         glAssert(glUniformMatrix4fv(glGetUniformLocation(sh, "uViewProjMatrix"), 1, false, (const GLfloat*)g_modelToClip.data()));
-        glAssert(glDrawArrays(prim, 0, (GLsizei)drawList.m_vertexCount));
+        glAssert(glDrawArrays(prim, first, (GLsizei)drawList.m_vertexCount));
+        first += (GLint)drawList.m_vertexCount;
     }
 
+    if (frameBytes > 0)
+        glAssert(fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+    g_Im3dSegment = (g_Im3dSegment + 1) % kIm3dFramesInFlight;
+
     glAssert(glBindVertexArray(0));
     glAssert(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
@@ -289,6 +363,12 @@ void Im3d_EndFrame()
     //g_Example->drawTextDrawListsImGui(Im3d::GetTextDrawLists(), Im3d::GetTextDrawListCount());
 }
 
+// Bytes of draw list vertices that the last Im3d_EndFrame() streamed to the GPU.
+size_t Im3d_BytesStreamed()
+{
+    return g_Im3dBytesStreamed;
+}
+
 namespace Im3d
 {
 #define IM3D_STRINGIFY_(_t) #_t
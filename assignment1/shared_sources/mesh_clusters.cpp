@@ -0,0 +1,215 @@
+#include "mesh_clusters.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+using Eigen::Vector3f, Eigen::Vector3i, Eigen::Vector4f, Eigen::Matrix4f;
+using std::vector;
+
+namespace
+{
+    // How much a candidate's normal counts against its distance from the cluster center, which is
+    // measured in typical triangle sizes. A candidate 30 degrees off the cluster normal costs
+    // about as much as one that is 1.3 triangles further away.
+    const float NormalWeight = 10.0f;
+
+    // Spreads the low 10 bits of v so that there are two zero bits between each of them.
+    uint32_t spreadBits(uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+}
+
+void MeshClusters::build(const vector<Vector3f>& positions, const vector<Vector3i>& indices, int max_triangles)
+{
+    m_clusters.clear();
+    m_order.clear();
+    const int n = int(indices.size());
+    if (n == 0)
+        return;
+    max_triangles = std::max(max_triangles, 1);
+
+    vector<Vector3f> centroids(n), normals(n);
+    Vector3f lo = Vector3f::Constant(INFINITY), hi = Vector3f::Constant(-INFINITY);
+    double area = 0.0;
+    for (int t = 0; t < n; ++t)
+    {
+        const Vector3f& p0 = positions[indices[t][0]];
+        const Vector3f& p1 = positions[indices[t][1]];
+        const Vector3f& p2 = positions[indices[t][2]];
+        centroids[t] = (p0 + p1 + p2) / 3.0f;
+        Vector3f c = (p1 - p0).cross(p2 - p0);
+        float len = c.norm();
+        area += 0.5 * len;
+        normals[t] = len > 0.0f ? Vector3f(c / len) : Vector3f::Zero();    // degenerate triangles do not bound the cone
+        lo = lo.cwiseMin(centroids[t]);
+        hi = hi.cwiseMax(centroids[t]);
+    }
+    const float triangle_size = std::max(float(std::sqrt(area / n)), 1e-20f);
+
+    // seeds in Morton order, so that consecutive clusters are close to each other and the
+    // leftovers of one cluster are picked up by the next
+    vector<std::pair<uint32_t, int>> morton(n);
+    Vector3f scale = (hi - lo).cwiseMax(1e-20f).cwiseInverse() * 1023.0f;
+    for (int t = 0; t < n; ++t)
+    {
+        Vector3f q = (centroids[t] - lo).cwiseProduct(scale);
+        morton[t] = { spreadBits(uint32_t(q.x())) | spreadBits(uint32_t(q.y())) << 1 | spreadBits(uint32_t(q.z())) << 2, t };
+    }
+    std::sort(morton.begin(), morton.end());
+
+    // the triangles around each vertex, in compressed rows
+    vector<int> first_around(positions.size() + 1, 0), around(3 * size_t(n));
+    for (const auto& tri : indices)
+        for (int k = 0; k < 3; ++k)
+            ++first_around[tri[k] + 1];
+    for (size_t v = 0; v < positions.size(); ++v)
+        first_around[v + 1] += first_around[v];
+    {
+        vector<int> fill(first_around.begin(), first_around.end() - 1);
+        for (int t = 0; t < n; ++t)
+            for (int k = 0; k < 3; ++k)
+                around[fill[indices[t][k]]++] = t;
+    }
+
+    m_order.reserve(n);
+    vector<char> assigned(n, 0);
+    vector<int> seen(n, -1);         // the last cluster that had the triangle as a candidate
+    vector<int> candidates;
+    for (const auto& seed : morton)
+    {
+        if (assigned[seed.second])
+            continue;
+
+        const int cluster = int(m_clusters.size());
+        const int first = int(m_order.size());
+        Vector3f centroid_sum = Vector3f::Zero(), normal_sum = Vector3f::Zero();
+        candidates.clear();
+
+        auto take = [&](int t)
+        {
+            assigned[t] = 1;
+            m_order.push_back(t);
+            centroid_sum += centroids[t];
+            normal_sum += normals[t];
+            for (int k = 0; k < 3; ++k)
+            {
+                int v = indices[t][k];
+                for (int i = first_around[v]; i < first_around[v + 1]; ++i)
+                {
+                    int u = around[i];
+                    if (!assigned[u] && seen[u] != cluster)
+                    {
+                        seen[u] = cluster;
+                        candidates.push_back(u);
+                    }
+                }
+            }
+        };
+
+        take(seed.second);
+        while (int(m_order.size()) - first < max_triangles && !candidates.empty())
+        {
+            Vector3f center = centroid_sum / float(m_order.size() - first);
+            Vector3f axis = normal_sum.normalized();
+            size_t best = 0;
+            float best_score = INFINITY;
+            for (size_t i = 0; i < candidates.size(); ++i)
+            {
+                int t = candidates[i];
+                float score = (centroids[t] - center).norm() / triangle_size + NormalWeight * (1.0f - normals[t].dot(axis));
+                if (score < best_score)
+                {
+                    best_score = score;
+                    best = i;
+                }
+            }
+            int t = candidates[best];
+            candidates[best] = candidates.back();
+            candidates.pop_back();
+            take(t);
+        }
+
+        // bounds of the finished cluster
+        Cluster c;
+        c.first = first;
+        c.count = int(m_order.size()) - first;
+        Vector3f box_lo = Vector3f::Constant(INFINITY), box_hi = Vector3f::Constant(-INFINITY);
+        for (int i = first; i < first + c.count; ++i)
+            for (int k = 0; k < 3; ++k)
+            {
+                box_lo = box_lo.cwiseMin(positions[indices[m_order[i]][k]]);
+                box_hi = box_hi.cwiseMax(positions[indices[m_order[i]][k]]);
+            }
+        c.center = 0.5f * (box_lo + box_hi);
+        float radius2 = 0.0f;
+        for (int i = first; i < first + c.count; ++i)
+            for (int k = 0; k < 3; ++k)
+                radius2 = std::max(radius2, (positions[indices[m_order[i]][k]] - c.center).squaredNorm());
+        c.radius = std::sqrt(radius2);
+
+        float len = normal_sum.norm();
+        if (len > 0.0f)
+        {
+            c.cone_axis = normal_sum / len;
+            c.cone_cutoff = 1.0f;
+            for (int i = first; i < first + c.count; ++i)
+                if (normals[m_order[i]] != Vector3f::Zero())
+                    c.cone_cutoff = std::min(c.cone_cutoff, normals[m_order[i]].dot(c.cone_axis));
+        }
+        m_clusters.push_back(c);
+    }
+}
+
+void MeshClusters::cull(const Matrix4f& model_to_clip, const Vector3f& camera, bool backfaces, vector<int>& visible) const
+{
+    // The frustum planes are the sums and differences of the w row and the x, y and z rows.
+    // They are normalized so that the distance of a sphere center can be compared to its radius.
+    Vector4f planes[6];
+    for (int i = 0; i < 3; ++i)
+    {
+        planes[2 * i] = model_to_clip.row(3) + model_to_clip.row(i);
+        planes[2 * i + 1] = model_to_clip.row(3) - model_to_clip.row(i);
+    }
+    for (auto& p : planes)
+        p /= std::max(p.head<3>().norm(), 1e-30f);
+
+    for (int i = 0; i < int(m_clusters.size()); ++i)
+    {
+        const Cluster& c = m_clusters[i];
+
+        bool outside = false;
+        for (const auto& p : planes)
+            if (p.head<3>().dot(c.center) + p.w() < -c.radius)
+            {
+                outside = true;
+                break;
+            }
+        if (outside)
+            continue;
+
+        // Every point of the cluster is seen from the camera within an angle asin(radius / distance)
+        // of the center, and every normal is within acos(cone_cutoff) of the axis. If the axis
+        // points away from the camera by more than the sum of the two, no triangle can face it.
+        if (backfaces && c.cone_cutoff > 0.0f)
+        {
+            Vector3f d = c.center - camera;
+            float distance = d.norm();
+            if (distance > c.radius)
+            {
+                float sin_b = c.radius / distance, cos_b = std::sqrt(1.0f - sin_b * sin_b);
+                float cos_a = c.cone_cutoff, sin_a = std::sqrt(std::max(1.0f - cos_a * cos_a, 0.0f));
+                if (cos_a * cos_b - sin_a * sin_b > 0.0f && c.cone_axis.dot(d) > (sin_a * cos_b + cos_a * sin_b) * distance)
+                    continue;
+            }
+        }
+
+        visible.push_back(i);
+    }
+}
@@ -0,0 +1,555 @@
+#include "ray_query.h"
+
+#include <algorithm>
+#include <cmath>
+
+using Eigen::Vector3f, Eigen::Vector3i, Eigen::Array4f;
+using std::vector;
+using Mask = Eigen::Array<bool, 4, 1>;
+
+namespace
+{
+    const int   NumBins = 16;
+    const int   MaxLeafTriangles = 4;
+    // Below this depth nodes are split at the median, so no path is longer than MedianDepth plus
+    // the logarithm of the triangle count.
+    const int   MedianDepth = 48;
+    // A traversal pushes at most three more nodes than it pops per level.
+    const int   StackSize = 3 * (MedianDepth + 40) + 1;
+
+    float halfArea(const Vector3f& lo, const Vector3f& hi)
+    {
+        Vector3f e = (hi - lo).cwiseMax(0.0f);
+        return e.x() * e.y() + e.y() * e.z() + e.z() * e.x();
+    }
+
+    // 1 / d, with zero components replaced by tiny ones of the same sign, so that the slab
+    // test never computes 0 * inf
+    Vector3f safeInverse(const Vector3f& d)
+    {
+        Vector3f inv;
+        for (int i = 0; i < 3; ++i)
+            inv[i] = 1.0f / (std::abs(d[i]) > 1e-30f ? d[i] : std::copysign(1e-30f, d[i]));
+        return inv;
+    }
+
+    // Binary SAH tree, only used while building.
+    struct BinaryNode
+    {
+        Vector3f    lo, hi;
+        int         left = -1, right = -1;  // -1 for leaves
+        int         first = 0, count = 0;   // leaves: range of the triangle order
+    };
+
+    class BinaryBuilder
+    {
+    public:
+        BinaryBuilder(const vector<Vector3f>& positions, const vector<Vector3i>& indices)
+        {
+            const int num_tris = (int)indices.size();
+            order.resize(num_tris);
+            m_lo.resize(num_tris);
+            m_hi.resize(num_tris);
+            m_centroids.resize(num_tris);
+#pragma omp parallel for
+            for (int t = 0; t < num_tris; ++t) {
+                const Vector3f& p0 = positions[indices[t][0]];
+                const Vector3f& p1 = positions[indices[t][1]];
+                const Vector3f& p2 = positions[indices[t][2]];
+                order[t] = t;
+                m_lo[t] = p0.cwiseMin(p1).cwiseMin(p2);
+                m_hi[t] = p0.cwiseMax(p1).cwiseMax(p2);
+                m_centroids[t] = 0.5f * (m_lo[t] + m_hi[t]);
+            }
+            nodes.reserve(2 * size_t(num_tris / MaxLeafTriangles + 1));
+            if (num_tris > 0)
+                build(0, num_tris, 0);
+        }
+
+        vector<BinaryNode>  nodes;      // [0] is the root
+        vector<int>         order;      // triangles in leaf order
+
+    private:
+        int build(int begin, int end, int depth)
+        {
+            int node = (int)nodes.size();
+            nodes.emplace_back();
+
+            Vector3f box_lo = Vector3f::Constant(FLT_MAX), box_hi = Vector3f::Constant(-FLT_MAX);
+            Vector3f centroid_lo = box_lo, centroid_hi = box_hi;
+            for (int k = begin; k < end; ++k) {
+                box_lo = box_lo.cwiseMin(m_lo[order[k]]);
+                box_hi = box_hi.cwiseMax(m_hi[order[k]]);
+                centroid_lo = centroid_lo.cwiseMin(m_centroids[order[k]]);
+                centroid_hi = centroid_hi.cwiseMax(m_centroids[order[k]]);
+            }
+            nodes[node].lo = box_lo;
+            nodes[node].hi = box_hi;
+            nodes[node].first = begin;
+            nodes[node].count = end - begin;
+
+            const int count = end - begin;
+            if (count <= MaxLeafTriangles)
+                return node;
+
+            // Bin the centroids along each axis and evaluate the SAH cost of splitting between
+            // every two bins: the area of each side times the number of triangles in it.
+            // Triangles cost about as much to test as boxes, so a leaf costs its triangle count
+            // times its own area.
+            float best_cost = halfArea(box_lo, box_hi) * float(count);
+            int best_axis = -1, best_split = 0;
+            for (int axis = 0; axis < 3 && depth < MedianDepth; ++axis) {
+                float extent = centroid_hi[axis] - centroid_lo[axis];
+                if (extent <= 0.0f)
+                    continue;
+                float scale = float(NumBins) / extent;
+                int bin_count[NumBins] = {};
+                Vector3f bin_lo[NumBins], bin_hi[NumBins];
+                for (int b = 0; b < NumBins; ++b) {
+                    bin_lo[b] = Vector3f::Constant(FLT_MAX);
+                    bin_hi[b] = Vector3f::Constant(-FLT_MAX);
+                }
+                for (int k = begin; k < end; ++k) {
+                    int t = order[k];
+                    int b = std::min(NumBins - 1, int((m_centroids[t][axis] - centroid_lo[axis]) * scale));
+                    ++bin_count[b];
+                    bin_lo[b] = bin_lo[b].cwiseMin(m_lo[t]);
+                    bin_hi[b] = bin_hi[b].cwiseMax(m_hi[t]);
+                }
+
+                // sweep from the right to get the cost of everything above each split
+                float right_cost[NumBins];
+                Vector3f acc_lo = Vector3f::Constant(FLT_MAX), acc_hi = Vector3f::Constant(-FLT_MAX);
+                int acc_count = 0;
+                for (int b = NumBins - 1; b > 0; --b) {
+                    acc_lo = acc_lo.cwiseMin(bin_lo[b]);
+                    acc_hi = acc_hi.cwiseMax(bin_hi[b]);
+                    acc_count += bin_count[b];
+                    right_cost[b] = acc_count > 0 ? halfArea(acc_lo, acc_hi) * float(acc_count) : 0.0f;
+                }
+                acc_lo = Vector3f::Constant(FLT_MAX);
+                acc_hi = Vector3f::Constant(-FLT_MAX);
+                acc_count = 0;
+                for (int b = 0; b < NumBins - 1; ++b) {
+                    acc_lo = acc_lo.cwiseMin(bin_lo[b]);
+                    acc_hi = acc_hi.cwiseMax(bin_hi[b]);
+                    acc_count += bin_count[b];
+                    if (acc_count == 0 || acc_count == count)
+                        continue;
+                    float cost = halfArea(acc_lo, acc_hi) * float(acc_count) + right_cost[b + 1] + halfArea(box_lo, box_hi);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b + 1;
+                    }
+                }
+            }
+
+            int mid;
+            if (best_axis >= 0) {
+                float scale = float(NumBins) / (centroid_hi[best_axis] - centroid_lo[best_axis]);
+                auto below = [&](int t) {
+                    return std::min(NumBins - 1, int((m_centroids[t][best_axis] - centroid_lo[best_axis]) * scale)) < best_split;
+                };
+                mid = int(std::partition(order.begin() + begin, order.begin() + end, below) - order.begin());
+            }
+            else {
+                // No split beats a leaf. Large leaves are still split in the middle so that a ray
+                // never tests too many triangles, which also covers many equal centroids.
+                if (count <= 4 * MaxLeafTriangles && depth < MedianDepth)
+                    return node;
+                Vector3f extent = centroid_hi - centroid_lo;
+                extent.maxCoeff(&best_axis);
+                mid = (begin + end) / 2;
+                std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                                 [&](int a, int b) { return m_centroids[a][best_axis] < m_centroids[b][best_axis]; });
+            }
+
+            int left = build(begin, mid, depth + 1);
+            int right = build(mid, end, depth + 1);
+            nodes[node].left = left;
+            nodes[node].right = right;
+            return node;
+        }
+
+        vector<Vector3f>    m_lo, m_hi, m_centroids;
+    };
+}
+
+//------------------------------------------------------------------------
+
+struct RayQuery::RayPacket
+{
+    Array4f     o[3], d[3], inv_d[3];
+    Array4f     t_max;          // shrinks to the closest hit so far; negative for unused rays
+    RayHit      hits[4];
+};
+
+void RayQuery::build(const vector<Vector3f>& positions, const vector<Vector3i>& indices)
+{
+    BinaryBuilder binary(positions, indices);
+    m_nodes.clear();
+    m_packets.clear();
+    m_num_triangles = indices.size();
+    stale = false;
+    if (binary.nodes.empty())
+        return;
+
+    auto addLeaf = [&](const BinaryNode& leaf, int& first, int& count) {
+        first = (int)m_packets.size();
+        count = (leaf.count + 3) / 4;
+        for (int k = 0; k < leaf.count; k += 4) {
+            TrianglePacket packet;
+            for (int c = 0; c < 3; ++c)
+                packet.p0[c] = packet.e1[c] = packet.e2[c] = Array4f::Zero();
+            for (int j = 0; j < 4; ++j)
+                packet.index[j] = k + j < leaf.count ? binary.order[leaf.first + k + j] : -1;
+            m_packets.push_back(packet);
+        }
+    };
+
+    // Collapses the binary tree below node into a wide node, depth first so that children come
+    // after their parents.
+    auto collapse = [&](auto& self, int node) -> int {
+        vector<int> children = { binary.nodes[node].left, binary.nodes[node].right };
+        while (children.size() < 4) {
+            int largest = -1;
+            float largest_area = -1.0f;
+            for (size_t c = 0; c < children.size(); ++c) {
+                const BinaryNode& n = binary.nodes[children[c]];
+                if (n.left != -1 && halfArea(n.lo, n.hi) > largest_area) {
+                    largest = int(c);
+                    largest_area = halfArea(n.lo, n.hi);
+                }
+            }
+            if (largest == -1)
+                break;
+            int expanded = children[largest];
+            children[largest] = binary.nodes[expanded].left;
+            children.push_back(binary.nodes[expanded].right);
+        }
+
+        int wide = (int)m_nodes.size();
+        m_nodes.emplace_back();
+        m_nodes[wide].num_children = (int)children.size();
+        for (int c = 0; c < 4; ++c) {
+            m_nodes[wide].child[c] = 0;
+            m_nodes[wide].count[c] = 0;
+        }
+        for (int c = 0; c < (int)children.size(); ++c) {
+            const BinaryNode& n = binary.nodes[children[c]];
+            if (n.left == -1) {
+                int first, count;
+                addLeaf(n, first, count);
+                m_nodes[wide].child[c] = first;
+                m_nodes[wide].count[c] = count;
+            }
+            else {
+                int sub = self(self, children[c]);
+                m_nodes[wide].child[c] = sub;
+            }
+        }
+        return wide;
+    };
+
+    if (binary.nodes[0].left == -1) {
+        // a single leaf still gets a node above it, so that traversal always starts at a node
+        m_nodes.emplace_back();
+        Node& root = m_nodes[0];
+        root.num_children = 1;
+        for (int c = 0; c < 4; ++c)
+            root.child[c] = root.count[c] = 0;
+        addLeaf(binary.nodes[0], root.child[0], root.count[0]);
+    }
+    else
+        collapse(collapse, 0);
+
+    refit(positions, indices);
+}
+
+void RayQuery::refit(const vector<Vector3f>& positions, const vector<Vector3i>& indices)
+{
+    const int num_packets = (int)m_packets.size();
+#pragma omp parallel for
+    for (int k = 0; k < num_packets; ++k) {
+        TrianglePacket& packet = m_packets[k];
+        for (int j = 0; j < 4; ++j) {
+            if (packet.index[j] == -1)
+                continue;
+            const Vector3i& tri = indices[packet.index[j]];
+            for (int c = 0; c < 3; ++c) {
+                packet.p0[c][j] = positions[tri[0]][c];
+                packet.e1[c][j] = positions[tri[1]][c] - positions[tri[0]][c];
+                packet.e2[c][j] = positions[tri[2]][c] - positions[tri[0]][c];
+            }
+        }
+    }
+
+    // children come after their parents, so going backwards visits them first
+    for (int n = (int)m_nodes.size() - 1; n >= 0; --n) {
+        Node& node = m_nodes[n];
+        for (int c = 0; c < 3; ++c) {
+            node.lo[c] = Array4f::Constant(FLT_MAX);
+            node.hi[c] = Array4f::Constant(-FLT_MAX);
+        }
+        for (int i = 0; i < node.num_children; ++i) {
+            if (node.count[i] > 0) {
+                for (int k = node.child[i]; k < node.child[i] + node.count[i]; ++k) {
+                    const TrianglePacket& packet = m_packets[k];
+                    for (int j = 0; j < 4; ++j) {
+                        if (packet.index[j] == -1)
+                            continue;
+                        for (int c = 0; c < 3; ++c) {
+                            float p0 = packet.p0[c][j], p1 = p0 + packet.e1[c][j], p2 = p0 + packet.e2[c][j];
+                            node.lo[c][i] = std::min(node.lo[c][i], std::min(p0, std::min(p1, p2)));
+                            node.hi[c][i] = std::max(node.hi[c][i], std::max(p0, std::max(p1, p2)));
+                        }
+                    }
+                }
+            }
+            else {
+                const Node& child = m_nodes[node.child[i]];
+                for (int c = 0; c < 3; ++c) {
+                    node.lo[c][i] = child.lo[c].head(child.num_children).minCoeff();
+                    node.hi[c][i] = child.hi[c].head(child.num_children).maxCoeff();
+                }
+            }
+        }
+    }
+    stale = false;
+}
+
+//------------------------------------------------------------------------
+
+template <bool AnyHit>
+bool RayQuery::trace(const Vector3f& o, const Vector3f& d, float t_max, RayHit& hit) const
+{
+    hit = RayHit();
+    if (m_nodes.empty())
+        return false;
+
+    const Vector3f inv = safeInverse(d);
+    const Array4f o4[3] = { Array4f::Constant(o.x()), Array4f::Constant(o.y()), Array4f::Constant(o.z()) };
+    const Array4f d4[3] = { Array4f::Constant(d.x()), Array4f::Constant(d.y()), Array4f::Constant(d.z()) };
+    const Array4f inv4[3] = { Array4f::Constant(inv.x()), Array4f::Constant(inv.y()), Array4f::Constant(inv.z()) };
+    float closest = t_max;
+
+    struct Entry { int index, count; float t; };
+    Entry stack[StackSize];
+    int top = 0;
+    stack[top++] = Entry{ 0, 0, 0.0f };
+    while (top > 0) {
+        Entry e = stack[--top];
+        if (e.t >= closest)
+            continue;
+
+        if (e.count > 0) {
+            // one ray against four triangles at a time (Moller-Trumbore)
+            for (int k = e.index; k < e.index + e.count; ++k) {
+                const TrianglePacket& tri = m_packets[k];
+                Array4f p[3] = { d4[1] * tri.e2[2] - d4[2] * tri.e2[1],
+                                 d4[2] * tri.e2[0] - d4[0] * tri.e2[2],
+                                 d4[0] * tri.e2[1] - d4[1] * tri.e2[0] };
+                Array4f inv_det = (tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2]).inverse();
+                Array4f s[3] = { o4[0] - tri.p0[0], o4[1] - tri.p0[1], o4[2] - tri.p0[2] };
+                Array4f u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+                Array4f q[3] = { s[1] * tri.e1[2] - s[2] * tri.e1[1],
+                                 s[2] * tri.e1[0] - s[0] * tri.e1[2],
+                                 s[0] * tri.e1[1] - s[1] * tri.e1[0] };
+                Array4f v = (d4[0] * q[0] + d4[1] * q[1] + d4[2] * q[2]) * inv_det;
+                Array4f t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * inv_det;
+                // a zero determinant gives NaN or infinite u, which fails these
+                Mask valid = (u >= 0.0f) && (v >= 0.0f) && (u + v <= 1.0f) && (t > 0.0f) && (t < closest);
+                if (!valid.any())
+                    continue;
+                for (int j = 0; j < 4; ++j)
+                    if (valid[j] && t[j] < closest) {
+                        closest = t[j];
+                        hit.triangle = tri.index[j];
+                        hit.t = t[j];
+                        hit.u = u[j];
+                        hit.v = v[j];
+                        if (AnyHit)
+                            return true;
+                    }
+            }
+            continue;
+        }
+
+        // one ray against the four child boxes
+        const Node& node = m_nodes[e.index];
+        Array4f t0[3], t1[3];
+        for (int c = 0; c < 3; ++c) {
+            t0[c] = (node.lo[c] - o4[c]) * inv4[c];
+            t1[c] = (node.hi[c] - o4[c]) * inv4[c];
+        }
+        Array4f t_enter = t0[0].min(t1[0]).max(t0[1].min(t1[1])).max(t0[2].min(t1[2])).max(0.0f);
+        Array4f t_exit = t0[0].max(t1[0]).min(t0[1].max(t1[1])).min(t0[2].max(t1[2])).min(closest);
+        Mask overlap = t_enter <= t_exit;
+
+        // push the hit children far to near, so that the nearest is visited first
+        Entry hits[4];
+        int num_hits = 0;
+        for (int i = 0; i < node.num_children; ++i) {
+            if (!overlap[i])
+                continue;
+            Entry entry{ node.child[i], node.count[i], t_enter[i] };
+            int k = num_hits++;
+            while (k > 0 && hits[k - 1].t < entry.t) {
+                hits[k] = hits[k - 1];
+                --k;
+            }
+            hits[k] = entry;
+        }
+        for (int k = 0; k < num_hits; ++k)
+            stack[top++] = hits[k];
+    }
+    return hit.triangle != -1;
+}
+
+template <bool AnyHit>
+void RayQuery::trace(RayPacket& rays) const
+{
+    if (m_nodes.empty())
+        return;
+
+    struct Entry { int index, count; float t; };
+    Entry stack[StackSize];
+    int top = 0;
+    stack[top++] = Entry{ 0, 0, 0.0f };
+    while (top > 0) {
+        Entry e = stack[--top];
+        if (!(e.t < rays.t_max).any())
+            continue;
+
+        if (e.count > 0) {
+            // each triangle against the four rays
+            for (int k = e.index; k < e.index + e.count; ++k) {
+                const TrianglePacket& packet = m_packets[k];
+                for (int j = 0; j < 4; ++j) {
+                    if (packet.index[j] == -1)
+                        continue;
+                    Array4f e1[3], e2[3], s[3];
+                    for (int c = 0; c < 3; ++c) {
+                        e1[c] = Array4f::Constant(packet.e1[c][j]);
+                        e2[c] = Array4f::Constant(packet.e2[c][j]);
+                        s[c] = rays.o[c] - packet.p0[c][j];
+                    }
+                    const Array4f* d = rays.d;
+                    Array4f p[3] = { d[1] * e2[2] - d[2] * e2[1],
+                                     d[2] * e2[0] - d[0] * e2[2],
+                                     d[0] * e2[1] - d[1] * e2[0] };
+                    Array4f inv_det = (e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2]).inverse();
+                    Array4f u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+                    Array4f q[3] = { s[1] * e1[2] - s[2] * e1[1],
+                                     s[2] * e1[0] - s[0] * e1[2],
+                                     s[0] * e1[1] - s[1] * e1[0] };
+                    Array4f v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+                    Array4f t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+                    Mask valid = (u >= 0.0f) && (v >= 0.0f) && (u + v <= 1.0f) && (t > 0.0f) && (t < rays.t_max);
+                    if (!valid.any())
+                        continue;
+                    for (int r = 0; r < 4; ++r)
+                        if (valid[r]) {
+                            rays.hits[r] = RayHit{ packet.index[j], t[r], u[r], v[r] };
+                            // a ray that only needs any hit is done
+                            rays.t_max[r] = AnyHit ? -1.0f : t[r];
+                        }
+                    if (AnyHit && (rays.t_max < 0.0f).all())
+                        return;
+                }
+            }
+            continue;
+        }
+
+        // each child box against the four rays
+        const Node& node = m_nodes[e.index];
+        Entry hits[4];
+        int num_hits = 0;
+        for (int i = 0; i < node.num_children; ++i) {
+            Array4f t_enter = Array4f::Zero(), t_exit = rays.t_max;
+            for (int c = 0; c < 3; ++c) {
+                Array4f t0 = (node.lo[c][i] - rays.o[c]) * rays.inv_d[c];
+                Array4f t1 = (node.hi[c][i] - rays.o[c]) * rays.inv_d[c];
+                t_enter = t_enter.max(t0.min(t1));
+                t_exit = t_exit.min(t0.max(t1));
+            }
+            Mask overlap = t_enter <= t_exit;
+            if (!overlap.any())
+                continue;
+            // ordered by the nearest entry of any ray
+            Entry entry{ node.child[i], node.count[i], overlap.select(t_enter, Array4f::Constant(FLT_MAX)).minCoeff() };
+            int k = num_hits++;
+            while (k > 0 && hits[k - 1].t < entry.t) {
+                hits[k] = hits[k - 1];
+                --k;
+            }
+            hits[k] = entry;
+        }
+        for (int k = 0; k < num_hits; ++k)
+            stack[top++] = hits[k];
+    }
+}
+
+bool RayQuery::closestHit(const Vector3f& o, const Vector3f& d, float t_max, RayHit& hit) const
+{
+    return trace<false>(o, d, t_max, hit);
+}
+
+bool RayQuery::anyHit(const Vector3f& o, const Vector3f& d, float t_max) const
+{
+    RayHit hit;
+    return trace<true>(o, d, t_max, hit);
+}
+
+void RayQuery::closestHits(const vector<Vector3f>& origins, const vector<Vector3f>& directions, float t_max, vector<RayHit>& hits) const
+{
+    const int num_rays = (int)origins.size();
+    hits.assign(num_rays, RayHit());
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int first = 0; first < num_rays; first += 4) {
+        RayPacket rays;
+        for (int r = 0; r < 4; ++r) {
+            // unused rays repeat the last one, with no room for hits
+            int k = std::min(first + r, num_rays - 1);
+            Vector3f inv = safeInverse(directions[k]);
+            for (int c = 0; c < 3; ++c) {
+                rays.o[c][r] = origins[k][c];
+                rays.d[c][r] = directions[k][c];
+                rays.inv_d[c][r] = inv[c];
+            }
+            rays.t_max[r] = first + r < num_rays ? t_max : -1.0f;
+        }
+        trace<false>(rays);
+        for (int r = 0; r < 4 && first + r < num_rays; ++r)
+            hits[first + r] = rays.hits[r];
+    }
+}
+
+void RayQuery::anyHits(const vector<Vector3f>& origins, const vector<Vector3f>& directions, float t_max, vector<char>& occluded) const
+{
+    const int num_rays = (int)origins.size();
+    occluded.assign(num_rays, 0);
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int first = 0; first < num_rays; first += 4) {
+        RayPacket rays;
+        for (int r = 0; r < 4; ++r) {
+            int k = std::min(first + r, num_rays - 1);
+            Vector3f inv = safeInverse(directions[k]);
+            for (int c = 0; c < 3; ++c) {
+                rays.o[c][r] = origins[k][c];
+                rays.d[c][r] = directions[k][c];
+                rays.inv_d[c][r] = inv[c];
+            }
+            rays.t_max[r] = first + r < num_rays ? t_max : -1.0f;
+        }
+        trace<true>(rays);
+        for (int r = 0; r < 4 && first + r < num_rays; ++r)
+            occluded[first + r] = rays.hits[r].triangle != -1;
+    }
+}
+
+size_t RayQuery::memoryBytes() const
+{
+    return m_nodes.capacity() * sizeof(Node) + m_packets.capacity() * sizeof(TrianglePacket);
+}
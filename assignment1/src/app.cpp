@@ -7,6 +7,7 @@
 #include <fmt/core.h>
 #include <cmath>
 #include <unordered_map>
+#include <random>
 
 //------------------------------------------------------------------------
 
@@ -22,6 +23,11 @@ const App::Vertex reference_plane_data[] = {
     { Vector3f(-1, -1,  1), Vector3f(0, 1, 0) }
 };
 
+// Compares vertex positions bit for bit, for welding the corners of flat triangle lists.
+struct PositionKey { float x,y,z; };
+struct PositionKeyHash { size_t operator()(PositionKey const& k) const noexcept { size_t h1 = std::hash<float>()(k.x); size_t h2 = std::hash<float>()(k.y); size_t h3 = std::hash<float>()(k.z); return h1 ^ (h2<<1) ^ (h3<<2);} };
+struct PositionKeyEq { bool operator()(PositionKey const& a, PositionKey const& b) const noexcept { return a.x==b.x && a.y==b.y && a.z==b.z; } };
+
 //------------------------------------------------------------------------
 
 App::App(void)
@@ -141,7 +147,8 @@ void App::run(const filesystem::path savePNGAndTerminate)
         vecStatusMessages.clear();
         vecStatusMessages.push_back("Use arrow keys, PgUp/PgDn to move the model (R1), Home/End to rotate camera.");
 
-        glfwPollEvents();
+        // Sleeps until there is something new to draw.
+        m_scheduler.waitForNextFrame();
 
         // Rebuild font atlas if necessary
         if (m_font_atlas_dirty)
@@ -164,6 +171,8 @@ void App::run(const filesystem::path savePNGAndTerminate)
             float dt = m_timer.end(); // seconds since last frame
             m_state.camera_rotation_angle += dt * (EIGEN_PI / 6.0f); // ~30 deg/sec
         }
+        else
+            m_timer.start();    // no jump after idling when the rotation starts
 
         // First, render our own 3D scene using OpenGL
         int width, height;
@@ -204,7 +213,12 @@ void App::run(const filesystem::path savePNGAndTerminate)
             cerr << "Wrote screenshot to " << png_path << endl;
         }
         ImGui::Checkbox("Fancy shading (S)", &(bool&)m_state.shading_toggle);
+        ImGui::Checkbox("Pick triangle under cursor", &m_pick_triangle);
+        ImGui::Checkbox("Cull clusters outside the view", &m_cluster_culling);
+        ImGui::SliderInt("Instances", &m_instance_count, 1, 100000, "%d", ImGuiSliderFlags_Logarithmic);
     ImGui::SliderFloat("FOV X (deg)", &m_state.fovx_degrees, 10.0f, 170.0f);
+        ImGui::Checkbox("Render continuously", &m_continuous_rendering);
+        ImGui::SliderInt("Max frame rate", &m_max_fps, 0, 240, m_max_fps > 0 ? "%d" : "off");
 
         // Simplification UI
         size_t triCount = m_indexed_mesh.triangles.size();
@@ -229,6 +243,7 @@ void App::run(const filesystem::path savePNGAndTerminate)
         // Draw the status messages in the current list
         // Note that you can add them from inside render(...)
         vecStatusMessages.push_back(fmt::format("Application average {:.3f} ms/frame ({:.1f} FPS)", 1000.0f / m_io->Framerate, m_io->Framerate));
+        vecStatusMessages.push_back(fmt::format("Drawn {:.1f} frames/s, CPU {:.0f}% of a core", m_scheduler.frameRate(), 100.0f * m_scheduler.cpuUsage()));
         for (const string& msg : vecStatusMessages)
             ImGui::Text("%s", msg.c_str());
 
@@ -244,6 +259,16 @@ void App::run(const filesystem::path savePNGAndTerminate)
         // This shows the image that was just rendered in the window.
         glfwSwapBuffers(m_window);
 
+        // Input wakes the scheduler by itself; other changes to the state and the animations
+        // (rotation, and the moving lights of the fancy shading) have to ask for frames.
+        string state = AppState::dump(m_state);
+        if (state != m_drawn_state) {
+            m_drawn_state = std::move(state);
+            m_scheduler.requestFrames();
+        }
+        m_scheduler.setAnimating(m_continuous_rendering || m_state.is_rotating || m_state.shading_toggle);
+        m_scheduler.setMaxFps(float(m_max_fps));
+
         // make sure keyboard input goes to the main window at startup
         if ( uFrameNumber == 0 )
             ImGui::SetWindowFocus(nullptr);
@@ -336,10 +361,12 @@ void App::render(const AppState& state, int window_width, int window_height, vec
     m_shader_program->use();
     //glUniform1i(m_gl.shading_toggle_uniform, shading_toggle_);
     m_shader_program->setUniform("bShading", state.shading_toggle ? 1 : 0);
+    m_shader_program->setUniform("bInstanced", 0);
     // Pass transforms and camera/time uniforms for shading
-    m_shader_program->setUniform("uWorldToClip", world_to_clip);
-    m_shader_program->setUniform("uTime", (float)glfwGetTime());
-    m_shader_program->setUniform("uCameraPos", camPos);
+    FrameUniforms frame = { world_to_clip, camPos, (float)glfwGetTime() };
+    glBindBuffer(GL_UNIFORM_BUFFER, m_gl.frame_uniform_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
     // Draw the reference plane. It is already in world coordinates.
     Matrix4f identity = Matrix4f::Identity();
@@ -373,12 +400,76 @@ void App::render(const AppState& state, int window_width, int window_height, vec
     // Normal matrix = inverse transpose of upper-left 3x3 of modelToWorld
     Matrix3f normalMat = modelToWorld.block<3,3>(0,0).inverse().transpose();
     m_shader_program->setUniform("uNormalMatrix", normalMat);
-    glBindVertexArray(m_gl.dynamic_vao);
-    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)m_vertex_count);
+    if (m_instance_count > 1) {
+        if (m_placements.size() != size_t(m_instance_count))
+            placeInstances();
+        size_t drawn = drawInstances(world_to_clip, modelToWorld);
+        vecStatusMessages.push_back(fmt::format("Instances drawn: {} of {}", drawn, m_instance_count));
+    }
+    else if (m_cluster_culling) {
+        if (m_clusters.empty() && m_vertex_count > 0) {
+            // Culling was just turned on: cluster the mesh that is on the GPU.
+            vector<Vertex> vertices(m_vertex_count);
+            glBindBuffer(GL_ARRAY_BUFFER, m_gl.dynamic_vertex_buffer);
+            glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex) * vertices.size(), vertices.data());
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            uploadVertices(clusterVertices(vertices));
+        }
+        glBindVertexArray(m_gl.dynamic_vao);
+        // Back faces are drawn here, so only the frustum test applies.
+        static vector<int> visible;
+        static vector<GLint> firsts;
+        static vector<GLsizei> counts;
+        visible.clear();
+        firsts.clear();
+        counts.clear();
+        m_clusters.cull(world_to_clip * modelToWorld, Vector3f::Zero(), false, visible);
+        size_t triangles = 0;
+        for (int i : visible) {
+            const auto& c = m_clusters.clusters()[i];
+            firsts.push_back(3 * c.first);
+            counts.push_back(3 * c.count);
+            triangles += c.count;
+        }
+        glMultiDrawArrays(GL_TRIANGLES, firsts.data(), counts.data(), (GLsizei)visible.size());
+        vecStatusMessages.push_back(fmt::format("Clusters drawn: {} of {} ({} of {} triangles)", visible.size(), m_clusters.clusters().size(),
+                                                triangles, m_vertex_count / 3));
+    }
+    else {
+        glBindVertexArray(m_gl.dynamic_vao);
+        glDrawArrays(GL_TRIANGLES, 0, (GLsizei)m_vertex_count);
+    }
+
+    if (m_pick_triangle && m_instance_count == 1 && !m_indexed_mesh.triangles.empty()) {
+        if (m_ray_query_dirty) {
+            vector<Vector3i> indices;
+            indices.reserve(m_indexed_mesh.triangles.size());
+            for (auto const& t : m_indexed_mesh.triangles)
+                indices.push_back(Vector3i(t[0], t[1], t[2]));
+            m_ray_query.build(m_indexed_mesh.positions, indices);
+            m_ray_query_dirty = false;
+        }
+
+        // Unproject the cursor at the near and far planes straight into model space, so the
+        // hierarchy never needs to be transformed.
+        double x, y; glfwGetCursorPos(m_window, &x, &y);
+        int w, h; glfwGetWindowSize(m_window, &w, &h);
+        Vector2f ndc(2.0f * float(x) / float(std::max(w, 1)) - 1.0f, 1.0f - 2.0f * float(y) / float(std::max(h, 1)));
+        Matrix4f clip_to_model = (world_to_clip * modelToWorld).inverse();
+        Vector4f n = clip_to_model * Vector4f(ndc.x(), ndc.y(), -1.0f, 1.0f);
+        Vector4f f = clip_to_model * Vector4f(ndc.x(), ndc.y(), 1.0f, 1.0f);
+        Vector3f o = n.head<3>() / n.w();
+        RayHit hit;
+        if (m_ray_query.closestHit(o, f.head<3>() / f.w() - o, 1.0f, hit))
+            vecStatusMessages.push_back(fmt::format("Cursor is over triangle {} of {}", hit.triangle, m_indexed_mesh.triangles.size()));
+        else
+            vecStatusMessages.push_back("Cursor is not over the model");
+    }
 
     // Undo our bindings.
     glBindVertexArray(0);
     glUseProgram(0);
+    glCheck("render");
 
     // Show status messages. You may find it useful to show some debug information in a message.
     Vector3f camPosDbg = camera_to_world.block(0, 3, 3, 1);
@@ -670,6 +761,52 @@ vector<App::Vertex> App::generateConeMesh()
 }
 
 void App::uploadGeometryToGPU(const std::vector<Vertex>& vertices) const {
+    // bounding sphere for culling the instances; they are placed again for the new size
+    Vector3f lo = Vector3f::Constant(INFINITY), hi = Vector3f::Constant(-INFINITY);
+    for (const auto& v : vertices) {
+        lo = lo.cwiseMin(v.position);
+        hi = hi.cwiseMax(v.position);
+    }
+    m_model_center = vertices.empty() ? Vector3f::Zero() : Vector3f(0.5f * (lo + hi));
+    m_model_radius = 0.0f;
+    for (const auto& v : vertices)
+        m_model_radius = std::max(m_model_radius, (v.position - m_model_center).norm());
+    m_placements.clear();
+
+    // Clustering welds and reorders the whole mesh, so it waits until culling is turned on.
+    m_clusters = MeshClusters();
+    if (m_cluster_culling)
+        uploadVertices(clusterVertices(vertices));
+    else
+        uploadVertices(vertices);
+}
+
+// Builds m_clusters and returns the triangles stored cluster by cluster, so that render()
+// can draw each cluster as one range.
+vector<App::Vertex> App::clusterVertices(const std::vector<Vertex>& vertices) const {
+    // Weld the corners so that clusters can grow across shared vertices.
+    vector<Vector3f> positions;
+    vector<Vector3i> indices(vertices.size() / 3);
+    std::unordered_map<PositionKey, int, PositionKeyHash, PositionKeyEq> welded;
+    welded.reserve(vertices.size());
+    for (size_t i = 0; i < 3 * indices.size(); ++i) {
+        const Vector3f& p = vertices[i].position;
+        auto it = welded.emplace(PositionKey{p.x(), p.y(), p.z()}, (int)positions.size());
+        if (it.second)
+            positions.push_back(p);
+        indices[i / 3][i % 3] = it.first->second;
+    }
+    m_clusters.build(positions, indices);
+
+    vector<Vertex> ordered;
+    ordered.reserve(3 * indices.size());
+    for (int t : m_clusters.order())
+        for (int k = 0; k < 3; ++k)
+            ordered.push_back(vertices[3 * t + k]);
+    return ordered;
+}
+
+void App::uploadVertices(const std::vector<Vertex>& vertices) const {
     // Load the vertex buffer to GPU.
     glBindBuffer(GL_ARRAY_BUFFER, m_gl.dynamic_vertex_buffer);
     glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
@@ -677,6 +814,73 @@ void App::uploadGeometryToGPU(const std::vector<Vertex>& vertices) const {
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+// Lays out m_instance_count copies of the model on a grid that fills the cube [-1, 1]^3. Each
+// copy is turned about y by a random angle and scaled to fit inside its cell.
+void App::placeInstances() const
+{
+    int n = std::max(int(std::ceil(std::cbrt(double(m_instance_count)) - 1e-6)), 1);
+    float cell = 2.0f / n;
+    float scale = m_model_radius > 0.0f ? 0.5f * cell / m_model_radius : 1.0f;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> angle(0.0f, 2.0f * float(EIGEN_PI));
+
+    m_placements.resize(m_instance_count);
+    for (int i = 0; i < m_instance_count; ++i) {
+        Vector3f cell_center = Vector3f(float(i % n), float(i / n % n), float(i / (n * n))) * cell + Vector3f::Constant(0.5f * cell - 1.0f);
+        Matrix3f R = Matrix3f(AngleAxis<float>(angle(rng), Vector3f(0, 1, 0)));
+        Matrix4f& M = m_placements[i].to_world;
+        M.setIdentity();
+        M.block<3,3>(0, 0) = scale * R;
+        M.block<3,1>(0, 3) = cell_center - scale * R * m_model_center;
+        m_placements[i].normal_matrix = R / scale;  // inverse transpose of scale * R
+    }
+}
+
+// Culls the copies against the view frustum, writes the visible ones to the instance buffer and
+// draws them with one call. model_to_world moves the whole grid. Returns the number drawn.
+size_t App::drawInstances(const Matrix4f& world_to_clip, const Matrix4f& model_to_world) const
+{
+    // Frustum planes in world space, normalized so that they give distances.
+    Vector4f planes[6];
+    for (int i = 0; i < 3; ++i) {
+        planes[2 * i] = world_to_clip.row(3) + world_to_clip.row(i);
+        planes[2 * i + 1] = world_to_clip.row(3) - world_to_clip.row(i);
+    }
+    for (auto& p : planes)
+        p /= std::max(p.head<3>().norm(), 1e-30f);
+
+    Matrix3f linear = model_to_world.block<3,3>(0, 0);
+    Vector3f translation = model_to_world.block<3,1>(0, 3);
+    Matrix3f normal_matrix = linear.inverse().transpose();
+    float stretch = linear.colwise().norm().maxCoeff();
+
+    m_visible_instances.clear();
+    for (const auto& p : m_placements) {
+        Vector3f center = linear * (p.to_world.block<3,3>(0, 0) * m_model_center + p.to_world.block<3,1>(0, 3)) + translation;
+        float radius = m_model_radius * stretch * p.to_world.block<3,1>(0, 0).norm();
+        bool inside = true;
+        for (const auto& plane : planes)
+            if (plane.head<3>().dot(center) + plane.w() < -radius) {
+                inside = false;
+                break;
+            }
+        if (inside)
+            m_visible_instances.push_back({ model_to_world * p.to_world, normal_matrix * p.normal_matrix });
+    }
+
+    // Orphan the buffer so that the driver need not wait for last frame's draw.
+    glBindBuffer(GL_ARRAY_BUFFER, m_gl.instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * m_visible_instances.size(), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Instance) * m_visible_instances.size(), m_visible_instances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    m_shader_program->setUniform("bInstanced", 1);
+    glBindVertexArray(m_gl.instanced_vao);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, (GLsizei)m_vertex_count, (GLsizei)m_visible_instances.size());
+    m_shader_program->setUniform("bInstanced", 0);
+    return m_visible_instances.size();
+}
+
 void App::setMeshFromFlat(const std::vector<Vertex>& vertices) const
 {
     // Upload as-is
@@ -687,14 +891,11 @@ void App::setMeshFromFlat(const std::vector<Vertex>& vertices) const
     m_indexed_mesh.triangles.clear();
     m_indexed_mesh.positions.reserve(vertices.size());
 
-    struct Key { float x,y,z; };
-    struct KeyHash { size_t operator()(Key const& k) const noexcept { size_t h1 = std::hash<float>()(k.x); size_t h2 = std::hash<float>()(k.y); size_t h3 = std::hash<float>()(k.z); return h1 ^ (h2<<1) ^ (h3<<2);} };
-    struct KeyEq { bool operator()(Key const& a, Key const& b) const noexcept { return a.x==b.x && a.y==b.y && a.z==b.z; } };
-    std::unordered_map<Key, uint32_t, KeyHash, KeyEq> mapIdx;
+    std::unordered_map<PositionKey, uint32_t, PositionKeyHash, PositionKeyEq> mapIdx;
     mapIdx.reserve(vertices.size());
 
     auto getIndex = [&](const Vector3f& p){
-        Key k{p.x(), p.y(), p.z()};
+        PositionKey k{p.x(), p.y(), p.z()};
         auto it = mapIdx.find(k);
         if (it != mapIdx.end()) return it->second;
         uint32_t idx = (uint32_t)m_indexed_mesh.positions.size();
@@ -712,6 +913,7 @@ void App::setMeshFromFlat(const std::vector<Vertex>& vertices) const
     }
 
     m_simplify_target = m_indexed_mesh.triangles.size();
+    m_ray_query_dirty = true;
 }
 
 void App::setMeshFromIndexed(const simplify::IndexedMesh& mesh) const
@@ -732,6 +934,7 @@ void App::setMeshFromIndexed(const simplify::IndexedMesh& mesh) const
     }
     uploadGeometryToGPU(verts);
     m_simplify_target = m_indexed_mesh.triangles.size();
+    m_ray_query_dirty = true;
 }
 
 
@@ -788,8 +991,11 @@ void App::initRendering()
 
         glDeleteVertexArrays(1, &m_gl.static_vao);
         glDeleteVertexArrays(1, &m_gl.dynamic_vao);
+        glDeleteVertexArrays(1, &m_gl.instanced_vao);
         glDeleteBuffers(1, &m_gl.static_vertex_buffer);
         glDeleteBuffers(1, &m_gl.dynamic_vertex_buffer);
+        glDeleteBuffers(1, &m_gl.instance_buffer);
+        glDeleteBuffers(1, &m_gl.frame_uniform_buffer);
     }
 
     // Create vertex attribute objects and buffers for vertex data.
@@ -797,6 +1003,17 @@ void App::initRendering()
     glGenVertexArrays(1, &m_gl.dynamic_vao);
     glGenBuffers(1, &m_gl.static_vertex_buffer);
     glGenBuffers(1, &m_gl.dynamic_vertex_buffer);
+    glGenVertexArrays(1, &m_gl.instanced_vao);
+    glGenBuffers(1, &m_gl.instance_buffer);
+    glGenBuffers(1, &m_gl.frame_uniform_buffer);
+
+    // The per-frame uniforms live in a buffer that stays bound to its binding point.
+    static_assert(sizeof(FrameUniforms) == 80, "FrameUniforms must match the std140 layout of the block");
+    m_shader_program->bindUniformBlock("FrameUniforms", FrameUniformBinding);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_gl.frame_uniform_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FrameUniformBinding, m_gl.frame_uniform_buffer);
 
     // Set up vertex attribute object for static data.
     glBindVertexArray(m_gl.static_vao);
@@ -816,6 +1033,28 @@ void App::initRendering()
     glVertexAttribPointer(m_vertex_input_mapping["aPosition"], 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
     glEnableVertexAttribArray(m_vertex_input_mapping["aNormal"]);
     glVertexAttribPointer(m_vertex_input_mapping["aNormal"], 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
+
+    // The instanced VAO reads the same vertices, and one Instance per copy from the instance
+    // buffer. Matrix attributes take one location per column.
+    static_assert(sizeof(Instance) == sizeof(Matrix4f) + sizeof(Matrix3f), "struct Instance must be tightly packed");
+    glBindVertexArray(m_gl.instanced_vao);
+    glEnableVertexAttribArray(m_vertex_input_mapping["aPosition"]);
+    glVertexAttribPointer(m_vertex_input_mapping["aPosition"], 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+    glEnableVertexAttribArray(m_vertex_input_mapping["aNormal"]);
+    glVertexAttribPointer(m_vertex_input_mapping["aNormal"], 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
+    glBindBuffer(GL_ARRAY_BUFFER, m_gl.instance_buffer);
+    for (GLuint c = 0; c < 4; ++c) {
+        GLuint location = m_vertex_input_mapping["aInstanceToWorld"] + c;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(sizeof(Vector4f) * c));
+        glVertexAttribDivisor(location, 1);
+    }
+    for (GLuint c = 0; c < 3; ++c) {
+        GLuint location = m_vertex_input_mapping["aInstanceNormalMatrix"] + c;
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(sizeof(Matrix4f) + sizeof(Vector3f) * c));
+        glVertexAttribDivisor(location, 1);
+    }
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 }
@@ -21,6 +21,9 @@ using namespace Eigen;      // enables writing "Vector3f" instead of "Eigen::Vec
 #include "image.h"
 #include "Utils.h"
 #include "vec_utils.h"
+#include "ray_query.h"
+#include "mesh_clusters.h"
+#include "frame_scheduler.h"
 
 #include "app_base.h"
 #include "ShaderProgram.h"
@@ -81,6 +84,10 @@ private:
     void                showPlyLoadDialog();
 
     void                uploadGeometryToGPU(const vector<Vertex>& vertices) const;
+    vector<Vertex>      clusterVertices(const vector<Vertex>& vertices) const;
+    void                uploadVertices(const vector<Vertex>& vertices) const;
+    void                placeInstances() const;
+    size_t              drawInstances(const Matrix4f& world_to_clip, const Matrix4f& model_to_world) const;
     void                setMeshFromFlat(const vector<Vertex>& vertices) const;
     void                setMeshFromIndexed(const simplify::IndexedMesh& mesh) const;
 
@@ -99,18 +106,53 @@ private:
     mutable size_t              m_vertex_count = 0;      // VB size in number of vertices.
     mutable simplify::IndexedMesh       m_indexed_mesh;          // Current model in indexed form for simplification
     mutable size_t                      m_simplify_target = 0;   // UI target triangles
+    mutable RayQuery                    m_ray_query;             // Hierarchy over m_indexed_mesh for picking
+    mutable bool                        m_ray_query_dirty = true;
+    bool                                m_pick_triangle = false; // Report the triangle under the cursor
+    mutable MeshClusters                m_clusters;              // Clusters of the vertex buffer, which holds them one after another; empty until culling is on
+    bool                                m_cluster_culling = false; // Draw only the clusters inside the view frustum
+
+    // Instanced scene: m_instance_count copies of the model on a grid, drawn with one call.
+    struct Instance
+    {
+        Matrix4f to_world;
+        Matrix3f normal_matrix;
+    };
+    int                                 m_instance_count = 1;
+    mutable vector<Instance>            m_placements;            // Where each copy sits before the model transform
+    mutable vector<Instance>            m_visible_instances;     // Contents of the instance buffer, rebuilt every frame
+    mutable Vector3f                    m_model_center = Vector3f::Zero(); // Bounding sphere of the model
+    mutable float                       m_model_radius = 0.0f;
+
+    // Uniforms that change once per frame, uploaded to the FrameUniforms block of the shaders in
+    // one go. The members follow the std140 layout of the block.
+    struct FrameUniforms
+    {
+        Matrix4f world_to_clip;
+        Vector3f camera_position;
+        float    time;
+    };
+    static constexpr GLuint FrameUniformBinding = 0;
 
     struct glGeneratedIndices
     {
         GLuint static_vao = 0, dynamic_vao = 0;
         GLuint shader_program_id = 0;
         GLuint static_vertex_buffer = 0, dynamic_vertex_buffer = 0;
+        GLuint instanced_vao = 0, instance_buffer = 0;
+        GLuint frame_uniform_buffer = 0;
     };
 
     glGeneratedIndices  m_gl;
 
     Timer               m_timer;
 
+    // Frames are drawn on input, state changes and animation only; see FrameScheduler.
+    FrameScheduler      m_scheduler;
+    string              m_drawn_state;               // m_state as of the last frame, to notice changes
+    bool                m_continuous_rendering = false;
+    int                 m_max_fps = 0;               // 0 for no cap
+
     // Trackball state
     bool                m_trackball_dragging = false;
     Vector3f            m_arcball_last = Vector3f::Zero();
@@ -6,8 +6,14 @@ in vec3 vNormal;    // from VS
 out vec4 fColor;
 
 uniform int   bShading;     // 0 = basic per-vertex color, 1 = fancy shading
-uniform vec3  uCameraPos;   // camera position in world-space
-uniform float uTime;        // time in seconds for animation
+
+// Per-frame data, shared with the other stage through App::FrameUniforms
+layout(std140) uniform FrameUniforms
+{
+    mat4  uWorldToClip;
+    vec3  uCameraPos;   // camera position in world-space
+    float uTime;        // time in seconds for animation
+};
 
 // Helper: apply simple gamma correction from linear -> sRGB
 vec3 gammaCorrect(vec3 c) {
@@ -3,6 +3,8 @@
 // Vertex attributes
 in vec3 aPosition;
 in vec3 aNormal;
+in mat4 aInstanceToWorld;       // per instance, used instead of the uniforms when bInstanced != 0
+in mat3 aInstanceNormalMatrix;
 
 // Varyings to the fragment shader
 out vec4 vColor;       // used in basic mode (bShading==0)
@@ -10,10 +12,18 @@ out vec3 vWorldPos;    // world-space position for fancy shading
 out vec3 vNormal;      // world-space normal for fancy shading
 
 // Uniforms
+// Per-frame data, shared with the other stage through App::FrameUniforms
+layout(std140) uniform FrameUniforms
+{
+    mat4  uWorldToClip;
+    vec3  uCameraPos;   // camera position in world-space
+    float uTime;        // time in seconds for animation
+};
+
 uniform mat4 uModelToWorld;
-uniform mat4 uWorldToClip;
 uniform int  bShading;
 uniform mat3 uNormalMatrix; // transforms object-space normals to world-space
+uniform int  bInstanced;
 
 const vec3 distinctColors[6] = vec3[6](
     vec3(0, 0, 1), vec3(0, 1, 0), vec3(0, 1, 1),
@@ -22,9 +32,11 @@ const vec3 distinctColors[6] = vec3[6](
 void main()
 {
     // Compute world-space position and normal for per-fragment shading
-    vec4 worldPos4 = uModelToWorld * vec4(aPosition, 1.0);
+    mat4 modelToWorld = bInstanced != 0 ? aInstanceToWorld : uModelToWorld;
+    mat3 normalMatrix = bInstanced != 0 ? aInstanceNormalMatrix : uNormalMatrix;
+    vec4 worldPos4 = modelToWorld * vec4(aPosition, 1.0);
     vWorldPos = worldPos4.xyz;
-    vNormal = normalize(uNormalMatrix * aNormal);
+    vNormal = normalize(normalMatrix * aNormal);
 
     // In basic mode, pass a distinct vertex color; in fancy mode, fragment shader ignores this
     vColor = vec4(distinctColors[gl_VertexID % 6], 1.0);
@@ -17,14 +17,32 @@
 #ifdef VERTEX_SHADER
 	uniform mat4 uViewProjMatrix;
 	
-	layout(location=0) in vec4 aPositionSize;
-	layout(location=1) in vec4 aColor;
+	#if defined(FRAMES)
+	 // instanced glyph: each instance is a frame, each line of the glyph one of its axes
+		uniform float uFrameLength;
+		uniform float uFrameSize;
+		
+		layout(location=0) in vec4 aAxisTip; // xyz selects the axis, w is 0 at the origin and 1 at the tip
+		layout(location=2) in vec3 aOrigin;
+		layout(location=3) in vec3 aAxis0;
+		layout(location=4) in vec3 aAxis1;
+		layout(location=5) in vec3 aAxis2;
+	#else
+		layout(location=0) in vec4 aPositionSize;
+		layout(location=1) in vec4 aColor;
+	#endif
 	
 	out VertexData vData;
 	
 	void main() 
 	{
-		vData.m_color = aColor.abgr; // swizzle to correct endianness
+		#if defined(FRAMES)
+			vec3 axis = aAxisTip.x * aAxis0 + aAxisTip.y * aAxis1 + aAxisTip.z * aAxis2;
+			vec4 aPositionSize = vec4(aOrigin + aAxisTip.w * uFrameLength * axis, uFrameSize);
+			vData.m_color = vec4(aAxisTip.y, aAxisTip.z, aAxisTip.x, 1.0); // axes 0, 1, 2 are blue, red, green
+		#else
+			vData.m_color = aColor.abgr; // swizzle to correct endianness
+		#endif
 		#if !defined(TRIANGLES)
 			vData.m_color.a *= smoothstep(0.0, 1.0, aPositionSize.w / kAntialiasing);
 		#endif
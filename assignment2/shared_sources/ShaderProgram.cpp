@@ -29,6 +29,7 @@
 
 #include "glad/gl_core_33.h"
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <fmt/core.h>
@@ -77,7 +78,51 @@ GLint ShaderProgram::getAttribLoc(const string& name) const
 
 GLint ShaderProgram::getUniformLoc(const string& name) const
 {
-    return glGetUniformLocation(m_glProgram, name.c_str());
+    auto it = m_uniformLocs.find(name);
+    if (it != m_uniformLocs.end())
+        return it->second;
+    // Only the first element of an array is in the table.
+    return name.find('[') != string::npos ? glGetUniformLocation(m_glProgram, name.c_str()) : -1;
+}
+
+//------------------------------------------------------------------------
+
+bool ShaderProgram::bindUniformBlock(const string& name, GLuint binding)
+{
+    GLuint index = glGetUniformBlockIndex(m_glProgram, name.c_str());
+    if (index == GL_INVALID_INDEX)
+        return false;
+    glUniformBlockBinding(m_glProgram, index, binding);
+    return true;
+}
+
+//------------------------------------------------------------------------
+
+// Looks up the location of every active uniform once, so that setting a uniform by name costs
+// a hash lookup instead of a call into the driver. Uniforms in blocks have no location.
+void ShaderProgram::reflectUniforms(void)
+{
+    m_uniformLocs.clear();
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(m_glProgram, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(m_glProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    string name;
+    for (GLint i = 0; i < count; ++i)
+    {
+        name.resize(std::max(maxLength, 1));
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(m_glProgram, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+        name.resize(length);
+        GLint loc = glGetUniformLocation(m_glProgram, name.c_str());
+        if (loc < 0)
+            continue;
+        m_uniformLocs[name] = loc;
+        // arrays are reported as "name[0]" but are usually set as "name"
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+            m_uniformLocs[name.substr(0, name.size() - 3)] = loc;
+    }
 }
 
 //------------------------------------------------------------------------
@@ -178,4 +223,5 @@ void ShaderProgram::init(
     // Link.
 
     linkGLProgram(m_glProgram);
+    reflectUniforms();
 }
@@ -30,6 +30,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <Eigen/Dense>
 
 #define FW_GL_SHADER_SOURCE(CODE) #CODE
@@ -53,7 +54,8 @@ public:
 
 	GLuint          getHandle(void) const { return m_glProgram; }
 	GLint           getAttribLoc(const std::string& name) const;
-	GLint           getUniformLoc(const std::string& name) const;
+	GLint           getUniformLoc(const std::string& name) const;   // from a table filled at link time
+	bool            bindUniformBlock(const std::string& name, GLuint binding);
 
     void            setUniform(int loc, int v) { if (loc >= 0) glUniform1i(loc, v); }
     void            setUniform(int loc, float v) { if (loc >= 0) glUniform1f(loc, v); }
@@ -102,6 +104,7 @@ private:
 	void            init(const std::string& vertexSource,
 						 GLenum geomInputType, GLenum geomOutputType, int geomVerticesOut, const std::string& geometrySource,
 						 const std::string& fragmentSource);
+	void            reflectUniforms(void);
 
 private:
 	ShaderProgram(const ShaderProgram&) = delete; // forbidden
@@ -112,4 +115,5 @@ private:
 	GLuint          m_glGeometryShader;
 	GLuint          m_glFragmentShader;
 	GLuint          m_glProgram;
+	std::unordered_map<std::string, GLint> m_uniformLocs;
 };
@@ -25,6 +25,16 @@ void fail(const string& reason)
 
 //------------------------------------------------------------------------
 
+#ifdef CS_C3100_GL_DEBUG
+void checkGLErrors(const char* what, const char* file, int line)
+{
+    for (GLenum err = glGetError(); err != GL_NO_ERROR; err = glGetError())
+        cerr << fmt::format("OpenGL error 0x{:04x} after {} ({}:{})", err, what, file, line) << endl;
+}
+#endif
+
+//------------------------------------------------------------------------
+
 string fileOpenDialog(const string& fileTypeName, const string& fileExtensions)
 {
     NFD_Init();
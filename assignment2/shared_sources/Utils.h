@@ -20,6 +20,16 @@ template <typename T, std::size_t N>
 char (&static_sizeof_array( T(&)[N] ))[N];   // declared, not defined
 #define SIZEOF_ARRAY( x ) sizeof(static_sizeof_array(x))
 
+// glGetError() waits for the driver to process every command queued so far, so the checks are
+// only compiled in when CS_C3100_GL_DEBUG is defined. glCheck(what) reports the errors raised
+// since the previous check.
+#ifdef CS_C3100_GL_DEBUG
+void checkGLErrors(const char* what, const char* file, int line);
+#define glCheck(what) checkGLErrors(what, __FILE__, __LINE__)
+#else
+#define glCheck(what) ((void)0)
+#endif
+
 
 inline string GetGLTypeString(GLenum type)
 {
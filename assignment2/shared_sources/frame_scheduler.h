@@ -0,0 +1,55 @@
+#pragma once
+
+// Decides when the main loop draws a frame. Rather than polling for events and rendering
+// continuously, waitForNextFrame() sleeps in glfwWaitEventsTimeout() until a frame is needed:
+//
+//  - input: any event wakes the wait, and a few more frames follow so that ImGui, which
+//    reacts to input one frame late, settles,
+//  - a state change or anything else the app reports with requestFrames(),
+//  - an animation, for as long as setAnimating(true) is in effect,
+//  - background work, which gets a frame every BackgroundInterval seconds while
+//    setBackgroundWork(true) is in effect so that its results are picked up.
+//
+// An optional cap limits how often frames start. The scheduler also measures how much CPU
+// time the process uses, which is what an idle viewer should keep close to zero.
+class FrameScheduler
+{
+public:
+    static constexpr double BackgroundInterval = 0.1;
+
+    // Returns when the next frame should be drawn, with all pending events processed.
+    void        waitForNextFrame();
+
+    void        requestFrames(int count = 1);
+    void        setAnimating(bool animating)        { m_animating = animating; }
+    void        setBackgroundWork(bool busy)        { m_background = busy; }
+    // Frames start at most max_fps times per second; 0 for no limit.
+    void        setMaxFps(float max_fps)            { m_max_fps = max_fps; }
+
+    // Averages over the last second or more, ending at the start of the current frame. After
+    // an idle period they cover the whole period.
+    float       cpuUsage() const                    { return m_cpu_usage; }     // CPU seconds per second, all threads
+    float       frameRate() const                   { return m_frame_rate; }
+
+private:
+    // ImGui updates hover and active states in the frame after the input that causes them.
+    static constexpr int SettleFrames = 3;
+    // Without background work, waits wake up this often only to check the state again.
+    static constexpr double IdleTimeout = 1.0;
+    // A wait that ends less than this early is taken to have timed out, not to have been woken.
+    static constexpr double TimerSlack = 1e-3;
+
+    void        waitUntil(double time);
+
+    bool        m_animating = false;
+    bool        m_background = false;
+    float       m_max_fps = 0.0f;
+    int         m_requested = SettleFrames;     // the first frames are drawn without input
+    double      m_last_frame = 0.0;
+
+    double      m_window_start = -1.0;          // wall and CPU time at the start of the measurement
+    double      m_window_cpu = 0.0;
+    int         m_window_frames = 0;
+    float       m_cpu_usage = 0.0f;
+    float       m_frame_rate = 0.0f;
+};
@@ -7,6 +7,8 @@
 #include "glad/gl_core_33.h"                // OpenGL
 #include "im3d.h"
 #include <fmt/core.h>
+#include <algorithm>
+#include <cstring>
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>             // Window manager
@@ -28,7 +30,20 @@ static GLuint g_Im3dVertexBuffer;
 static GLuint g_Im3dShaderPoints;
 static GLuint g_Im3dShaderLines;
 static GLuint g_Im3dShaderTriangles;
+static GLuint g_Im3dShaderFrames;
 static AppData g_appData;
+
+// Draw lists are streamed through g_Im3dVertexBuffer as a ring of kIm3dFramesInFlight segments, one
+// per frame. A frame maps its segment unsynchronized, which is safe because the fence set after the
+// segment was last drawn from has been waited on, so the driver neither reallocates the storage
+// nor stalls on the draws of the previous frame. The segments only grow, by reallocating the whole
+// buffer, when a frame streams more than fits.
+static const int kIm3dFramesInFlight = 3;
+static GLsizeiptr g_Im3dSegmentBytes = 0;
+static GLsync g_Im3dSegmentFences[kIm3dFramesInFlight] = {};
+static int g_Im3dSegment = 0;
+static size_t g_Im3dBytesStreamed = 0;
+
 static Matrix4f g_modelToClip = Matrix4f::Zero();
 
 
@@ -39,6 +54,9 @@ namespace Im3d
     const char* GetGlEnumString(GLenum _enum);
     const char* GlGetString(GLenum _name);
 
+// Checking every call stalls the pipeline, so outside CS_C3100_GL_DEBUG builds the calls are
+// only made.
+#ifdef CS_C3100_GL_DEBUG
 #define glAssert(call) \
         do { \
             (call); \
@@ -47,6 +65,9 @@ namespace Im3d
                 fail(fmt::format("glAssert failed: {}, {}, {}, {}", #call, __FILE__, __LINE__, Im3d::GetGlEnumString(err))); \
             } \
         } while (0)
+#else
+#define glAssert(call) do { (call); } while (0)
+#endif
 } // namespace Im3d
 
 
@@ -98,6 +119,30 @@ bool Im3d_Init()
         }
     }
 
+    {	GLuint vs = LoadCompileShader(GL_VERTEX_SHADER,   CS3100_IM3D_GLSL, "VERTEX_SHADER\0LINES\0FRAMES\0");
+        GLuint gs = LoadCompileShader(GL_GEOMETRY_SHADER, CS3100_IM3D_GLSL, "GEOMETRY_SHADER\0LINES\0");
+        GLuint fs = LoadCompileShader(GL_FRAGMENT_SHADER, CS3100_IM3D_GLSL, "FRAGMENT_SHADER\0LINES\0");
+        if (vs && gs && fs)
+        {
+            glAssert(g_Im3dShaderFrames = glCreateProgram());
+            glAssert(glAttachShader(g_Im3dShaderFrames, vs));
+            glAssert(glAttachShader(g_Im3dShaderFrames, gs));
+            glAssert(glAttachShader(g_Im3dShaderFrames, fs));
+            bool ret = LinkShaderProgram(g_Im3dShaderFrames);
+            glAssert(glDeleteShader(vs));
+            glAssert(glDeleteShader(gs));
+            glAssert(glDeleteShader(fs));
+            if (!ret)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
     {	GLuint vs = LoadCompileShader(GL_VERTEX_SHADER,   CS3100_IM3D_GLSL, "VERTEX_SHADER\0TRIANGLES\0");
         GLuint fs = LoadCompileShader(GL_FRAGMENT_SHADER, CS3100_IM3D_GLSL, "FRAGMENT_SHADER\0TRIANGLES\0");
         if (vs && fs)
@@ -136,9 +181,13 @@ void Im3d_Shutdown()
 {
     glAssert(glDeleteVertexArrays(1, &g_Im3dVertexArray));
     glAssert(glDeleteBuffers(1, &g_Im3dVertexBuffer));
+    for (GLsync& fence : g_Im3dSegmentFences)
+        if (fence)
+            glAssert(glDeleteSync(fence));
     glAssert(glDeleteProgram(g_Im3dShaderPoints));
     glAssert(glDeleteProgram(g_Im3dShaderLines));
     glAssert(glDeleteProgram(g_Im3dShaderTriangles));
+    glAssert(glDeleteProgram(g_Im3dShaderFrames));
 }
 
 // At the top of each frame, the application must fill the Im3d::AppData struct and then call Im3d::NewFrame().
@@ -231,7 +280,55 @@ void Im3d_EndFrame()
     glAssert(glDisable(GL_CULL_FACE));
 
     //glAssert(glViewport(0, 0, (GLsizei)g_Example->m_width, (GLsizei)g_Example->m_height));
-        
+
+    // Copy all draw lists of the frame into this frame's segment of the ring with one mapping.
+    GLsizeiptr frameBytes = 0;
+    for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
+        frameBytes += (GLsizeiptr)Im3d::GetDrawLists()[i].m_vertexCount * sizeof(Im3d::VertexData);
+    g_Im3dBytesStreamed = (size_t)frameBytes;
+
+    glAssert(glBindBuffer(GL_ARRAY_BUFFER, g_Im3dVertexBuffer));
+    GLsync& fence = g_Im3dSegmentFences[g_Im3dSegment];
+    if (frameBytes > g_Im3dSegmentBytes)
+    {
+     // grow to whole vertices so that every segment starts at a vertex; nothing can be in flight from the old storage
+        GLsizeiptr vertices = std::max<GLsizeiptr>(2 * frameBytes, 1 << 20) / sizeof(Im3d::VertexData);
+        g_Im3dSegmentBytes = vertices * sizeof(Im3d::VertexData);
+        glAssert(glBufferData(GL_ARRAY_BUFFER, kIm3dFramesInFlight * g_Im3dSegmentBytes, nullptr, GL_STREAM_DRAW));
+        for (GLsync& f : g_Im3dSegmentFences)
+            if (f)
+            {
+                glAssert(glDeleteSync(f));
+                f = nullptr;
+            }
+    }
+    else if (fence)
+    {
+     // normally signaled long ago, kIm3dFramesInFlight - 1 frames have been swapped since
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glAssert(glDeleteSync(fence));
+        fence = nullptr;
+    }
+
+    GLint segmentFirst = (GLint)(g_Im3dSegment * (g_Im3dSegmentBytes / sizeof(Im3d::VertexData)));
+    if (frameBytes > 0)
+    {
+        void* dst = nullptr;
+        glAssert(dst = glMapBufferRange(GL_ARRAY_BUFFER, g_Im3dSegment * g_Im3dSegmentBytes, frameBytes,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+        char* out = (char*)dst;
+        for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
+        {
+            const Im3d::DrawList& drawList = Im3d::GetDrawLists()[i];
+            size_t bytes = drawList.m_vertexCount * sizeof(Im3d::VertexData);
+            memcpy(out, drawList.m_vertexData, bytes);
+            out += bytes;
+        }
+        glAssert(glUnmapBuffer(GL_ARRAY_BUFFER));
+    }
+
+    GLint first = segmentFirst;
     for (U32 i = 0, n = Im3d::GetDrawListCount(); i < n; ++i)
     {
         const Im3d::DrawList& drawList = Im3d::GetDrawLists()[i];
@@ -266,16 +363,19 @@ void Im3d_EndFrame()
         };
     
         glAssert(glBindVertexArray(g_Im3dVertexArray));
-        glAssert(glBindBuffer(GL_ARRAY_BUFFER, g_Im3dVertexBuffer));
-        glAssert(glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)drawList.m_vertexCount * sizeof(Im3d::VertexData), (GLvoid*)drawList.m_vertexData, GL_STREAM_DRAW));
     
         AppData& ad = GetAppData();
         glAssert(glUseProgram(sh));
         glAssert(glUniform2f(glGetUniformLocation(sh, "uViewport"), ad.m_viewportSize.x, ad.m_viewportSize.y));
         glAssert(glUniformMatrix4fv(glGetUniformLocation(sh, "uViewProjMatrix"), 1, false, (const GLfloat*)g_modelToClip.data()));
-        glAssert(glDrawArrays(prim, 0, (GLsizei)drawList.m_vertexCount));
+        glAssert(glDrawArrays(prim, first, (GLsizei)drawList.m_vertexCount));
+        first += (GLint)drawList.m_vertexCount;
     }
 
+    if (frameBytes > 0)
+        glAssert(fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+    g_Im3dSegment = (g_Im3dSegment + 1) % kIm3dFramesInFlight;
+
     glAssert(glBindVertexArray(0));
     glAssert(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
@@ -289,6 +389,66 @@ void Im3d_EndFrame()
     //g_Example->drawTextDrawListsImGui(Im3d::GetTextDrawLists(), Im3d::GetTextDrawListCount());
 }
 
+// Bytes of draw list vertices that the last Im3d_EndFrame() streamed to the GPU.
+size_t Im3d_BytesStreamed()
+{
+    return g_Im3dBytesStreamed;
+}
+
+// Geometry that does not change from frame to frame can be kept in the application's own vertex
+// buffers and drawn with the functions below, which use the shaders and blend state of
+// Im3d_EndFrame() so that it looks the same as geometry drawn through Im3d. They use the camera
+// and viewport given to Im3d_NewFrame().
+static void BeginRetained(GLuint _shader)
+{
+    AppData& ad = GetAppData();
+    glAssert(glEnable(GL_BLEND));
+    glAssert(glBlendEquation(GL_FUNC_ADD));
+    glAssert(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+    glAssert(glEnable(GL_PROGRAM_POINT_SIZE));
+    glAssert(glDisable(GL_CULL_FACE));
+    glAssert(glUseProgram(_shader));
+    glAssert(glUniform2f(glGetUniformLocation(_shader, "uViewport"), ad.m_viewportSize.x, ad.m_viewportSize.y));
+    glAssert(glUniformMatrix4fv(glGetUniformLocation(_shader, "uViewProjMatrix"), 1, false, (const GLfloat*)g_modelToClip.data()));
+}
+
+static void EndRetained()
+{
+    glAssert(glBindVertexArray(0));
+    glAssert(glUseProgram(0));
+    glAssert(glDisable(GL_BLEND));
+    glAssert(glDisable(GL_PROGRAM_POINT_SIZE));
+    glAssert(glEnable(GL_CULL_FACE));
+}
+
+// Draws GL_POINTS, GL_LINES or GL_LINE_STRIP ranges of a vertex buffer holding Im3d::VertexData,
+// all with one call. The vertex array must set up attributes 0 and 1 like g_Im3dVertexArray.
+void Im3d_DrawVertexArray(GLenum prim, GLuint vao, const GLint* first, const GLsizei* count, GLsizei draws)
+{
+    if (draws == 0)
+        return;
+    BeginRetained(prim == GL_POINTS ? g_Im3dShaderPoints : g_Im3dShaderLines);
+    glAssert(glBindVertexArray(vao));
+    glAssert(glMultiDrawArrays(prim, first, count, draws));
+    EndRetained();
+}
+
+// Draws a coordinate frame glyph per instance: a line of the given length along each of the three
+// axes, colored blue, red and green. Attribute 0 of the vertex array is the glyph, a GL_LINES list
+// of (axis selector, 0 at the origin or 1 at the tip), and attributes 2 to 5 are the origin and
+// the three axes of each instance.
+void Im3d_DrawFrameGlyphs(GLuint vao, GLsizei glyph_vertices, GLsizei instances, float length, float size)
+{
+    if (instances == 0)
+        return;
+    BeginRetained(g_Im3dShaderFrames);
+    glAssert(glUniform1f(glGetUniformLocation(g_Im3dShaderFrames, "uFrameLength"), length));
+    glAssert(glUniform1f(glGetUniformLocation(g_Im3dShaderFrames, "uFrameSize"), size));
+    glAssert(glBindVertexArray(vao));
+    glAssert(glDrawArraysInstanced(GL_LINES, 0, glyph_vertices, instances));
+    EndRetained();
+}
+
 namespace Im3d
 {
 #define IM3D_STRINGIFY_(_t) #_t
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <vector>
+#include <cstddef>
+
+// A triangle mesh split into small clusters of neighboring triangles, each with a bounding sphere
+// and a cone that contains the normals of its triangles, so that the renderer can skip clusters
+// that are outside the view frustum or face away from the camera without looking at their
+// triangles.
+//
+// Clusters are grown greedily from seeds taken in Morton order of the triangle centers. A cluster
+// takes, among the triangles that share a vertex with it, the one whose normal deviates least from
+// the cluster's and that lies closest to its center, until it holds max_triangles triangles or
+// has no neighbors left. Flat, compact clusters give tight cones, so more of them can be culled.
+class MeshClusters
+{
+public:
+    struct Cluster
+    {
+        Eigen::Vector3f center = Eigen::Vector3f::Zero();       // bounding sphere of the triangles
+        float           radius = 0.0f;
+        Eigen::Vector3f cone_axis = Eigen::Vector3f::Zero();    // average normal
+        float           cone_cutoff = -1.0f;    // cosine of the widest normal from the axis; <= 0 disables the cone test
+        int             first = 0;              // first entry of order()
+        int             count = 0;
+    };
+
+    // Clusters the triangles of the mesh. The triangles are not moved: order() lists them cluster
+    // by cluster, and an index buffer written in that order has each cluster as one range.
+    void                build(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices, int max_triangles = 128);
+
+    // Appends the clusters that may be visible through model_to_clip to visible. camera is the
+    // eye in the same space as the positions. With backfaces, clusters whose triangles all face
+    // away from the camera are left out as well, which is only right when the renderer culls
+    // back faces and front faces are counter-clockwise.
+    void                cull(const Eigen::Matrix4f& model_to_clip, const Eigen::Vector3f& camera, bool backfaces, std::vector<int>& visible) const;
+
+    const std::vector<Cluster>& clusters() const    { return m_clusters; }
+    const std::vector<int>&     order() const       { return m_order; }
+    bool                        empty() const       { return m_clusters.empty(); }
+
+private:
+    std::vector<Cluster>    m_clusters;
+    std::vector<int>        m_order;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <vector>
+#include <cfloat>
+#include <cstddef>
+
+// Intersection of a ray with a triangle mesh. The hit point is (1 - u - v) * p0 + u * p1 + v * p2
+// for the triangle's vertices p0, p1, p2, and triangle is -1 if nothing was hit.
+struct RayHit
+{
+    int     triangle = -1;
+    float   t = FLT_MAX;
+    float   u = 0.0f;
+    float   v = 0.0f;
+};
+
+// Ray casts against a triangle mesh: closest hits for picking, any hits for visibility and
+// ambient occlusion. Rays are o + t * d with 0 < t < t_max, and triangles are hit from both sides.
+//
+// The mesh is organized in a bounding volume hierarchy with four children per node. It is first
+// built as a binary tree with binned surface area heuristic splits, and then every node absorbs
+// its grandchildren, largest first, until it has four children. The four child boxes of a node
+// are stored as one array per coordinate, as are the triangles of a leaf, four at a time, so one
+// ray is tested against all four with a single set of SIMD operations (Eigen's Array4f maps to
+// SSE or NEON). The batch queries turn this around: four consecutive rays are traced together,
+// each box and triangle being tested against all four of them at once, which pays off when the
+// rays are coherent, like the rays through neighboring pixels or from one point.
+//
+// When the vertices move but the triangles stay the same, refit() recomputes the boxes without
+// changing the tree. That is much faster than build(), but the tree gets worse the further the
+// vertices move from where it was built.
+class RayQuery
+{
+public:
+    void                build(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices);
+    void                refit(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices);
+
+    // Finds the closest triangle. Returns false if there is none.
+    bool                closestHit(const Eigen::Vector3f& o, const Eigen::Vector3f& d, float t_max, RayHit& hit) const;
+    // Returns true as soon as any triangle is found, which is cheaper.
+    bool                anyHit(const Eigen::Vector3f& o, const Eigen::Vector3f& d, float t_max) const;
+
+    // The same for many rays, in parallel. Ray k is origins[k] + t * directions[k].
+    void                closestHits(const std::vector<Eigen::Vector3f>& origins, const std::vector<Eigen::Vector3f>& directions, float t_max, std::vector<RayHit>& hits) const;
+    void                anyHits(const std::vector<Eigen::Vector3f>& origins, const std::vector<Eigen::Vector3f>& directions, float t_max, std::vector<char>& occluded) const;
+
+    size_t              numTriangles() const    { return m_num_triangles; }
+    size_t              memoryBytes() const;
+
+    // Set by whoever moves the vertices, so that the next user refits first.
+    bool                stale = false;
+
+private:
+    struct Node
+    {
+        Eigen::Array4f  lo[3], hi[3];   // child boxes, one array per coordinate
+        int             child[4];       // inner child: node index; leaf child: first packet
+        int             count[4];       // leaf child: number of packets; inner child: 0
+        int             num_children;
+    };
+
+    // Four triangles as one vertex and two edges each. Unused slots have index -1 and zero
+    // edges, which no ray hits.
+    struct TrianglePacket
+    {
+        Eigen::Array4f  p0[3], e1[3], e2[3];
+        int             index[4];
+    };
+
+    struct RayPacket;
+
+    template <bool AnyHit> bool trace(const Eigen::Vector3f& o, const Eigen::Vector3f& d, float t_max, RayHit& hit) const;
+    template <bool AnyHit> void trace(RayPacket& rays) const;
+
+    std::vector<Node>           m_nodes;
+    std::vector<TrianglePacket> m_packets;
+    size_t                      m_num_triangles = 0;
+};
@@ -2,6 +2,7 @@
 
 #include "app.h"
 #include "subdiv.h"
+#include "subdiv_gpu.h"
 
 #include <fmt/core.h>
 
@@ -29,6 +30,7 @@ void Im3d_NewFrame(GLFWwindow* window,
     float mousex,
     float mousey);
 void Im3d_EndFrame();
+size_t Im3d_BytesStreamed();
 namespace Im3d
 {
     inline void Vertex(const Vector3f& v) { Im3d::Vertex(v(0), v(1), v(2)); }
@@ -152,7 +154,8 @@ void App::run(const filesystem::path savePNGAndTerminate)
         // your own debug information from there if you like.
         vecStatusMessages.clear();
 
-        glfwPollEvents();
+        // Sleeps until there is something new to draw.
+        m_scheduler.waitForNextFrame();
 
         // Rebuild font atlas if necessary
         if (m_font_atlas_dirty)
@@ -196,6 +199,9 @@ void App::run(const filesystem::path savePNGAndTerminate)
             m_state.mode = DrawMode::Subdivision_R3;
         if (ImGui::RadioButton("Subdivision Mode - R3 & R4 only (4)", m_state.mode == DrawMode::Subdivision_R3_R4))
             m_state.mode = DrawMode::Subdivision_R3_R4;
+        ImGui::Checkbox("Pick through ID buffer", &m_id_buffer_picking);
+        ImGui::Checkbox("Render continuously", &m_continuous_rendering);
+        ImGui::SliderInt("Max frame rate", &m_max_fps, 0, 240, m_max_fps > 0 ? "%d" : "off");
 
 
         if (m_state.mode == DrawMode::Curves)
@@ -208,6 +214,19 @@ void App::run(const filesystem::path savePNGAndTerminate)
                 ImGui::Checkbox("Render wireframe (W)", &m_state.wireframe);
                 ImGui::Checkbox("Render curve frames (F)", &m_state.draw_frames);
             }
+            // Ray marched isosurfaces have no mesh, so the isovalue can be changed interactively.
+            bool has_volumes = false;
+            for (size_t i = 0; i < m_render_cache.volumes.size(); ++i) {
+                if (!m_render_cache.volumes[i])
+                    continue;
+                const auto& vol = *m_render_cache.volumes[i];
+                auto& isos = m_render_cache.surfaces[i].isos;
+                for (size_t k = 0; k < isos.size(); ++k)
+                    ImGui::SliderFloat(fmt::format("Isovalue {}.{}", i, k).c_str(), &isos[k], vol.minValue(), vol.maxValue());
+                has_volumes = true;
+            }
+            if (has_volumes)
+                ImGui::SliderFloat("Ray march step (voxels)", &m_raymarch_step, 0.1f, 2.0f);
 
             // Curve editor UI
             ImGui::Separator();
@@ -314,6 +333,60 @@ void App::run(const filesystem::path savePNGAndTerminate)
             ImGui::Checkbox("Render wireframe (W)", &m_state.wireframe);
             ImGui::Checkbox("Show connectivity (D)", &m_debug_subdivision);
             ImGui::Checkbox("Crude boundary handling (B)", &m_state.crude_boundaries);
+            if (ImGui::Checkbox("Angle-weighted normals", &m_angle_weighted_normals)) {
+                auto& meshes = m_render_cache.subdivided_meshes;
+                for (auto& m : meshes) {
+                    if (!m)
+                        continue;
+                    m->normal_weighting = m_angle_weighted_normals ? NormalWeighting::Angle : NormalWeighting::Area;
+                    m->computeVertexNormals();
+                }
+                // a level built in the background would have the old normals
+                m_render_cache.prefetch.cancel();
+                if (m_render_cache.stream_patches)
+                    m_render_cache.streamed_level = -1;
+                else if (!m_render_cache.show_limit && !m_render_cache.adaptive && m_render_cache.subdivision < meshes.size())
+                    uploadGeometryToGPU(*meshes[m_render_cache.subdivision]);
+            }
+            if (ImGui::Checkbox("Deform control mesh", &m_deform_control_mesh) && !m_deform_control_mesh) {
+                restoreSubdivisionSurface();
+                auto& meshes = m_render_cache.subdivided_meshes;
+                if (!m_render_cache.show_limit && !m_render_cache.adaptive && !m_render_cache.stream_patches && m_render_cache.subdivision < meshes.size())
+                    uploadGeometryToGPU(*meshes[m_render_cache.subdivision]);
+            }
+            if (m_deform_control_mesh) {
+                ImGui::SliderFloat("Deformation amplitude", &m_deform_amplitude, 0.0f, 1.0f);
+                ImGui::Checkbox("Evaluate stencils on GPU", &m_gpu_stencil_evaluation);
+            }
+            if (m_state.mode == DrawMode::Subdivision) {
+                ImGui::Checkbox("Show limit surface", &m_limit_surface);
+                if (m_limit_surface)
+                    ImGui::SliderInt("Limit tessellation rate", &m_limit_rate, 1, 32);
+                ImGui::Checkbox("Adaptive subdivision", &m_adaptive_subdivision);
+                if (m_adaptive_subdivision) {
+                    ImGui::SliderFloat("Adaptive tolerance", &m_adaptive_tolerance, 1e-5f, 1e-1f, "%.5f", ImGuiSliderFlags_Logarithmic);
+                    ImGui::SliderFloat("Max edge length (pixels)", &m_adaptive_max_pixels, 0.0f, 100.0f, m_adaptive_max_pixels > 0.0f ? "%.0f" : "off");
+                    // the screen size criterion uses the view at the time of the refinement
+                    if (m_adaptive_max_pixels > 0.0f && ImGui::Button("Refine for current view"))
+                        m_render_cache.adaptive_mesh.reset();
+                }
+            }
+            ImGui::Checkbox("Stream patches to GPU", &m_stream_patches);
+            ImGui::Checkbox("Cull mesh clusters", &m_cluster_culling);
+            ImGui::SliderInt("Level cache budget (MB)", &m_level_cache_budget_mb, 16, 8192);
+            if (ImGui::TreeNode("Level cache")) {
+                const auto& meshes = m_render_cache.subdivided_meshes;
+                const auto& stencils = m_render_cache.subdivision_stencils;
+                for (size_t k = 0; k < meshes.size(); ++k) {
+                    float stencil_mb = float(stencilBytes(stencils[k])) / float(1 << 20);
+                    if (meshes[k])
+                        ImGui::Text("Level %d: %.1f MB mesh%s, %.1f MB stencil", (int)k, float(meshes[k]->memoryBytes()) / float(1 << 20),
+                                    meshes[k]->hasConnectivity() ? " with connectivity" : "", stencil_mb);
+                    else
+                        ImGui::Text("Level %d: evicted, %.1f MB stencil", (int)k, stencil_mb);
+                }
+                ImGui::TreePop();
+            }
         }
 
 
@@ -332,6 +405,7 @@ void App::run(const filesystem::path savePNGAndTerminate)
         // Draw the status messages in the current list
         // Note that you can add them from inside render(...)
         vecStatusMessages.push_back(fmt::format("Application average {:.3f} ms/frame ({:.1f} FPS)", 1000.0f / m_io->Framerate, m_io->Framerate));
+        vecStatusMessages.push_back(fmt::format("Drawn {:.1f} frames/s, CPU {:.0f}% of a core", m_scheduler.frameRate(), 100.0f * m_scheduler.cpuUsage()));
         for (const string& msg : vecStatusMessages)
             ImGui::Text("%s", msg.c_str());
 
@@ -346,6 +420,20 @@ void App::run(const filesystem::path savePNGAndTerminate)
 
         // This shows the image that was just rendered in the window.
         glfwSwapBuffers(m_window);
+
+        // Input wakes the scheduler by itself. State changes, the deformation animation and
+        // the jobs whose results update_render_cache() picks up have to ask for frames.
+        string state = AppState::dump(m_state);
+        if (state != m_drawn_state) {
+            m_drawn_state = std::move(state);
+            m_scheduler.requestFrames();
+        }
+        bool background = m_render_cache.prefetch.level() >= 0 && !m_render_cache.prefetch.ready();
+        for (const auto& iso : m_render_cache.isosurfaces)
+            background = background || (iso && !iso->finished());
+        m_scheduler.setAnimating(m_continuous_rendering || m_deform_control_mesh);
+        m_scheduler.setBackgroundWork(background);
+        m_scheduler.setMaxFps(float(m_max_fps));
     }
 
     // Cleanup
@@ -391,25 +479,51 @@ void App::update_render_cache(const AppState& state) const {
             auto parsed = nlohmann::json::parse(f);
             parsed.at("curves").get_to(cache.spline_curves);
             parsed.at("surfaces").get_to(cache.surfaces);
+            cache.volumes.clear();
+            cache.isosurfaces.clear();
+            exportIsoSurfaces();
         }
 
 
+        // pick up isosurface levels that finished refining in the background
+        bool refined = false;
+        for (auto& iso : cache.isosurfaces)
+            if (iso && iso->update())
+                refined = true;
+
         if (spline_changed) {
             tessellateCurves(state.spline_tessellation);
             generateSurfaces(state.spline_tessellation);
         }
+        else if (refined)
+            assembleSurfaceMesh();
     }
     else {
 
         // subdivision surfaces change if the mode or edge handling changes
         bool surface_changed = file_changed || (cache.crude_boundaries != state.crude_boundaries) || (cache.mode != state.mode);
+        // the limit surface replaces the subdivision levels; it is only defined for the full Loop rules
+        bool show_limit = m_limit_surface && state.mode == DrawMode::Subdivision;
+        bool limit_changed = (cache.show_limit != show_limit) || (show_limit && cache.limit_rate != m_limit_rate);
+        // adaptive refinement also evaluates the limit surface, so it needs the full Loop rules too;
+        // the chosen level is its maximum depth
+        bool adaptive = m_adaptive_subdivision && state.mode == DrawMode::Subdivision && !show_limit;
+        // streamed levels only ever exist in the GPU buffers
+        bool stream_patches = m_stream_patches && !show_limit && !adaptive;
         // the mesh to be displayed changes if the subdivision surface itself changes or if a different level is chosen
-        bool mesh_changed = surface_changed || (cache.subdivision != state.subdivision);
+        bool mesh_changed = surface_changed || limit_changed || (cache.adaptive != adaptive) || (cache.stream_patches != stream_patches) || (cache.subdivision != state.subdivision);
+
+        // a deformed level goes back to rest before it is replaced or hidden
+        if (mesh_changed)
+            restoreSubdivisionSurface();
 
         // set cached values to match
         cache.crude_boundaries = state.crude_boundaries;
         cache.mode = state.mode;
         cache.subdivision = state.subdivision;
+        cache.show_limit = show_limit;
+        cache.adaptive = adaptive;
+        cache.stream_patches = stream_patches;
 
         if (file_changed)
             loadOBJ(state.filename);
@@ -417,15 +531,82 @@ void App::update_render_cache(const AppState& state) const {
         // if load fails, we'll have zero meshes
         if (cache.subdivided_meshes.size() > 0) {
 
-            if (surface_changed)
+            if (surface_changed) {
+                cache.prefetch.cancel();
+                cache.pick_queries.clear();
+                cache.derived_pick_query.reset();
                 cache.subdivided_meshes.resize(1);
+                cache.subdivision_stencils.resize(1);
+                cache.control_stencil_level = -1;
+                cache.limit_mesh.reset();
+                cache.adaptive_mesh.reset();
+            }
 
-            while (cache.subdivided_meshes.size() <= state.subdivision)
-                addSubdivisionLevel(state.mode, state.crude_boundaries);
+            if (show_limit) {
+                // evaluated straight from the control mesh, so no levels need to be built
+                if (!cache.limit_mesh || cache.limit_rate != m_limit_rate) {
+                    cache.limit_mesh.reset(LoopLimitEvaluator(*cache.subdivided_meshes[0]).tessellate(m_limit_rate));
+                    cache.limit_rate = m_limit_rate;
+                }
+                if (mesh_changed) {
+                    uploadGeometryToGPU(*cache.limit_mesh);
+                    cache.derived_pick_query.reset();
+                }
+                return;
+            }
 
-            if (mesh_changed) {
-                uploadGeometryToGPU(*cache.subdivided_meshes[state.subdivision]);
+            if (adaptive) {
+                if (!cache.adaptive_mesh || cache.adaptive_level != int(state.subdivision) ||
+                    cache.adaptive_tolerance != m_adaptive_tolerance || cache.adaptive_max_pixels != m_adaptive_max_pixels) {
+                    AdaptiveSubdivisionSettings settings;
+                    settings.max_level = int(state.subdivision);
+                    settings.tolerance = m_adaptive_tolerance;
+                    settings.max_pixels = m_adaptive_max_pixels;
+                    if (m_adaptive_max_pixels > 0.0f) {
+                        // the viewport of the previous frame, which is the one being looked at
+                        GLint viewport[4];
+                        glGetIntegerv(GL_VIEWPORT, viewport);
+                        settings.world_to_clip = state.camera.GetPerspective() * state.camera.GetModelview();
+                        settings.viewport_width = float(viewport[2]);
+                        settings.viewport_height = float(viewport[3]);
+                    }
+                    cache.adaptive_mesh.reset(adaptiveLoopSubdivision(LoopLimitEvaluator(*cache.subdivided_meshes[0]), settings));
+                    cache.adaptive_level = int(state.subdivision);
+                    cache.adaptive_tolerance = m_adaptive_tolerance;
+                    cache.adaptive_max_pixels = m_adaptive_max_pixels;
+                    mesh_changed = true;
+                }
+                if (mesh_changed) {
+                    uploadGeometryToGPU(*cache.adaptive_mesh);
+                    cache.derived_pick_query.reset();
+                }
+                return;
+            }
+
+            if (stream_patches) {
+                // subdivided patch by patch straight into the vertex and index buffers, without
+                // building the level on the CPU
+                if (mesh_changed || cache.streamed_level != int(state.subdivision)) {
+                    PatchStreamer streamer(*cache.subdivided_meshes[0], state.mode, state.crude_boundaries);
+                    bool ok = streamer.streamToGPU(int(state.subdivision), m_gl.vertex_buffer, m_gl.index_buffer);
+                    cache.streamed_triangles = ok ? streamer.numTriangles(int(state.subdivision)) : 0;
+                    cache.streamed_level = int(state.subdivision);
+                    if (ok)
+                        setVertexLayout(streamer.numVertices(int(state.subdivision)));
+                }
+                return;
             }
+
+            MeshWithConnectivity& shown = subdivisionLevel(int(state.subdivision));
+            trimLevelCache();
+
+            if (mesh_changed)
+                uploadGeometryToGPU(shown);
+
+            if (m_deform_control_mesh && state.subdivision > 0)
+                deformSubdivisionSurface(m_deform_amplitude, float(glfwGetTime()));
+            else
+                prefetchNextLevel();
         }
     }
 }
@@ -458,6 +639,9 @@ void App::render(const AppState& state, int window_width, int window_height, vec
     double mousex, mousey;
     glfwGetCursorPos(m_window, &mousex, &mousey);
     Im3d_NewFrame(m_window, window_width, window_height, state.camera.GetModelview(), state.camera.GetPerspective(), 0.01f, mousex, mousey);
+    updateFrameUniforms(state.camera);
+    if (Im3d_BytesStreamed() > 0)
+        vecStatusMessages.push_back(fmt::format("Im3d streamed {:.1f} KB last frame", Im3d_BytesStreamed() / 1024.0));
     // Reset edit selection when mode changes to keep sane state
     if (state.mode != DrawMode::Curves) { m_curve_edit_mode = false; m_dragging_point = false; }
 
@@ -465,28 +649,83 @@ void App::render(const AppState& state, int window_width, int window_height, vec
     {
     case DrawMode::Curves:
             renderCurves(state.draw_frames);
-            if(cache.surfaces.size()>0 && state.show_surface)
+            if (m_curve_edit_mode && m_id_buffer_picking && m_edit_curve_idx >= 0 && m_edit_curve_idx < (int)cache.spline_curves.size())
+            {
+                // handleMouseButton() takes the control point under the cursor from this pass
+                double mx, my;
+                glfwGetCursorPos(m_window, &mx, &my);
+                ImVec2 fbScale = ImGui::GetIO().DisplayFramebufferScale;
+                Matrix4f world_to_clip = state.camera.GetPerspective() * state.camera.GetModelview();
+                m_id_picker.drawPoints(cache.spline_curves[m_edit_curve_idx].control_points, m_pick_radius_pixels * fbScale.x,
+                                       world_to_clip, window_width, window_height, mx * fbScale.x, my * fbScale.y);
+            }
+            if(cache.surfaces.size()>0 && state.show_surface) {
                 renderMesh(cache.surface_mesh, state.camera, state.wireframe, -1, -1);
+                for (size_t i = 0; i < cache.volumes.size(); ++i)
+                    if (cache.volumes[i])
+                        for (float iso : cache.surfaces[i].isos)
+                            cache.volumes[i]->render(state.camera, iso, m_raymarch_step);
+            }
             break;
 
     case DrawMode::Subdivision:
     case DrawMode::Subdivision_R3:
     case DrawMode::Subdivision_R3_R4:
-        if (cache.subdivided_meshes.size() > 0)
+        if (cache.stream_patches)
+        {
+            drawGeometry(state.camera, cache.streamed_triangles);
+            vecStatusMessages.push_back(fmt::format("Streamed triangles: {}", cache.streamed_triangles));
+        }
+        else if (cache.subdivided_meshes.size() > 0)
         {
-            const MeshWithConnectivity& m = *cache.subdivided_meshes[state.subdivision];
+            MeshWithConnectivity& m = cache.show_limit ? *cache.limit_mesh :
+                                      cache.adaptive ? *cache.adaptive_mesh : *cache.subdivided_meshes[state.subdivision];
+            if (cache.adaptive)
+                vecStatusMessages.push_back(fmt::format("Adaptive triangles: {} (uniform level {}: {})", m.indices.size(), state.subdivision,
+                                                        cache.subdivided_meshes[0]->indices.size() << (2 * state.subdivision)));
 
             // check if mouse is on top of a triangle and show debug info if requested
             int highlight_triangle = -1;
             int highlight_vertex = -1;
             if (m_debug_subdivision)
             {
+                // cached levels that are no longer refined drop their connectivity
+                if (!m.hasConnectivity())
+                    m.computeConnectivity();
+
                 double mx, my;
                 glfwGetCursorPos(m_window, &mx, &my);
                 ImVec2 fbScale = ImGui::GetIO().DisplayFramebufferScale; // Mac Retina specific
-                std::tuple<int,int> tri_vertex_ind = pickTriangle(m, state.camera, window_width, window_height, mx * fbScale.x, my * fbScale.y);
-                highlight_triangle = std::get<0>(tri_vertex_ind);
-                highlight_vertex = std::get<1>(tri_vertex_ind);
+                if (m_id_buffer_picking)
+                {
+                    // the pass reads the vertex buffer that renderMesh() draws from, so it also
+                    // sees the surface when the GPU deforms it
+                    Matrix4f world_to_clip = state.camera.GetPerspective() * state.camera.GetModelview();
+                    m_id_picker.drawTriangles(m_gl.vao, m.indices.size(), world_to_clip, window_width, window_height, mx * fbScale.x, my * fbScale.y);
+                    const IdBufferPicker::Pick& pick = m_id_picker.latest();
+                    // a pick from before the mesh changed may not name one of its vertices
+                    if (pick.kind == IdBufferPicker::Kind::Triangles && pick.id >= 0 && pick.id < (int)m.indices.size())
+                        for (int k = 0; k < 3; ++k)
+                            if (m.indices[pick.id](k) == pick.vertex) {
+                                highlight_triangle = pick.id;
+                                highlight_vertex = k;
+                            }
+                }
+                else
+                {
+                    // each level keeps its own hierarchy; the limit and adaptive meshes share one
+                    unique_ptr<RayQuery>* query = &cache.derived_pick_query;
+                    if (!cache.show_limit && !cache.adaptive) {
+                        if (cache.pick_queries.size() <= state.subdivision)
+                            cache.pick_queries.resize(state.subdivision + 1);
+                        query = &cache.pick_queries[state.subdivision];
+                    }
+                    if (!*query)
+                        query->reset(new RayQuery());
+                    std::tuple<int,int> tri_vertex_ind = pickTriangle(m, **query, state.camera, window_width, window_height, mx * fbScale.x, my * fbScale.y);
+                    highlight_triangle = std::get<0>(tri_vertex_ind);
+                    highlight_vertex = std::get<1>(tri_vertex_ind);
+                }
 
                 Vector3f pos(Vector3f::Zero());
 			    Vector3f norm(Vector3f::Zero());
@@ -506,6 +745,9 @@ void App::render(const AppState& state, int window_width, int window_height, vec
             }
 
             renderMesh(m, state.camera, state.wireframe, highlight_triangle, highlight_vertex);
+            if (m_cluster_culling && !m_deform_control_mesh)
+                vecStatusMessages.push_back(fmt::format("Clusters drawn: {} of {} ({} of {} triangles)", cache.drawn_clusters, cache.clusters.clusters().size(),
+                                                        cache.drawn_cluster_triangles, m.indices.size()));
         }
         break;
 	}
@@ -514,36 +756,33 @@ void App::render(const AppState& state, int window_width, int window_height, vec
     Im3d_EndFrame();
 }
 
-void App::renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool include_wireframe, int highlight_triangle, int highlight_vertex) const
+// Fills the FrameUniforms block for the current camera. The lighting is the same every frame.
+void App::updateFrameUniforms(const Camera& cam) const
 {
-    Matrix4f world_to_view = cam.GetModelview();
-    Matrix4f view_to_clip = cam.GetPerspective();
-    Matrix4f view_to_world = world_to_view.inverse();
-    Vector3f camera_position = view_to_world.block(0, 3, 3, 1);
+    FrameUniforms u = {};
+    u.world_to_view = cam.GetModelview();
+    u.view_to_clip = cam.GetPerspective();
+    u.world_to_clip = u.view_to_clip * u.world_to_view;
+    u.camera_world_position = u.world_to_view.inverse().block(0, 3, 3, 1);
+    u.ambient_strength = 0.2f;
+    u.specular_strength = 0.55f;
+    u.shininess = 48.0f;
+    u.rim_strength = 0.35f;
+    u.rim_color = Vector3f(0.55f, 0.70f, 0.90f);
+    u.specular_color = Vector3f(1.0f, 1.0f, 1.0f);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, m_gl.frame_uniform_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &u);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
+// Draws the first num_triangles triangles of the vertex and index buffers with the mesh shader.
+// With clusters, draws only the clusters that pass MeshClusters::cull(), from cluster_index_buffer.
+// The camera and lights come from the FrameUniforms block; cam is only used for culling.
+void App::drawGeometry(const Camera& cam, size_t num_triangles, const MeshClusters* clusters) const
+{
     glUseProgram(m_gl.shader_program);
-    auto err = glGetError();
     glUniform1f(m_gl.shading_toggle_uniform, true ? 1.0f : 0.0f);
-    err = glGetError();
-    glUniformMatrix4fv(m_gl.view_to_clip_uniform, 1, GL_FALSE, view_to_clip.data());
-    err = glGetError();
-    glUniformMatrix4fv(m_gl.world_to_view_uniform, 1, GL_FALSE, world_to_view.data());
-    err = glGetError();
-    glUniform3fv(m_gl.camera_world_position_uniform, 1, camera_position.data());
-    err = glGetError();
-    glUniform1f(m_gl.ambient_strength_uniform, 0.2f);
-    err = glGetError();
-    glUniform1f(m_gl.specular_strength_uniform, 0.55f);
-    err = glGetError();
-    glUniform1f(m_gl.shininess_uniform, 48.0f);
-    err = glGetError();
-    glUniform1f(m_gl.rim_strength_uniform, 0.35f);
-    err = glGetError();
-    glUniform3f(m_gl.rim_color_uniform, 0.55f, 0.70f, 0.90f);
-    err = glGetError();
-    glUniform3f(m_gl.specular_color_uniform, 1.0f, 1.0f, 1.0f);
-    err = glGetError();
-
 
     // Draw the model with your model-to-world transformation.
     // Force opaque rendering for solid look
@@ -551,32 +790,75 @@ void App::renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool incl
     glDepthMask(GL_TRUE);
     glBindVertexArray(m_gl.vao);
     glBindBuffer(GL_ARRAY_BUFFER, m_gl.vertex_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
-    glDrawElements(GL_TRIANGLES, (GLsizei)3 * m.indices.size(), GL_UNSIGNED_INT, 0);
+    if (clusters)
+    {
+        // one range of cluster_index_buffer per visible cluster, in a single call
+        static vector<int> visible;
+        static vector<GLsizei> counts;
+        static vector<const GLvoid*> offsets;
+        visible.clear();
+        counts.clear();
+        offsets.clear();
+        Matrix4f world_to_view = cam.GetModelview();
+        Vector3f camera_position = world_to_view.inverse().block(0, 3, 3, 1);
+        clusters->cull(cam.GetPerspective() * world_to_view, camera_position, true, visible);
+        size_t triangles = 0;
+        for (int i : visible) {
+            const auto& c = clusters->clusters()[i];
+            counts.push_back(3 * c.count);
+            offsets.push_back((const GLvoid*)(sizeof(Vector3i) * c.first));
+            triangles += c.count;
+        }
+        m_render_cache.drawn_clusters = visible.size();
+        m_render_cache.drawn_cluster_triangles = triangles;
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.cluster_index_buffer);
+        glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), (GLsizei)visible.size());
+        // the picker and the wireframe draw from the VAO with the original triangle numbers
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
+    }
+    else
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
+        glDrawElements(GL_TRIANGLES, (GLsizei)(3 * num_triangles), GL_UNSIGNED_INT, 0);
+    }
 
     // Undo our bindings.
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     glUseProgram(0);
+    glCheck("drawGeometry");
+}
 
-    if (include_wireframe || (highlight_triangle != -1 && m_debug_subdivision))
+void App::renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool include_wireframe, int highlight_triangle, int highlight_vertex) const
+{
+    // The bounds come from the uploaded positions, which a deformation moves on every frame.
+    const MeshClusters* clusters = nullptr;
+    auto& cache = m_render_cache;
+    if (m_cluster_culling && !m_deform_control_mesh)
     {
-        static vector<size_t> only_highlighted_triangle({0});
-        static vector<size_t> all_triangles;
-        if (all_triangles.size() != m.indices.size())
+        if (cache.clusters_stale)
         {
-            all_triangles.resize(m.indices.size());
-            for (size_t i = 0; i < m.indices.size(); ++i)
-                all_triangles[i] = i;
-        }
-        const vector<size_t>* index_list = &all_triangles;
-        if (!include_wireframe && highlight_triangle != -1 && m_debug_subdivision)
-        {
-            only_highlighted_triangle[0] = highlight_triangle;
-            index_list = &only_highlighted_triangle;
+            cache.clusters.build(m.positions, m.indices);
+            vector<Vector3i> reordered;
+            reordered.reserve(m.indices.size());
+            for (int t : cache.clusters.order())
+                reordered.push_back(m.indices[t]);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.cluster_index_buffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Vector3i) * reordered.size(), reordered.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+            cache.clusters_stale = false;
         }
+        clusters = &cache.clusters;
+    }
+    drawGeometry(cam, m.indices.size(), clusters);
+
+    if (include_wireframe)
+        drawWireframe(m_gl.vao, m.indices.size(), m_debug_subdivision ? highlight_triangle : -1);
 
+    if (highlight_triangle != -1 && m_debug_subdivision)
+    {
         Im3d::BeginPoints();
         if(m_debug_indices.size() && m_toggle_onering && highlight_triangle != -1){
             Im3d::SetSize(16.0f);
@@ -607,17 +889,12 @@ void App::renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool incl
         }
         Im3d::End();
 
-        Im3d::BeginLines();
-        for (size_t j = 0; j < index_list->size(); ++j)
+        // with the wireframe on, drawWireframe() has already drawn the triangle wider
+        if (!include_wireframe)
         {
-            size_t i = (*index_list)[j];
-
-            const Vector3i& f = m.indices[i];
-
-            if (i == highlight_triangle)
-                Im3d::SetSize(8.0f);
-            else
-                Im3d::SetSize(2.0f);
+            Im3d::BeginLines();
+            const Vector3i& f = m.indices[highlight_triangle];
+            Im3d::SetSize(8.0f);
 
             // prepare a slightly smaller triangle so that we can code its edges with colors
             auto v0 = m.positions[f[0]];
@@ -642,8 +919,8 @@ void App::renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool incl
             Im3d::SetColor(0.0f, 0.0f, 1.0f);   // 3rd edge: blue
             Im3d::Vertex(nv2);
             Im3d::Vertex(nv0);
+            Im3d::End();
         }
-        Im3d::End();
     }
 }
 
@@ -662,18 +939,21 @@ void App::initRendering()
     glGenVertexArrays(1, &m_gl.vao);
     glGenBuffers(1, &m_gl.vertex_buffer);
     glGenBuffers(1, &m_gl.index_buffer);
+    glGenBuffers(1, &m_gl.cluster_index_buffer);
+
+    // The per-frame uniforms stay bound to their binding point; updateFrameUniforms() fills them.
+    glGenBuffers(1, &m_gl.frame_uniform_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_gl.frame_uniform_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FrameUniformBinding, m_gl.frame_uniform_buffer);
 
-    // Set up vertex attribute object
+    // Set up vertex attribute object. The attribute pointers depend on the vertex count
+    // and are set in uploadGeometryToGPU().
     glBindVertexArray(m_gl.vao);
-    glBindBuffer(GL_ARRAY_BUFFER, m_gl.vertex_buffer);
     glEnableVertexAttribArray(ATTRIB_POSITION);
-    glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPNC), (GLvoid*)0);
     glEnableVertexAttribArray(ATTRIB_NORMAL);
-    glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPNC), (GLvoid*)offsetof(VertexPNC, normal));
     glEnableVertexAttribArray(ATTRIB_COLOR);
-    glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPNC), (GLvoid*)offsetof(VertexPNC, color));
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
     glBindVertexArray(0);
 
@@ -681,6 +961,7 @@ void App::initRendering()
     auto shader_program = new ShaderProgram(
         "#version 330\n"
         "#extension GL_ARB_separate_shader_objects : enable\n"
+        FRAME_UNIFORMS_GLSL
         FW_GL_SHADER_SOURCE(
             layout(location = 0) in vec4 aPosition;
             layout(location = 1) in vec3 aNormal;
@@ -690,8 +971,6 @@ void App::initRendering()
             layout(location = 1) out vec3 vNormal;
             layout(location = 2) out vec4 vColor;
 
-            uniform mat4 uWorldToView;
-            uniform mat4 uViewToClip;
             uniform float uShading;
 
             void main()
@@ -704,19 +983,12 @@ void App::initRendering()
         ),
         "#version 330\n"
         "#extension GL_ARB_separate_shader_objects : enable\n"
+        FRAME_UNIFORMS_GLSL
         FW_GL_SHADER_SOURCE(
             layout(location = 0) in vec3 vWorldPos;
             layout(location = 1) in vec3 vNormal;
             layout(location = 2) in vec4 vColor;
 
-            uniform vec3 uCameraWorldPosition;
-            uniform float uAmbientStrength;
-            uniform float uSpecularStrength;
-            uniform float uShininess;
-            uniform float uRimStrength;
-            uniform vec3 uRimColor;
-            uniform vec3 uSpecularColor;
-
             const vec3 cLightDirection1 = normalize(vec3(0.5, 0.5, 0.6));
             const vec3 cLightDirection2 = normalize(vec3(-1, 0, 0));
             const vec3 cLightColor1 = vec3(1, 1, 1);
@@ -764,16 +1036,8 @@ void App::initRendering()
 
     // Get the IDs of the shader program and its uniform input locations from OpenGL.
     m_gl.shader_program = shader_program->getHandle();
-    m_gl.view_to_clip_uniform = glGetUniformLocation(m_gl.shader_program, "uViewToClip");
-    m_gl.world_to_view_uniform = glGetUniformLocation(m_gl.shader_program, "uWorldToView");
-    m_gl.shading_toggle_uniform = glGetUniformLocation(m_gl.shader_program, "uShading");
-    m_gl.camera_world_position_uniform = glGetUniformLocation(m_gl.shader_program, "uCameraWorldPosition");
-    m_gl.ambient_strength_uniform = glGetUniformLocation(m_gl.shader_program, "uAmbientStrength");
-    m_gl.specular_strength_uniform = glGetUniformLocation(m_gl.shader_program, "uSpecularStrength");
-    m_gl.shininess_uniform = glGetUniformLocation(m_gl.shader_program, "uShininess");
-    m_gl.rim_strength_uniform = glGetUniformLocation(m_gl.shader_program, "uRimStrength");
-    m_gl.rim_color_uniform = glGetUniformLocation(m_gl.shader_program, "uRimColor");
-    m_gl.specular_color_uniform = glGetUniformLocation(m_gl.shader_program, "uSpecularColor");
+    m_gl.shading_toggle_uniform = shader_program->getUniformLoc("uShading");
+    shader_program->bindUniformBlock("FrameUniforms", FrameUniformBinding);
 }
 
 //------------------------------------------------------------------------
@@ -799,8 +1063,21 @@ void App::loadOBJ(const string& filename) const
 {
     // get rid of the old meshes, if any
     m_render_cache.subdivided_meshes.clear();
+    m_render_cache.subdivision_stencils.assign(1, SubdivisionStencil());
+    m_render_cache.control_stencil_level = -1;
+    m_render_cache.deformed_level = -1;
+    m_render_cache.gpu_stencil.reset();
+    m_render_cache.limit_mesh.reset();
+    m_render_cache.adaptive_mesh.reset();
+    m_render_cache.prefetch.cancel();
+    m_render_cache.pick_queries.clear();
+    m_render_cache.derived_pick_query.reset();
 
     auto pNewMesh = MeshWithConnectivity::loadOBJ(filename, m_state.crude_boundaries);
+    if (m_angle_weighted_normals) {
+        pNewMesh->normal_weighting = NormalWeighting::Angle;
+        pNewMesh->computeVertexNormals();
+    }
 
     // hoist it into GPU memory...
     uploadGeometryToGPU(*pNewMesh);
@@ -813,70 +1090,310 @@ void App::loadOBJ(const string& filename) const
 
 void App::addSubdivisionLevel(DrawMode mode, bool crude_boundaries) const
 {
-    // copy constuct finest mesh
-    MeshWithConnectivity* pNewMesh = new MeshWithConnectivity(*m_render_cache.subdivided_meshes.back());
-    pNewMesh->LoopSubdivision(mode, crude_boundaries);
+    auto& meshes = m_render_cache.subdivided_meshes;
+    MeshWithConnectivity& parent = *meshes.back();
+
+    // copy the vertex and index data of the finest mesh; its connectivity is moved instead,
+    // as the parent is not refined again (the control mesh keeps its own)
+    MeshWithConnectivity* pNewMesh = new MeshWithConnectivity();
+    pNewMesh->positions = parent.positions;
+    pNewMesh->normals = parent.normals;
+    pNewMesh->colors = parent.colors;
+    pNewMesh->ages = parent.ages;
+    pNewMesh->indices = parent.indices;
+    pNewMesh->normal_weighting = parent.normal_weighting;
+    if (meshes.size() == 1) {
+        pNewMesh->neighborTris = parent.neighborTris;
+        pNewMesh->neighborEdges = parent.neighborEdges;
+    } else {
+        pNewMesh->neighborTris.swap(parent.neighborTris);
+        pNewMesh->neighborEdges.swap(parent.neighborEdges);
+    }
+    if (!pNewMesh->hasConnectivity())
+        pNewMesh->computeConnectivity();
+
+    // LoopSubdivision already recomputes the vertex normals
+    m_render_cache.subdivision_stencils.emplace_back();
+    pNewMesh->LoopSubdivision(mode, crude_boundaries, &m_render_cache.subdivision_stencils.back());
     pNewMesh->computeConnectivity();
-    pNewMesh->computeVertexNormals();
-    m_render_cache.subdivided_meshes.push_back(unique_ptr<MeshWithConnectivity>(pNewMesh));
+    meshes.push_back(unique_ptr<MeshWithConnectivity>(pNewMesh));
+}
+
+// Returns the given subdivision level, building it if it has never been built and
+// regenerating it if trimLevelCache() evicted it.
+MeshWithConnectivity& App::subdivisionLevel(int level) const
+{
+    auto& cache = m_render_cache;
+    auto& meshes = cache.subdivided_meshes;
+    while (int(meshes.size()) <= level) {
+        unique_ptr<MeshWithConnectivity> prefetched;
+        SubdivisionStencil stencil;
+        if (cache.prefetch.take(int(meshes.size()), prefetched, stencil)) {
+            meshes.push_back(std::move(prefetched));
+            cache.subdivision_stencils.push_back(std::move(stencil));
+        }
+        else
+            addSubdivisionLevel(cache.mode, cache.crude_boundaries);
+    }
+
+    if (!meshes[level]) {
+        // start from the nearest cached level below; the stencils are never evicted, so only
+        // the meshes are rebuilt
+        int base = level - 1;
+        while (!meshes[base])
+            --base;
+        MeshWithConnectivity* pMesh = new MeshWithConnectivity(*meshes[base]);
+        for (int k = base + 1; k <= level; ++k) {
+            if (!pMesh->hasConnectivity())
+                pMesh->computeConnectivity();
+            pMesh->LoopSubdivision(cache.mode, cache.crude_boundaries);
+            pMesh->releaseConnectivity();
+        }
+        meshes[level].reset(pMesh);
+    }
+    return *meshes[level];
+}
+
+// Starts building the level after the displayed one in the background if the displayed one is the
+// finest so far, so that stepping up is instant. Skipped if the new level would not fit in the
+// level cache budget; it has four times the triangles of the displayed one.
+void App::prefetchNextLevel() const
+{
+    auto& cache = m_render_cache;
+    auto& meshes = cache.subdivided_meshes;
+    int next = int(meshes.size());
+    if (int(cache.subdivision) != next - 1 || cache.prefetch.level() == next)
+        return;
+    if (4 * meshes.back()->memoryBytes() > size_t(m_level_cache_budget_mb) << 20)
+        return;
+    cache.prefetch.start(*meshes.back(), next, cache.mode, cache.crude_boundaries);
+}
+
+// Keeps the cached subdivision levels within m_level_cache_budget_mb. Levels that are not refined
+// any further drop their connectivity, since drawing them only needs the vertex and index data.
+// If that is not enough, whole levels are evicted, farthest from the displayed one first. The
+// control mesh and the displayed level always stay.
+void App::trimLevelCache() const
+{
+    auto& cache = m_render_cache;
+    auto& meshes = cache.subdivided_meshes;
+    int shown = int(cache.subdivision);
+    int finest = int(meshes.size()) - 1;
+
+    for (int k = 1; k < finest; ++k)
+        if (meshes[k] && !(k == shown && m_debug_subdivision))
+            meshes[k]->releaseConnectivity();
+
+    auto& queries = cache.pick_queries;
+    queries.resize(meshes.size());
+    size_t total = stencilBytes(cache.control_stencil);
+    for (size_t k = 0; k < meshes.size(); ++k)
+        total += (meshes[k] ? meshes[k]->memoryBytes() : 0) + stencilBytes(cache.subdivision_stencils[k]) + (queries[k] ? queries[k]->memoryBytes() : 0);
+
+    // picking hierarchies go before the levels themselves, as they are quicker to rebuild
+    size_t budget = size_t(m_level_cache_budget_mb) << 20;
+    while (total > budget) {
+        int victim = -1;
+        for (int k = 0; k <= finest; ++k)
+            if (queries[k] && k != shown && (victim == -1 || std::abs(k - shown) >= std::abs(victim - shown)))
+                victim = k;
+        if (victim == -1)
+            break;
+        total -= queries[victim]->memoryBytes();
+        queries[victim].reset();
+    }
+    while (total > budget) {
+        int victim = -1;
+        for (int k = 1; k <= finest; ++k)
+            if (meshes[k] && k != shown && (victim == -1 || std::abs(k - shown) >= std::abs(victim - shown)))
+                victim = k;
+        if (victim == -1)
+            break;
+        total -= meshes[victim]->memoryBytes() + (queries[victim] ? queries[victim]->memoryBytes() : 0);
+        meshes[victim].reset();
+        queries[victim].reset();
+    }
+
+    // evicted levels at the end are simply built again by addSubdivisionLevel()
+    while (!meshes.back()) {
+        meshes.pop_back();
+        cache.subdivision_stencils.pop_back();
+        queries.pop_back();
+    }
 }
 
 //------------------------------------------------------------------------
 
-void App::uploadGeometryToGPU(const MeshWithConnectivity& m) const
+// Moves the control vertices along their normals with a travelling wave and evaluates the
+// displayed level from them with the stored stencils. Nothing is subdivided again, so this
+// costs one sparse matrix-vector product plus the vertex normals and runs every frame.
+// On the GPU path the refined vertices are written straight into the vertex buffer, and
+// the CPU copy of the mesh keeps its rest positions.
+void App::deformSubdivisionSurface(float amplitude, float time) const
 {
-    static vector<VertexPNC> v;
-    v.resize(m.positions.size());
-    for (size_t i = 0; i < v.size(); ++i)
-    {
-        v[i].position = m.positions[i];
-        v[i].color = m.colors[i];
-        v[i].normal = m.normals[i];
+    auto& cache = m_render_cache;
+    int level = int(cache.subdivision);
+    const MeshWithConnectivity& control = *cache.subdivided_meshes[0];
+    MeshWithConnectivity& mesh = *cache.subdivided_meshes[level];
+
+    // multiply the per-level stencils into one from the control mesh to the displayed level;
+    // this is only redone when the level changes
+    if (cache.control_stencil_level != level) {
+        cache.control_stencil = cache.subdivision_stencils[1];
+        for (int k = 2; k <= level; ++k) {
+            SubdivisionStencil composed = cache.subdivision_stencils[k] * cache.control_stencil;
+            cache.control_stencil = std::move(composed);
+        }
+        cache.control_stencil_level = level;
+        cache.gpu_stencil.reset();
+    }
+
+    MeshWithConnectivity& deformed = cache.deformed_control;
+    deformed.positions.resize(control.positions.size());
+#pragma omp parallel for
+    for (int v = 0; v < (int)control.positions.size(); ++v) {
+        const Vector3f& p = control.positions[v];
+        deformed.positions[v] = p + amplitude * std::sin(1.5f * p.y() - 3.0f * time) * control.normals[v];
     }
 
-    // Load the vertex buffer to GPU.
+    if (m_gpu_stencil_evaluation && !cache.gpu_stencil) {
+        cache.gpu_stencil.reset(new GpuStencilEvaluator());
+        cache.gpu_stencil->upload(cache.control_stencil);
+    }
+    // an evaluator whose upload failed has no rows; fall back to the CPU then
+    if (m_gpu_stencil_evaluation && cache.gpu_stencil->rows() == int(mesh.positions.size())) {
+        restoreSubdivisionSurface();
+        deformed.indices = control.indices;
+        deformed.normal_weighting = control.normal_weighting;
+        deformed.computeVertexNormals();
+        cache.gpu_stencil->evaluate(deformed.positions, deformed.normals, m_gl.vertex_buffer);
+        return;
+    }
+
+    applyStencil(cache.control_stencil, deformed.positions, mesh.positions);
+    mesh.computeVertexNormals();
+    uploadGeometryToGPU(mesh);
+    cache.deformed_level = level;
+    markPickQueryStale(level);
+}
+
+// Evaluates the deformed level from the undeformed control mesh again.
+void App::restoreSubdivisionSurface() const
+{
+    auto& cache = m_render_cache;
+    if (cache.deformed_level < 0)
+        return;
+
+    MeshWithConnectivity& mesh = *cache.subdivided_meshes[cache.deformed_level];
+    applyStencil(cache.control_stencil, cache.subdivided_meshes[0]->positions, mesh.positions);
+    mesh.computeVertexNormals();
+    markPickQueryStale(cache.deformed_level);
+    cache.deformed_level = -1;
+}
+
+// The vertices of the level moved, so its picking hierarchy is refitted before it is used again.
+void App::markPickQueryStale(int level) const
+{
+    auto& queries = m_render_cache.pick_queries;
+    if (level < int(queries.size()) && queries[level])
+        queries[level]->stale = true;
+}
+
+//------------------------------------------------------------------------
+
+void App::uploadGeometryToGPU(const MeshWithConnectivity& m) const
+{
+    // Load the vertex buffer to GPU. It holds all positions, then all normals, then all
+    // colors instead of interleaving them, so that GpuStencilEvaluator can overwrite the
+    // positions and normals with transform feedback.
+    GLsizeiptr bytes = sizeof(Vector3f) * m.positions.size();
     glBindBuffer(GL_ARRAY_BUFFER, m_gl.vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPNC) * v.size(), v.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, 3 * bytes, nullptr, GL_STATIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, m.positions.data());
+    glBufferSubData(GL_ARRAY_BUFFER, bytes, bytes, m.normals.data());
+    glBufferSubData(GL_ARRAY_BUFFER, 2 * bytes, bytes, m.colors.data());
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    setVertexLayout(m.positions.size());
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.index_buffer);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Vector3i) * m.indices.size(), m.indices.data(), GL_STATIC_DRAW);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    m_render_cache.clusters_stale = true;
+}
+
+// Points the vertex attributes at the planar layout of the vertex buffer: num_vertices
+// positions, then as many normals, then as many colors.
+void App::setVertexLayout(size_t num_vertices) const
+{
+    GLsizeiptr bytes = sizeof(Vector3f) * num_vertices;
+    glBindBuffer(GL_ARRAY_BUFFER, m_gl.vertex_buffer);
+    glBindVertexArray(m_gl.vao);
+    glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+    glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)bytes);
+    glVertexAttribPointer(ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)(2 * bytes));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 //------------------------------------------------------------------------
 
 void MeshWithConnectivity::computeVertexNormals()
 {
-    // Calculate average normal for each vertex position by
-    // looping over triangles, computing their normals,
-    // and adding them to each of its vertices' normal.
+    // Calculate the normal for each vertex by summing the weighted
+    // normals of the triangles around it and normalizing.
 
-    typedef std::map<Vector3f, Vector3f, CompareVector3f> postonormal_t;
-    postonormal_t posToNormal;
-    Vector3f v[3];
+    const int num_tris = (int)indices.size();
+    const int num_verts = (int)positions.size();
 
-    for (size_t j = 0; j < indices.size(); j++)
+    // Weighted face normals; for angle weighting one per corner.
+    vector<Vector3f> corner_normals(3 * size_t(num_tris));
+#pragma omp parallel for
+    for (int t = 0; t < num_tris; ++t)
     {
-        const Vector3i& tri = indices[j];
-        for (int k = 0; k < 3; k++)
-            v[k] = positions[tri[k]];
-
+        const Vector3i& tri = indices[t];
+        Vector3f v[3] = { positions[tri[0]], positions[tri[1]], positions[tri[2]] };
+        // the cross product's length is twice the area, so the plain sum is area weighted
         Vector3f triNormal = (v[1] - v[0]).cross(v[2] - v[0]);
         for (int k = 0; k < 3; k++)
         {
-            if (posToNormal.find(v[k]) != posToNormal.end())
-                posToNormal[v[k]] += triNormal;
+            if (normal_weighting == NormalWeighting::Angle)
+            {
+                Vector3f a = v[(k + 1) % 3] - v[k];
+                Vector3f b = v[(k + 2) % 3] - v[k];
+                float angle = std::atan2(a.cross(b).norm(), a.dot(b));
+                corner_normals[3 * t + k] = triNormal.normalized() * angle;
+            }
             else
-                posToNormal[v[k]] = triNormal;
+                corner_normals[3 * t + k] = triNormal;
         }
     }
 
-    // Output normals. Normalization yields the average of
+    // Vertex -> corner adjacency in compressed rows, so that every vertex can gather
+    // its own sum without atomics or a scatter across threads.
+    vector<int> corner_start(num_verts + 1, 0);
+    for (const auto& tri : indices)
+        for (int k = 0; k < 3; k++)
+            ++corner_start[tri[k] + 1];
+    for (int i = 0; i < num_verts; ++i)
+        corner_start[i + 1] += corner_start[i];
+    vector<int> corners(corner_start[num_verts]);
+    {
+        vector<int> cursor(corner_start.begin(), corner_start.end() - 1);
+        for (int c = 0; c < 3 * num_tris; ++c)
+            corners[cursor[indices[c / 3][c % 3]]++] = c;
+    }
+
+    // Output normals. Normalization yields the weighted average of
     // the normals of all the triangles that share each vertex.
-    for ( size_t i = 0; i < positions.size(); ++i )
+    // Vertices that no triangle uses keep their old normal.
+#pragma omp parallel for
+    for (int i = 0; i < num_verts; ++i)
     {
-        if (posToNormal.find(positions[i]) != posToNormal.end())
-            normals[i] = posToNormal[positions[i]].normalized();
+        if (corner_start[i] == corner_start[i + 1])
+            continue;
+        Vector3f n = Vector3f::Zero();
+        for (int c = corner_start[i]; c < corner_start[i + 1]; ++c)
+            n += corner_normals[corners[c]];
+        normals[i] = n.normalized();
     }
 }
 
@@ -949,20 +1466,17 @@ void App::tessellateCurves(int tessellation_steps) const
                 tessellateKappaClosed(curve.control_points, dest, tessellation_steps);
         }
     }
+    cache.curve_buffers_stale = true;
 }
 
 void App::generateSurfaces(int tessellation_steps) const
 {
     auto& cache = m_render_cache;
+    cache.generated.assign(cache.surfaces.size(), GeneratedSurface());
 
-    MeshWithConnectivity& m = cache.surface_mesh;
-    
-    m.positions.clear();
-    m.normals.clear();
-    m.colors.clear();
-    m.indices.clear();
     for (auto& surf : cache.surfaces) {
-        GeneratedSurface s;
+        size_t index = &surf - cache.surfaces.data();
+        GeneratedSurface& s = cache.generated[index];
         //switch (surf.type) {
         if ( surf.type == "revolution")
         //case SurfaceType::Revolution:
@@ -1001,10 +1515,59 @@ void App::generateSurfaces(int tessellation_steps) const
                 else s = makeGenCylPiecewise(profile, segments);
             }
         }
-        else if (surf.type == "isosurface")
-            s = makeIsoSurfaceRAW(surf.volume_file, surf.dims, surf.iso, surf.spacing, surf.origin, surf.dtype);
+        else if (surf.type == "isosurface") {
+            if (surf.render == "raymarch") {
+                // Uploaded once to a 3D texture and rendered directly; nothing to add to the mesh.
+                if (cache.volumes.size() < cache.surfaces.size())
+                    cache.volumes.resize(cache.surfaces.size());
+                if (!cache.volumes[index]) {
+                    VoxelType type = VoxelType::UInt8;
+                    RawVolume volume;
+                    if (!parseVoxelType(surf.dtype, type))
+                        std::cerr << "Unsupported dtype: " << surf.dtype << std::endl;
+                    else if (volume.open(surf.volume_file, surf.dims, type)) {
+                        auto rv = std::make_unique<RaymarchedVolume>();
+                        if (rv->upload(volume, surf.spacing, surf.origin))
+                            cache.volumes[index] = std::move(rv);
+                    }
+                }
+                continue;
+            }
+            // written to disk by exportIsoSurfaces() when the scene was loaded
+            if (index < cache.exported.size() && cache.exported[index])
+                continue;
+            // A coarse preview is extracted right away and refined in the background;
+            // update_render_cache() reassembles the mesh whenever a finer level is ready.
+            if (cache.isosurfaces.size() < cache.surfaces.size())
+                cache.isosurfaces.resize(cache.surfaces.size());
+            auto& progressive = cache.isosurfaces[index];
+            if (!progressive) {
+                progressive = std::make_unique<ProgressiveIsoSurface>();
+                progressive->start(surf.volume_file, surf.dims, surf.isos, surf.spacing, surf.origin, surf.dtype, surf.method);
+            }
+            continue;
+        }
             //break;
         //}
+    }
+
+    assembleSurfaceMesh();
+}
+
+// Puts the meshes made from curves and the latest isosurface levels into surface_mesh and
+// uploads it. A finer isosurface level only needs this, not generateSurfaces().
+void App::assembleSurfaceMesh() const
+{
+    auto& cache = m_render_cache;
+
+    MeshWithConnectivity& m = cache.surface_mesh;
+    
+    m.positions.clear();
+    m.normals.clear();
+    m.colors.clear();
+    m.indices.clear();
+
+    auto append = [&m](const GeneratedSurface& s) {
         size_t offset = m.positions.size();
         m.positions.resize(offset + s.positions.size());
         m.normals.resize(offset + s.normals.size());
@@ -1018,6 +1581,14 @@ void App::generateSurfaces(int tessellation_steps) const
         m.indices.resize(m.indices.size() + s.indices.size());
         for (int i = 0; i < s.indices.size(); ++i)
             m.indices[ind_offset + i] = Vector3i(int(offset), int(offset), int(offset)) + s.indices[i];
+    };
+
+    for (size_t index = 0; index < cache.surfaces.size(); ++index) {
+        if (index < cache.generated.size())
+            append(cache.generated[index]);
+        if (index < cache.isosurfaces.size() && cache.isosurfaces[index])
+            for (const auto& isosurface : cache.isosurfaces[index]->surfaces())
+                append(isosurface);
     }
 
     if (!m.positions.empty()) {
@@ -1027,42 +1598,36 @@ void App::generateSurfaces(int tessellation_steps) const
     uploadGeometryToGPU(m);
 }
 
+// Streams the isosurfaces that have an output_file straight to disk, as their meshes may be far
+// too large to display. This is a full pass over each volume, so it runs once per scene load
+// rather than whenever generateSurfaces() rebuilds the mesh.
+void App::exportIsoSurfaces() const
+{
+    auto& cache = m_render_cache;
+    cache.exported.assign(cache.surfaces.size(), 0);
+    for (size_t index = 0; index < cache.surfaces.size(); ++index) {
+        const auto& surf = cache.surfaces[index];
+        if (surf.type != "isosurface" || surf.render == "raymarch" || surf.output_file.empty())
+            continue;
+        int64_t count = writeIsoSurfaceSTL(surf.volume_file, surf.dims, surf.isos, surf.spacing, surf.origin, surf.dtype, surf.output_file, surf.method);
+        if (count >= 0)
+            std::cerr << "Wrote " << count << " isosurface triangles to " << surf.output_file << std::endl;
+        // a failed export has printed its error and is not retried either
+        cache.exported[index] = 1;
+    }
+}
+
 
 //------------------------------------------------------------------------
 
 void App::renderCurves(bool draw_frames) const
-{    
-    // draw the tessellated curves
-    Im3d::SetColor(1.0f, 1.0f, 1.0f);
-    Im3d::SetSize(2.0f);
-    for (size_t i = 0; i < m_render_cache.tessellated_curves.size(); ++i)
-        drawCurve(m_render_cache.tessellated_curves[i], draw_frames);
-
-    // draw control point sequences
-    for (auto i = 0u; i < m_render_cache.spline_curves.size(); ++i)
-    {
-        const SplineCurve& c = m_render_cache.spline_curves[i];
-
-        if(c.type == "bezier")
-            Im3d::SetColor(1.0f, 1.0f, 0.0f);
-        else if (c.type == "bspline")
-            Im3d::SetColor(0.0f, 1.0f, 0.0f);
-        else if (c.type == "circle")
-            Im3d::SetColor(.6f, .6f, .6f);
-
-        // draw larger points
-        Im3d::PushSize(16.0f);
-        Im3d::BeginPoints();
-        for (const auto& cpt : c.control_points)
-            Im3d::Vertex(cpt(0), cpt(1), cpt(2));
-        Im3d::End();
-        Im3d::PopSize();
-
-        Im3d::BeginLineStrip();
-        for (const auto& cpt : c.control_points)
-            Im3d::Vertex(cpt(0), cpt(1), cpt(2));
-        Im3d::End();
+{
+    // the curves, control polygons and frames only go to the GPU when tessellateCurves() changed them
+    if (m_render_cache.curve_buffers_stale) {
+        m_render_cache.curve_buffers.upload(m_render_cache.tessellated_curves, m_render_cache.spline_curves);
+        m_render_cache.curve_buffers_stale = false;
     }
+    m_render_cache.curve_buffers.draw(draw_frames);
 
     // highlight selection when editing
     if (m_curve_edit_mode && m_edit_curve_idx >= 0 && m_edit_curve_idx < (int)m_render_cache.spline_curves.size())
@@ -1076,7 +1641,7 @@ void App::renderCurves(bool draw_frames) const
     }
 }
 
-std::tuple<int,int> App::pickTriangle(const MeshWithConnectivity& m, const Camera& cam, int window_width, int window_height, float mousex, float mousey) const
+std::tuple<int,int> App::pickTriangle(const MeshWithConnectivity& m, RayQuery& query, const Camera& cam, int window_width, int window_height, float mousex, float mousey) const
 {
     Matrix4f view_to_world = cam.GetModelview().inverse();
     Matrix4f clip_to_view = cam.GetPerspective().inverse();
@@ -1092,7 +1657,7 @@ std::tuple<int,int> App::pickTriangle(const MeshWithConnectivity& m, const Camer
 
     d -= o;
 
-    return m.pickTriangle(o, d);
+    return m.pickTriangle(o, d, query);
 }
 
 void App::screenshot (const string& name) {
@@ -1207,7 +1772,15 @@ void App::handleMouseButton(GLFWwindow* window, int button, int action, int mods
             {
                 bool allowAddRemove = (m_render_cache.spline_curves[m_edit_curve_idx].type == "catmull-rom");
                 // pick existing point; if none and Shift pressed, add new point
-                int picked = pickControlPointScreen(m_edit_curve_idx, fbw, fbh, x, y);
+                int picked = -1;
+                if (m_id_buffer_picking) {
+                    // the ID buffer pass of the last frame or two, drawn around the cursor
+                    const IdBufferPicker::Pick& pick = m_id_picker.latest();
+                    if (pick.kind == IdBufferPicker::Kind::Points && pick.id < (int)m_render_cache.spline_curves[m_edit_curve_idx].control_points.size())
+                        picked = pick.id;
+                }
+                else
+                    picked = pickControlPointScreen(m_edit_curve_idx, fbw, fbh, x, y);
                 if (picked >= 0) { m_edit_point_idx = picked; m_dragging_point = true; }
                 else if ((mods & GLFW_MOD_SHIFT) != 0 && allowAddRemove)
                 {
@@ -39,6 +39,17 @@ enum class DrawMode
 #include "curve.h"
 #include "surf.h"
 #include "subdiv.h"
+#include "subdiv_gpu.h"
+#include "subdiv_patch.h"
+#include "subdiv_stream.h"
+#include "subdiv_adaptive.h"
+#include "subdiv_prefetch.h"
+#include "id_picker.h"
+#include "wireframe.h"
+#include "curve_buffers.h"
+#include "mesh_clusters.h"
+#include "frame_scheduler.h"
+#include "volume_render.h"
 
 //------------------------------------------------------------------------
 
@@ -61,14 +72,41 @@ enum class DrawMode
 
 //------------------------------------------------------------------------
 
-// Structure for holding vertex data.
-// PNC stands for Position, Normal, Color
-struct VertexPNC
+// Camera and lighting for one frame, shared by every program that declares FRAME_UNIFORMS_GLSL.
+// App::render() writes it once per frame to a uniform buffer bound to FrameUniformBinding, so
+// draws do not set these uniforms one by one. The members follow the std140 layout of the block.
+struct FrameUniforms
 {
-    Vector3f position   = Vector3f::Zero();
-    Vector3f normal     = Vector3f::Zero();
-    Vector3f color      = Vector3f::Zero();
+    Matrix4f    world_to_view;
+    Matrix4f    view_to_clip;
+    Matrix4f    world_to_clip;
+    Vector3f    camera_world_position;
+    float       ambient_strength;
+    Vector3f    rim_color;
+    float       specular_strength;
+    Vector3f    specular_color;
+    float       shininess;
+    float       rim_strength;
+    float       padding[3];
 };
+static_assert(sizeof(FrameUniforms) == 256, "FrameUniforms must match the std140 layout of the block");
+
+constexpr GLuint FrameUniformBinding = 0;
+
+#define FRAME_UNIFORMS_GLSL                 \
+    "layout(std140) uniform FrameUniforms\n" \
+    "{\n"                                   \
+    "    mat4 uWorldToView;\n"              \
+    "    mat4 uViewToClip;\n"               \
+    "    mat4 uWorldToClip;\n"              \
+    "    vec3 uCameraWorldPosition;\n"      \
+    "    float uAmbientStrength;\n"         \
+    "    vec3 uRimColor;\n"                 \
+    "    float uSpecularStrength;\n"        \
+    "    vec3 uSpecularColor;\n"            \
+    "    float uShininess;\n"               \
+    "    float uRimStrength;\n"             \
+    "};\n"
 
 //------------------------------------------------------------------------
 
@@ -105,9 +143,39 @@ private:
         // spline and mesh data
         vector<SplineCurve>	                        spline_curves;
         vector<vector<CurvePoint>>                  tessellated_curves;
+        CurveBuffers                                curve_buffers;          // the curves on the GPU, for renderCurves()
+        bool                                        curve_buffers_stale = true;
         vector<ParsedSurface>                       surfaces;
         MeshWithConnectivity                        surface_mesh;
-        vector<unique_ptr<MeshWithConnectivity>>    subdivided_meshes;
+        vector<unique_ptr<MeshWithConnectivity>>    subdivided_meshes;      // null for levels evicted by trimLevelCache()
+        vector<SubdivisionStencil>                  subdivision_stencils;   // [k] maps level k-1 to level k, [0] is empty
+        SubdivisionStencil                          control_stencil;        // control mesh to level control_stencil_level
+        int                                         control_stencil_level = -1;
+        int                                         deformed_level = -1;    // level whose positions were evaluated from a deformed control mesh
+        MeshWithConnectivity                        deformed_control;
+        unique_ptr<GpuStencilEvaluator>             gpu_stencil;            // control_stencil on the GPU, created on demand
+        SubdivisionPrefetcher                       prefetch;               // builds the level after the finest one in the background
+        vector<unique_ptr<RayQuery>>                pick_queries;           // parallel to subdivided_meshes, built on the first pick
+        unique_ptr<RayQuery>                        derived_pick_query;     // for limit_mesh or adaptive_mesh, whichever is shown
+        bool                                        show_limit = false;
+        int                                         limit_rate = 0;
+        unique_ptr<MeshWithConnectivity>            limit_mesh;             // limit surface of the control mesh, tessellated at limit_rate
+        bool                                        stream_patches = false;
+        int                                         streamed_level = -1;    // level held by the GPU buffers, -1 if it must be streamed again
+        size_t                                      streamed_triangles = 0; // 0 if streaming failed
+        bool                                        adaptive = false;
+        int                                         adaptive_level = -1;
+        float                                       adaptive_tolerance = 0.0f;
+        float                                       adaptive_max_pixels = 0.0f;
+        unique_ptr<MeshWithConnectivity>            adaptive_mesh;          // refined up to adaptive_level where needed, null if it must be rebuilt
+        MeshClusters                                clusters;               // of the mesh in the GPU buffers, for drawGeometry()
+        bool                                        clusters_stale = true;
+        size_t                                      drawn_clusters = 0;
+        size_t                                      drawn_cluster_triangles = 0;
+        vector<unique_ptr<RaymarchedVolume>>        volumes;            // parallel to surfaces, null unless ray marched
+        vector<unique_ptr<ProgressiveIsoSurface>>   isosurfaces;        // parallel to surfaces, null unless extracted
+        vector<char>                                exported;           // parallel to surfaces, set once output_file has been written
+        vector<GeneratedSurface>                    generated;          // parallel to surfaces, the meshes made from curves
 
     } mutable m_render_cache;
 
@@ -127,6 +195,8 @@ private:
 
     void tessellateCurves(int tessellation_steps) const;
     void generateSurfaces(int tessellation_steps) const;
+    void exportIsoSurfaces() const;
+    void assembleSurfaceMesh() const;
 
     enum VertexShaderAttributeLocations {
         ATTRIB_POSITION = 0,
@@ -140,20 +210,30 @@ private:
         GLuint vao;
         GLuint vertex_buffer;
         GLuint index_buffer;
-    GLuint world_to_view_uniform, view_to_clip_uniform, shading_toggle_uniform, camera_world_position_uniform;
-    GLuint ambient_strength_uniform, specular_strength_uniform, shininess_uniform;
-    GLuint rim_strength_uniform, rim_color_uniform, specular_color_uniform;
+        GLuint cluster_index_buffer;    // the triangles of index_buffer in the order of m_render_cache.clusters
+        GLuint frame_uniform_buffer;    // FrameUniforms
+        GLuint shading_toggle_uniform;
     };
 
     glGeneratedIndices m_gl;
 
     ShaderProgram*                              m_subdivision_shader = nullptr;
+    mutable IdBufferPicker                      m_id_picker;
 
     void                addSubdivisionLevel(DrawMode mode, bool crude_boundaries) const;
+    MeshWithConnectivity& subdivisionLevel(int level) const;
+    void                trimLevelCache() const;
+    void                prefetchNextLevel() const;
+    void                markPickQueryStale(int level) const;
+    void                deformSubdivisionSurface(float amplitude, float time) const;
+    void                restoreSubdivisionSurface() const;
 
     void                uploadGeometryToGPU(const MeshWithConnectivity& m) const;
+    void                setVertexLayout(size_t num_vertices) const;
+    void                updateFrameUniforms(const Camera& cam) const;
+    void                drawGeometry(const Camera& cam, size_t num_triangles, const MeshClusters* clusters = nullptr) const;
     void                renderMesh(const MeshWithConnectivity& m, const Camera& cam, bool include_wireframe, int highlight_triangle, int highlight_vertex) const;
-    std::tuple<int,int> pickTriangle(const MeshWithConnectivity& m, const Camera& cam, int window_width, int window_height, float mousex, float mousey) const;
+    std::tuple<int,int> pickTriangle(const MeshWithConnectivity& m, RayQuery& query, const Camera& cam, int window_width, int window_height, float mousex, float mousey) const;
 
 
     void				handleKeypress(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -165,6 +245,23 @@ private:
 	mutable vector<int> m_debug_indices;
     bool                m_toggle_onering = false;
     bool                m_debug_subdivision = false;
+    bool                m_angle_weighted_normals = false;
+    bool                m_deform_control_mesh = false;
+    float               m_deform_amplitude = 0.2f;
+    bool                m_gpu_stencil_evaluation = true;
+    bool                m_limit_surface = false;
+    int                 m_limit_rate = 8;
+    int                 m_level_cache_budget_mb = 1024;
+    bool                m_stream_patches = false;
+    bool                m_adaptive_subdivision = false;
+    float               m_adaptive_tolerance = 1e-3f;
+    float               m_adaptive_max_pixels = 0.0f;
+    bool                m_id_buffer_picking = false;    // pick triangles and control points with m_id_picker
+    bool                m_cluster_culling = false;      // skip the clusters of the mesh that are off screen or face away
+    FrameScheduler      m_scheduler;                    // draws frames on input, state changes, animation and background work only
+    string              m_drawn_state;                  // m_state as of the last frame, to notice changes
+    bool                m_continuous_rendering = false;
+    int                 m_max_fps = 0;                  // 0 for no cap
         ;
 
     // -------- Curve editor state --------
@@ -174,6 +271,7 @@ private:
     mutable bool        m_dragging_point = false;    // dragging flag
     mutable float       m_pick_radius_pixels = 16.0f;// screen-space pick radius
     mutable bool        m_surfaces_dirty = false;     // regenerate surfaces lazily
+    float               m_raymarch_step = 0.5f;       // ray marching step in voxels
 
     // Helpers for curve editing
     Vector3f            screenToRayOrigin(const Camera& cam) const;
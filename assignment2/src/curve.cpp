@@ -520,30 +520,3 @@ void tessellateCircle(const vector<Vector3f>& P, vector<CurvePoint>& dest, unsig
 			});
 	}
 }
-
-void drawCurve(const vector<CurvePoint>& curve, bool draw_frames)
-{
-    // Just the curve
-	Im3d::BeginLineStrip();
-	Im3d::SetColor(1.0f, 1.0f, 1.0f);
-	for (unsigned i = 0; i < curve.size(); ++i)
-		Im3d::Vertex(curve[i].position(0), curve[i].position(1), curve[i].position(2));
-	Im3d::End();
-    // Tangent, normal, binormal if desired
-    if (draw_frames) {
-        Im3d::BeginLines();
-        for (unsigned i = 0; i < curve.size(); ++i) {
-            CurvePoint c = curve[i];
-            Vector3f p = c.position;
-            Vector3f offset[3] = { c.tangent, c.normal, c.binormal };
-            for (int i = 0; i < 3; ++i) {
-                Im3d::SetColor(i == 1, i == 2, i == 0);
-                Im3d::Vertex(p(0), p(1), p(2));
-                Vector3f o = offset[i] * .2f;
-                Im3d::Vertex(p(0) + o(0), p(1) + o(1), p(2) + o(2));
-            }
-        }
-        Im3d::End();
-    }
-}
-
@@ -94,8 +94,3 @@ void tessellateKappaClosed(const vector<Vector3f>& P, vector<CurvePoint>& dest,
 
 // Two control points: the x-coordinate of the first gives the radius.
 void tessellateCircle(const vector<Vector3f>& P, vector<CurvePoint>& dest, unsigned num_intervals);
-
-// Draw the curve. For the extras that require computing coordinate
-// frames, we suggest you append a mechanism for optionally drawing
-// the frames as well.
-void drawCurve(const vector<CurvePoint>& curve, bool draw_frames);
@@ -0,0 +1,130 @@
+#include "app.h"
+
+#include "curve_buffers.h"
+
+#include "im3d.h"
+
+// defined in im3d_opengl33.cpp
+void Im3d_DrawVertexArray(GLenum prim, GLuint vao, const GLint* first, const GLsizei* count, GLsizei draws);
+void Im3d_DrawFrameGlyphs(GLuint vao, GLsizei glyph_vertices, GLsizei instances, float length, float size);
+
+namespace
+{
+    // the sizes and lengths renderCurves() used with Im3d
+    const float CurveSize = 2.0f;
+    const float PointSize = 16.0f;
+    const float FrameLength = 0.2f;
+
+    Im3d::Color controlPolygonColor(const string& type)
+    {
+        if (type == "bezier")
+            return Im3d::Color(1.0f, 1.0f, 0.0f);
+        if (type == "bspline")
+            return Im3d::Color(0.0f, 1.0f, 0.0f);
+        if (type == "circle")
+            return Im3d::Color(.6f, .6f, .6f);
+        return Im3d::Color(1.0f, 1.0f, 1.0f);
+    }
+}
+
+CurveBuffers::~CurveBuffers()
+{
+    if (m_vao != 0) {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteVertexArrays(1, &m_frame_vao);
+        glDeleteBuffers(1, &m_vertex_buffer);
+        glDeleteBuffers(1, &m_glyph_buffer);
+        glDeleteBuffers(1, &m_frame_buffer);
+    }
+}
+
+void CurveBuffers::upload(const vector<vector<CurvePoint>>& tessellated_curves, const vector<SplineCurve>& spline_curves)
+{
+    // the frame attributes are read straight out of the CurvePoints
+    static_assert(sizeof(CurvePoint) == 4 * sizeof(Vector3f), "CurvePoint must be four packed vectors");
+
+    if (m_vao == 0) {
+        glGenVertexArrays(1, &m_vao);
+        glGenBuffers(1, &m_vertex_buffer);
+        glBindVertexArray(m_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Im3d::VertexData), (GLvoid*)offsetof(Im3d::VertexData, m_positionSize));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Im3d::VertexData), (GLvoid*)offsetof(Im3d::VertexData, m_color));
+
+        // one line per axis, from the curve point to the tip
+        const float glyph[6][4] = {
+            { 1, 0, 0, 0 }, { 1, 0, 0, 1 },
+            { 0, 1, 0, 0 }, { 0, 1, 0, 1 },
+            { 0, 0, 1, 0 }, { 0, 0, 1, 1 } };
+        glGenVertexArrays(1, &m_frame_vao);
+        glGenBuffers(1, &m_glyph_buffer);
+        glGenBuffers(1, &m_frame_buffer);
+        glBindVertexArray(m_frame_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, m_glyph_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(glyph), glyph, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+        glBindBuffer(GL_ARRAY_BUFFER, m_frame_buffer);
+        for (int k = 0; k < 4; ++k) {
+            // position, tangent, normal, binormal
+            glEnableVertexAttribArray(2 + k);
+            glVertexAttribPointer(2 + k, 3, GL_FLOAT, GL_FALSE, sizeof(CurvePoint), (GLvoid*)(k * sizeof(Vector3f)));
+            glVertexAttribDivisor(2 + k, 1);
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    vector<Im3d::VertexData> vertices;
+    m_strip_first.clear();
+    m_strip_count.clear();
+    auto addStrip = [&](const auto& points, auto position, Im3d::Color color) {
+        if (points.size() < 2)
+            return;
+        m_strip_first.push_back(GLint(vertices.size()));
+        m_strip_count.push_back(GLsizei(points.size()));
+        for (const auto& point : points) {
+            const Vector3f& p = position(point);
+            vertices.push_back(Im3d::VertexData(Im3d::Vec3(p(0), p(1), p(2)), CurveSize, color));
+        }
+    };
+
+    size_t num_frames = 0;
+    for (const auto& curve : tessellated_curves) {
+        addStrip(curve, [](const CurvePoint& c) -> const Vector3f& { return c.position; }, Im3d::Color(1.0f, 1.0f, 1.0f));
+        num_frames += curve.size();
+    }
+    for (const auto& c : spline_curves)
+        addStrip(c.control_points, [](const Vector3f& p) -> const Vector3f& { return p; }, controlPolygonColor(c.type));
+
+    m_points_first = GLint(vertices.size());
+    for (const auto& c : spline_curves)
+        for (const auto& p : c.control_points)
+            vertices.push_back(Im3d::VertexData(Im3d::Vec3(p(0), p(1), p(2)), PointSize, controlPolygonColor(c.type)));
+    m_points_count = GLsizei(vertices.size() - m_points_first);
+
+    vector<CurvePoint> frames;
+    frames.reserve(num_frames);
+    for (const auto& curve : tessellated_curves)
+        frames.insert(frames.end(), curve.begin(), curve.end());
+    m_frames = GLsizei(frames.size());
+
+    // dragging a control point uploads every frame, hence dynamic
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Im3d::VertexData) * vertices.size(), vertices.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, m_frame_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(CurvePoint) * frames.size(), frames.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CurveBuffers::draw(bool draw_frames) const
+{
+    if (m_vao == 0)
+        return;
+    Im3d_DrawVertexArray(GL_LINE_STRIP, m_vao, m_strip_first.data(), m_strip_count.data(), GLsizei(m_strip_first.size()));
+    Im3d_DrawVertexArray(GL_POINTS, m_vao, &m_points_first, &m_points_count, m_points_count > 0 ? 1 : 0);
+    if (draw_frames)
+        Im3d_DrawFrameGlyphs(m_frame_vao, 6, m_frames, FrameLength, CurveSize);
+}
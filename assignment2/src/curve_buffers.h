@@ -0,0 +1,34 @@
+#pragma once
+
+#include "app.h"
+#include "curve.h"
+
+// The tessellated curves, control polygons and control points of a scene, kept in GPU buffers
+// between frames. upload() rebuilds the buffers and is only needed when the curves change;
+// draw() then costs three draw calls no matter how many curves there are: one for all line
+// strips, one for all points, and one instanced call that puts a frame glyph at every curve
+// point. They are drawn with Im3d's shaders, so they look the same as renderCurves() used to.
+class CurveBuffers
+{
+public:
+                    CurveBuffers() = default;
+                    ~CurveBuffers();
+                    CurveBuffers(const CurveBuffers&) = delete;
+    CurveBuffers&   operator=(const CurveBuffers&) = delete;
+
+    void            upload(const vector<vector<CurvePoint>>& tessellated_curves, const vector<SplineCurve>& spline_curves);
+    void            draw(bool draw_frames) const;
+
+private:
+    GLuint          m_vao = 0;
+    GLuint          m_vertex_buffer = 0;        // Im3d::VertexData: curve and polygon strips, then control points
+    GLuint          m_frame_vao = 0;
+    GLuint          m_glyph_buffer = 0;
+    GLuint          m_frame_buffer = 0;         // every CurvePoint of every curve, one per glyph instance
+
+    vector<GLint>   m_strip_first;
+    vector<GLsizei> m_strip_count;
+    GLint           m_points_first = 0;
+    GLsizei         m_points_count = 0;
+    GLsizei         m_frames = 0;
+};
@@ -0,0 +1,363 @@
+#include "app.h"
+
+#include "id_picker.h"
+
+#include <climits>
+#include <cmath>
+#include <iostream>
+
+namespace
+{
+    // looked up once, when the programs link
+    GLint s_triangle_world_to_clip_uniform = -1;
+    GLint s_point_world_to_clip_uniform = -1;
+    GLint s_point_radius_uniform = -1;
+}
+
+IdBufferPicker::~IdBufferPicker()
+{
+    for (Readback& readback : m_readbacks) {
+        if (readback.fence)
+            glDeleteSync(readback.fence);
+        if (readback.buffer != 0)
+            glDeleteBuffers(1, &readback.buffer);
+    }
+    if (m_framebuffer != 0) {
+        glDeleteFramebuffers(1, &m_framebuffer);
+        glDeleteRenderbuffers(1, &m_ids);
+        glDeleteRenderbuffers(1, &m_depth);
+    }
+    if (m_point_vao != 0) {
+        glDeleteVertexArrays(1, &m_point_vao);
+        glDeleteBuffers(1, &m_point_buffer);
+    }
+}
+
+void IdBufferPicker::drawTriangles(GLuint vao, size_t num_triangles, const Matrix4f& world_to_clip, int width, int height, double x, double y)
+{
+    Matrix4f region_to_clip;
+    if (num_triangles == 0 || !begin(world_to_clip, width, height, x, y, region_to_clip))
+        return;
+
+    glUseProgram(triangleProgram());
+    glUniformMatrix4fv(s_triangle_world_to_clip_uniform, 1, GL_FALSE, region_to_clip.data());
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, GLsizei(3 * num_triangles), GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    end(Kind::Triangles);
+}
+
+void IdBufferPicker::drawPoints(const vector<Vector3f>& points, float radius_pixels, const Matrix4f& world_to_clip, int width, int height, double x, double y)
+{
+    Matrix4f region_to_clip;
+    if (points.empty() || !begin(world_to_clip, width, height, x, y, region_to_clip))
+        return;
+
+    if (m_point_vao == 0) {
+        glGenVertexArrays(1, &m_point_vao);
+        glGenBuffers(1, &m_point_buffer);
+        glBindVertexArray(m_point_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, m_point_buffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid*)0);
+        glBindVertexArray(0);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, m_point_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3f) * points.size(), points.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glUseProgram(pointProgram());
+    glUniformMatrix4fv(s_point_world_to_clip_uniform, 1, GL_FALSE, region_to_clip.data());
+    // one pixel of the region is 2 / Side in clip units
+    glUniform1f(s_point_radius_uniform, 2.0f * radius_pixels / Side);
+    glBindVertexArray(m_point_vao);
+    glDrawArrays(GL_POINTS, 0, GLsizei(points.size()));
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    end(Kind::Points);
+}
+
+const IdBufferPicker::Pick& IdBufferPicker::latest()
+{
+    // The passes finish in the order they were issued, so the first one that is still running
+    // means the newer ones are too.
+    for (int k = 0; k < Slots; ++k) {
+        Readback& readback = m_readbacks[(m_next + k) % Slots];
+        if (!readback.fence)
+            continue;
+        GLenum status = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            break;
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+        if (status == GL_WAIT_FAILED)
+            continue;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        const GLint* ids = (const GLint*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 2 * sizeof(GLint) * Side * Side, GL_MAP_READ_BIT);
+        if (ids) {
+            // IDs are stored one higher so that the cleared value 0 means nothing
+            Pick pick;
+            pick.kind = readback.kind;
+            int best = INT_MAX;
+            for (int j = 0; j < Side; ++j)
+                for (int i = 0; i < Side; ++i) {
+                    const GLint* texel = ids + 2 * (j * Side + i);
+                    int distance2 = (i - Radius) * (i - Radius) + (j - Radius) * (j - Radius);
+                    if (texel[0] != 0 && distance2 < best) {
+                        best = distance2;
+                        pick.id = texel[0] - 1;
+                        pick.vertex = readback.kind == Kind::Triangles ? texel[1] : -1;
+                    }
+                }
+            m_latest = pick;
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    return m_latest;
+}
+
+bool IdBufferPicker::begin(const Matrix4f& world_to_clip, int width, int height, double x, double y, Matrix4f& region_to_clip)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    if (m_framebuffer == 0) {
+        glGenRenderbuffers(1, &m_ids);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_ids);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RG32I, Side, Side);
+        glGenRenderbuffers(1, &m_depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, Side, Side);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &m_framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_ids);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ID buffer framebuffer is incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+
+        for (Readback& readback : m_readbacks) {
+            glGenBuffers(1, &readback.buffer);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(GLint) * Side * Side, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    // all slots still in flight: skip this frame rather than wait for the GPU
+    latest();
+    if (m_readbacks[m_next].fence)
+        return false;
+
+    // Narrow the projection to the Side x Side pixels centered on the cursor, so that they fill
+    // the whole ID buffer one to one.
+    int px = int(std::floor(x));
+    int py = height - 1 - int(std::floor(y));
+    float cx = 2.0f * (px + 0.5f) / width - 1.0f;
+    float cy = 2.0f * (py + 0.5f) / height - 1.0f;
+    Matrix4f clip_to_region(Matrix4f::Identity());
+    clip_to_region(0, 0) = float(width) / Side;
+    clip_to_region(1, 1) = float(height) / Side;
+    clip_to_region(0, 3) = -cx * float(width) / Side;
+    clip_to_region(1, 3) = -cy * float(height) / Side;
+    region_to_clip = clip_to_region * world_to_clip;
+
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &m_previous_framebuffer);
+    glGetIntegerv(GL_VIEWPORT, m_previous_viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+    glViewport(0, 0, Side, Side);
+    const GLint no_id[4] = { 0, 0, 0, 0 };
+    const GLfloat far_depth = 1.0f;
+    glDepthMask(GL_TRUE);
+    glClearBufferiv(GL_COLOR, 0, no_id);
+    glClearBufferfv(GL_DEPTH, 0, &far_depth);
+    glEnable(GL_DEPTH_TEST);
+    return true;
+}
+
+void IdBufferPicker::end(Kind kind)
+{
+    Readback& readback = m_readbacks[m_next];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    glReadPixels(0, 0, Side, Side, GL_RG_INTEGER, GL_INT, (GLvoid*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.kind = kind;
+    m_next = (m_next + 1) % Slots;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_previous_framebuffer);
+    glViewport(m_previous_viewport[0], m_previous_viewport[1], m_previous_viewport[2], m_previous_viewport[3]);
+}
+
+GLuint IdBufferPicker::triangleProgram()
+{
+    static GLuint s_program = 0;
+    if (s_program != 0)
+        return s_program;
+
+    // gl_VertexID is the value read from the index buffer, so it names the mesh vertex. The
+    // geometry shader hands all three corners to the fragment shader, which keeps the one
+    // closest to the fragment.
+    GLuint vertex_shader = ShaderProgram::createGLShader(GL_VERTEX_SHADER, "GL_VERTEX_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            layout(location = 0) in vec3 aPosition;
+
+            uniform mat4 uWorldToClip;
+
+            out vec3 vPosition;
+            flat out int vVertex;
+
+            void main()
+            {
+                gl_Position = uWorldToClip * vec4(aPosition, 1.0);
+                vPosition = aPosition;
+                vVertex = gl_VertexID;
+            }
+        ));
+    GLuint geometry_shader = ShaderProgram::createGLShader(GL_GEOMETRY_SHADER, "GL_GEOMETRY_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            layout(triangles) in;
+            layout(triangle_strip, max_vertices = 3) out;
+
+            in vec3 vPosition[];
+            flat in int vVertex[];
+
+            out vec3 gPosition;
+            flat out vec3 gCorner[3];
+            flat out ivec3 gVertices;
+            flat out int gTriangle;
+
+            void main()
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    gl_Position = gl_in[i].gl_Position;
+                    gPosition = vPosition[i];
+                    gCorner[0] = vPosition[0];
+                    gCorner[1] = vPosition[1];
+                    gCorner[2] = vPosition[2];
+                    gVertices = ivec3(vVertex[0], vVertex[1], vVertex[2]);
+                    gTriangle = gl_PrimitiveIDIn;
+                    EmitVertex();
+                }
+                EndPrimitive();
+            }
+        ));
+    GLuint fragment_shader = ShaderProgram::createGLShader(GL_FRAGMENT_SHADER, "GL_FRAGMENT_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            in vec3 gPosition;
+            flat in vec3 gCorner[3];
+            flat in ivec3 gVertices;
+            flat in int gTriangle;
+
+            out ivec2 fId;
+
+            void main()
+            {
+                int closest = 0;
+                for (int i = 1; i < 3; ++i)
+                    if (distance(gPosition, gCorner[i]) < distance(gPosition, gCorner[closest]))
+                        closest = i;
+                fId = ivec2(gTriangle + 1, gVertices[closest]);
+            }
+        ));
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, geometry_shader);
+    glAttachShader(program, fragment_shader);
+    ShaderProgram::linkGLProgram(program);
+    s_triangle_world_to_clip_uniform = glGetUniformLocation(program, "uWorldToClip");
+
+    s_program = program;
+    return s_program;
+}
+
+GLuint IdBufferPicker::pointProgram()
+{
+    static GLuint s_program = 0;
+    if (s_program != 0)
+        return s_program;
+
+    // Each point becomes a square in the geometry shader rather than a GL point, as a
+    // point is dropped whole when its center falls outside the region, even if the disc reaches
+    // the cursor. The depth of a fragment is its distance from the center of the disc, so the
+    // depth test keeps the nearest point at every pixel.
+    GLuint vertex_shader = ShaderProgram::createGLShader(GL_VERTEX_SHADER, "GL_VERTEX_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            layout(location = 0) in vec3 aPosition;
+
+            uniform mat4 uWorldToClip;
+
+            void main()
+            {
+                gl_Position = uWorldToClip * vec4(aPosition, 1.0);
+            }
+        ));
+    GLuint geometry_shader = ShaderProgram::createGLShader(GL_GEOMETRY_SHADER, "GL_GEOMETRY_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            layout(points) in;
+            layout(triangle_strip, max_vertices = 4) out;
+
+            uniform float uRadius;  // disc radius in clip units of the region
+
+            out vec2 gDisc;
+            flat out int gPoint;
+
+            void main()
+            {
+                vec4 center = gl_in[0].gl_Position;
+                if (center.w <= 0.0)
+                    return;
+                for (int i = 0; i < 4; ++i)
+                {
+                    gDisc = vec2(i & 1, i >> 1) * 2.0 - 1.0;
+                    gl_Position = center + vec4(gDisc * uRadius * center.w, 0.0, 0.0);
+                    gPoint = gl_PrimitiveIDIn;
+                    EmitVertex();
+                }
+                EndPrimitive();
+            }
+        ));
+    GLuint fragment_shader = ShaderProgram::createGLShader(GL_FRAGMENT_SHADER, "GL_FRAGMENT_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            in vec2 gDisc;
+            flat in int gPoint;
+
+            out ivec2 fId;
+
+            void main()
+            {
+                float r = length(gDisc);
+                if (r > 1.0)
+                    discard;
+                gl_FragDepth = r;
+                fId = ivec2(gPoint + 1, 0);
+            }
+        ));
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, geometry_shader);
+    glAttachShader(program, fragment_shader);
+    ShaderProgram::linkGLProgram(program);
+    s_point_world_to_clip_uniform = glGetUniformLocation(program, "uWorldToClip");
+    s_point_radius_uniform = glGetUniformLocation(program, "uRadius");
+
+    s_program = program;
+    return s_program;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "app.h"
+
+// Picks triangles and points by drawing their IDs instead of intersecting them on the CPU.
+// Each pass draws into a tiny integer framebuffer that covers only the pixels around the cursor:
+// the projection is narrowed to that region, so the cost of the pass does not depend on the size
+// of the window, and the fragments outside it are clipped before they are shaded. The IDs are
+// copied to a pixel buffer object and fenced, and latest() maps the buffer only once the fence
+// has signaled, so the CPU never waits for the GPU and the pick is usually one frame old.
+class IdBufferPicker
+{
+public:
+    enum class Kind { None, Triangles, Points };
+
+    struct Pick
+    {
+        Kind    kind = Kind::None;
+        int     id = -1;        // triangle or point, -1 if there is nothing under the cursor
+        int     vertex = -1;    // triangles: the vertex of the triangle closest to the cursor
+    };
+
+                        IdBufferPicker() = default;
+                        ~IdBufferPicker();
+                        IdBufferPicker(const IdBufferPicker&) = delete;
+    IdBufferPicker&     operator=(const IdBufferPicker&) = delete;
+
+    // Draws the IDs of the first num_triangles triangles of an indexed mesh. The positions must be
+    // attribute 0 of vao, and the index buffer must be bound to it. (x, y) is the cursor in
+    // framebuffer pixels, measured from the top left as GLFW does.
+    void                drawTriangles(GLuint vao, size_t num_triangles, const Matrix4f& world_to_clip, int width, int height, double x, double y);
+    // Draws the points as discs of the given radius. Where discs overlap, the one whose center is
+    // nearer wins.
+    void                drawPoints(const vector<Vector3f>& points, float radius_pixels, const Matrix4f& world_to_clip, int width, int height, double x, double y);
+
+    // Collects the passes that have finished and returns the newest result.
+    const Pick&         latest();
+
+private:
+    // Half the side of the region that is read back. Off the mesh, the ID nearest to the cursor
+    // within the region is taken, which makes thin triangles and silhouettes easier to hit.
+    static constexpr int Radius = 4;
+    static constexpr int Side = 2 * Radius + 1;
+    static constexpr int Slots = 3;
+
+    struct Readback
+    {
+        GLuint  buffer = 0;
+        GLsync  fence = nullptr;
+        Kind    kind = Kind::None;
+    };
+
+    bool                begin(const Matrix4f& world_to_clip, int width, int height, double x, double y, Matrix4f& region_to_clip);
+    void                end(Kind kind);
+    static GLuint       triangleProgram();
+    static GLuint       pointProgram();
+
+    GLuint              m_framebuffer = 0;
+    GLuint              m_ids = 0;
+    GLuint              m_depth = 0;
+    GLuint              m_point_vao = 0;
+    GLuint              m_point_buffer = 0;
+    GLint               m_previous_framebuffer = 0;
+    GLint               m_previous_viewport[4] = {};
+
+    Readback            m_readbacks[Slots];
+    int                 m_next = 0;         // the slot the next pass writes to, oldest first
+    Pick                m_latest;
+};
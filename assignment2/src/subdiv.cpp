@@ -19,27 +19,76 @@ void MeshWithConnectivity::computeConnectivity()
 	neighborTris.assign(indices.size(), Vector3i{ -1, -1, -1 });
 	neighborEdges.assign(indices.size(), Vector3i{ -1, -1, -1 });
 
-	// bookkeeping: map edges (vert0, vert1) to (triangle, edge_number) pairs
-	typedef std::map<std::pair<int, int>, std::pair<int, int>> edgemap_t;
-	edgemap_t M;
+	const int num_tris = (int)indices.size();
+	int num_verts = (int)positions.size();
+	for (const auto& tri : indices)
+		num_verts = std::max(num_verts, tri.maxCoeff() + 1);
+
+	// Bucket the half-edges by their smaller endpoint with a counting sort. Every half-edge
+	// of an undirected edge lands in the same bucket, and the scatter is stable, so the
+	// half-edges of a bucket keep their original order. Half-edge 3*i+j is edge j of triangle i.
+	vector<int> bucket_start(num_verts + 1, 0);
+	for (int i = 0; i < num_tris; ++i)
+		for (int j = 0; j < 3; ++j)
+			++bucket_start[std::min(indices[i][j], indices[i][(j+1)%3]) + 1];
+	for (int v = 0; v < num_verts; ++v)
+		bucket_start[v + 1] += bucket_start[v];
+
+	// Each entry keeps the other endpoint and the direction next to the half-edge id,
+	// so pairing doesn't need to go back to the index buffer.
+	struct HalfEdge { int other; int dir; int id; };
+	vector<HalfEdge> half_edges(3 * size_t(num_tris));
+	{
+		vector<int> cursor(bucket_start.begin(), bucket_start.end() - 1);
+		for (int i = 0; i < num_tris; ++i)
+			for (int j = 0; j < 3; ++j) {
+				int v0 = indices[i][j];
+				int v1 = indices[i][(j+1)%3];
+				half_edges[cursor[std::min(v0, v1)]++] = HalfEdge{ std::max(v0, v1), v0 > v1 ? 1 : 0, 3 * i + j };
+			}
+	}
 
-	for (int i = 0; i < (int)indices.size(); ++i) {
-		// vertex index is also an index for the corresponding edge starting at that vertex
-		for (int j = 0; j < 3; ++j) {
-			int v0 = indices[i][j];
-			int v1 = indices[i][(j+1)%3];
-			auto it = M.find(std::make_pair(v1, v0));
-			if (it == M.end()) {
-				// edge not found, add myself to mapping
-				// (opposite direction than when finding because we look for neighbor edges)
-				M[std::make_pair(v0, v1)] = std::make_pair(i, j);
-			} else {
-				if (it->second.first == -1)	{
+	// Buckets are independent and small (about the vertex valence), so pairing within a
+	// bucket is a short linear scan. The pairing rules are the same as they were with a map
+	// from directed edges: the first half-edge of each direction is recorded, a later
+	// half-edge in the opposite direction pairs with it, and any further half-edge of an
+	// already paired edge is non-manifold.
+	const int Paired = -2;
+#pragma omp parallel
+	{
+		struct Slot { int other; int first[2]; };
+		vector<Slot> slots;
+
+#pragma omp for schedule(dynamic, 1024)
+		for (int v = 0; v < num_verts; ++v) {
+			slots.clear();
+			for (int k = bucket_start[v]; k < bucket_start[v + 1]; ++k) {
+				int h = half_edges[k].id;
+				int i = h / 3, j = h % 3;
+				int other = half_edges[k].other;
+				int dir = half_edges[k].dir;
+				// a degenerate edge (v, v) is its own reverse
+				int reverse = other == v ? dir : 1 - dir;
+
+				Slot* slot = nullptr;
+				for (auto& s : slots)
+					if (s.other == other) { slot = &s; break; }
+				if (slot == nullptr) {
+					slots.push_back(Slot{ other, { -1, -1 } });
+					slot = &slots.back();
+				}
+
+				int found = slot->first[reverse];
+				if (found == -1) {
+					// edge not found, record myself
+					slot->first[dir] = h;
+				} else if (found == Paired) {
+#pragma omp critical
 					std::cerr << "Non-manifold edge detected\n";
 				} else {
-					// other site found, let's fill in the data
-					int other_t = it->second.first;
-					int other_e = it->second.second;
+					// other side found, let's fill in the data
+					int other_t = found / 3;
+					int other_e = found % 3;
 
 					neighborTris[i][j] = other_t;
 					neighborEdges[i][j] = other_e;
@@ -47,12 +96,25 @@ void MeshWithConnectivity::computeConnectivity()
 					neighborTris[other_t][other_e] = i;
 					neighborEdges[other_t][other_e] = j;
 
-					it->second.first = -1;
+					slot->first[reverse] = Paired;
 				}
 			}
 		}
 	}
-	
+}
+
+void MeshWithConnectivity::releaseConnectivity()
+{
+	// swap with empty vectors so that the memory is actually returned
+	vector<Vector3i>().swap(neighborTris);
+	vector<Vector3i>().swap(neighborEdges);
+}
+
+size_t MeshWithConnectivity::memoryBytes() const
+{
+	return (positions.capacity() + normals.capacity() + colors.capacity()) * sizeof(Vector3f)
+		+ ages.capacity() * sizeof(int)
+		+ (indices.capacity() + neighborTris.capacity() + neighborEdges.capacity()) * sizeof(Vector3i);
 }
 
 using std::min, std::max;
@@ -134,20 +196,69 @@ void MeshWithConnectivity::traverseOneRing(int i, int j, Vector3f& position, Vec
 }
 
 
-void MeshWithConnectivity::LoopSubdivision(DrawMode mode, bool crude_boundaries) {
-	// generate new (odd) vertices
+size_t stencilBytes(const SubdivisionStencil& stencil)
+{
+	return size_t(stencil.nonZeros()) * (sizeof(float) + sizeof(int)) + size_t(stencil.outerSize() + 1) * sizeof(int);
+}
+
+void applyStencil(const SubdivisionStencil& stencil, const vector<Vector3f>& in, vector<Vector3f>& out)
+{
+	// Rows are independent, so this is a plain parallel sparse matrix-vector product
+	// with three right-hand sides. The CSR arrays are read directly to keep the inner
+	// loop free of iterator overhead.
+	const int rows = (int)stencil.rows();
+	const int* row_start = stencil.outerIndexPtr();
+	const int* column = stencil.innerIndexPtr();
+	const float* weight = stencil.valuePtr();
+	out.resize(rows);
+#pragma omp parallel for schedule(static, 4096)
+	for (int r = 0; r < rows; ++r) {
+		Vector3f sum = Vector3f::Zero();
+		for (int k = row_start[r]; k < row_start[r + 1]; ++k)
+			sum += weight[k] * in[column[k]];
+		out[r] = sum;
+	}
+}
 
-	// visited edge -> vertex position information
-	// Note that this is different from the one in computeConnectivity()
-	typedef std::map<std::pair<int, int>, int> edgemap_t;
-	edgemap_t new_vertices;
+SubdivisionStencil MeshWithConnectivity::buildSubdivisionStencil(DrawMode mode, bool crude_boundaries, vector<Vector3i>& new_indices) const
+{
+	// Every edge gets exactly one new vertex. Instead of looking edges up in a map, each edge
+	// is owned by the lower-indexed of its two triangles (or by its only triangle on the
+	// boundary), and the owned edges are numbered with a prefix sum over the triangles.
+	// This visits edges in the same order as a scan over the triangles would, so the new
+	// vertices keep the numbering they had when a map of visited edges was used.
+	const int num_tris = (int)indices.size();
+	const int num_verts = (int)positions.size();
+	auto ownsEdge = [&](int i, int j) {
+		int nt = neighborTris[i][j];
+		return nt == -1 || nt > i || (nt == i && neighborEdges[i][j] > j);
+	};
 
-	// The new data must be doublebuffered or otherwise some of the calculations below would
-	// not read the original positions but the newly changed ones, which is slightly wrong.
-	vector<Vector3f> new_positions(positions.size());
-	vector<Vector3f> new_normals(normals.size());
-	vector<Vector3f> new_colors(colors.size());
-	vector<int>      new_ages(ages.size());
+	vector<int> edge_offset(num_tris + 1, 0);
+#pragma omp parallel for
+	for (int i = 0; i < num_tris; ++i)
+		edge_offset[i + 1] = int(ownsEdge(i, 0)) + int(ownsEdge(i, 1)) + int(ownsEdge(i, 2));
+	for (int i = 0; i < num_tris; ++i)
+		edge_offset[i + 1] += edge_offset[i];
+	const int num_edges = edge_offset[num_tris];
+
+	// new vertex index of each edge of each triangle, and the corner 3*i+j that owns each new vertex
+	vector<Vector3i> edge_vertices(num_tris);
+	vector<int> edge_corner(num_edges);
+#pragma omp parallel for
+	for (int i = 0; i < num_tris; ++i) {
+		int next = edge_offset[i];
+		for (int j = 0; j < 3; ++j)
+			if (ownsEdge(i, j)) {
+				edge_corner[next] = 3 * i + j;
+				edge_vertices[i][j] = num_verts + next++;
+			}
+	}
+#pragma omp parallel for
+	for (int i = 0; i < num_tris; ++i)
+		for (int j = 0; j < 3; ++j)
+			if (!ownsEdge(i, j))
+				edge_vertices[i][j] = edge_vertices[neighborTris[i][j]][neighborEdges[i][j]];
 
 	// Precompute boundary flags and boundary neighbors per vertex
     std::vector<bool> isBoundaryVertex(positions.size(), false);
@@ -201,184 +312,201 @@ void MeshWithConnectivity::LoopSubdivision(DrawMode mode, bool crude_boundaries)
 		return { nb0, nb1 };
 	};
 
-    for (size_t i = 0; i < indices.size(); ++i)
-        for (int j = 0; j < 3; ++j) {
-            int v0 = indices[i][j];
-            int v1 = indices[i][(j + 1) % 3];
-
-			// Map the edge endpoint indices to new vertex index.
-			// We use min and max because the edge direction does not matter when we finally
-			// rebuild the new faces (R3); this is how we always get unique indices for the map.
-			auto edge = std::make_pair(min(v0, v1), max(v0, v1));
-
-			// With naive iteration, we would find each edge twice, because each is part of two triangles
-			// (if the mesh does not have any holes/empty borders). Thus, we keep track of the already
-			// visited edges in the new_vertices map. That requires the small R3 task below in the 'if' block.
-            if (new_vertices.find(edge) == new_vertices.end()) {
-                // YOUR CODE HERE (R4): compute the position for odd (= new) vertex.
-                // You will need to use the neighbor information to find the correct vertices and then combine the four corner vertices with the correct weights.
-                // Be sure to see section 3.2 in the handout for an in depth explanation of the neighbor index tables; the scheme is somewhat involved.
-                Vector3f pos, col, norm;
-
-                // The default implementation just puts the new vertex at the edge midpoint.
-                pos = 0.5f * (positions[v0] + positions[v1]);
-                col = 0.5f * (colors[v0] + colors[v1]);
-                norm = 0.5f * (normals[v0] + normals[v1]);
-
-                // Only do this if "R3 & R4" or the full subdivision mode are selected in the UI
-                // (this allows you to see the different stages separately)
-                if (mode >= DrawMode::Subdivision_R3_R4) {
-                    // Loop edge rule: new (odd) vertex at edge midpoint refined using opposite vertices
-                    // Identify the two opposite vertices: one in current triangle i, one in neighboring triangle across edge (if any)
-                    int opp_curr = indices[i][(j + 2) % 3];
-                    int tri_nb = neighborTris[i][j];
-                    int edge_nb = neighborEdges[i][j];
-                    int opp_nb = -1;
-                    if (tri_nb != -1 && edge_nb != -1) {
-                        opp_nb = indices[tri_nb][(edge_nb + 2) % 3];
-                    }
-                    bool edge_is_boundary = (neighborTris[i][j] == -1);
-                    if (!crude_boundaries && edge_is_boundary) {
-                        // Proper boundary rule for odd vertex: stay at midpoint
-                        pos = 0.5f * (positions[v0] + positions[v1]);
-                        col = 0.5f * (colors[v0] + colors[v1]);
-                        norm = 0.5f * (normals[v0] + normals[v1]);
-                    } else {
-                        // Interior edge rule (or crude handling): 3/8 endpoints + 1/8 opposites
-                        const float w_end = 3.0f / 8.0f;
-                        const float w_opp = 1.0f / 8.0f;
-
-                        Vector3f p2 = (opp_curr >= 0) ? positions[opp_curr] : Vector3f::Zero();
-                        Vector3f p3 = (opp_nb   >= 0) ? positions[opp_nb]   : Vector3f::Zero();
-                        Vector3f c2 = (opp_curr >= 0) ? colors[opp_curr]   : Vector3f::Zero();
-                        Vector3f c3 = (opp_nb   >= 0) ? colors[opp_nb]     : Vector3f::Zero();
-                        Vector3f n2 = (opp_curr >= 0) ? normals[opp_curr]  : Vector3f::Zero();
-                        Vector3f n3 = (opp_nb   >= 0) ? normals[opp_nb]    : Vector3f::Zero();
-
-                        pos = w_end * (positions[v0] + positions[v1]) + w_opp * (p2 + p3);
-                        col = w_end * (colors[v0] + colors[v1]) + w_opp * (c2 + c3);
-                        norm = w_end * (normals[v0] + normals[v1]) + w_opp * (n2 + n3);
-                    }
-                    if (norm.norm() > 1e-8f) norm.normalize();
-                }
-
-				new_positions.push_back(pos);
-				new_colors.push_back(col);
-				new_normals.push_back(norm);
-				new_ages.push_back(0); // odd vertices are newly created this level
-
-				// YOUR CODE HERE (R3):
-				// Map the edge to the correct vertex index.
-				// This is just one line! Use new_vertices and the index of the position that was just pushed back to the vector.
-				new_vertices[edge] = static_cast<int>(new_positions.size()) - 1;
-			}
-		}
-    // compute positions for even (old) vertices
-	vector<bool> vertexComputed(new_positions.size(), false);
+	// Collects the one-ring of vertex indices[i][j] in the same order as traverseOneRing().
+	// Returns false if the walk runs into the boundary.
+	auto collectOneRing = [&](int i, int j, vector<int>& ring) {
+		ring.clear();
+		int ct = i, ce = j;
+		do {
+			ring.push_back(indices[ct][(ce + 1) % 3]);
+			int e_in = (ce + 2) % 3;
+			int nt = neighborTris[ct][e_in];
+			int ne = neighborEdges[ct][e_in];
+			if (nt == -1 || ne == -1)
+				return false;
+			ct = nt;
+			ce = ne;
+		} while (!(ct == i && ce == j) && (int)ring.size() <= num_verts);
+		return true;
+	};
 
-	for (int i = 0; i < (int)indices.size(); ++i) {
-		for (int j = 0; j < 3; ++j) {
+	// Each vertex is computed once, starting from its first corner in triangle order,
+	// which makes the one-ring walk independent of thread scheduling.
+	vector<int> first_corner(positions.size(), -1);
+	for (int i = num_tris - 1; i >= 0; --i)
+		for (int j = 2; j >= 0; --j)
+			first_corner[indices[i][j]] = 3 * i + j;
+
+	// Row r of the stencil holds the weights of refined vertex r: the old (even) vertices
+	// keep their indices, the new (odd) ones follow in edge order.
+	typedef std::pair<int, float> Weight;
+	auto stencilRow = [&](int r, vector<Weight>& row, vector<int>& ring) {
+		row.clear();
+		if (r >= num_verts) {
+			int i = edge_corner[r - num_verts] / 3;
+			int j = edge_corner[r - num_verts] % 3;
 			int v0 = indices[i][j];
-
-			// don't redo if this one is already done
-			if (vertexComputed[v0] )
-				continue;
-
-			vertexComputed[v0] = true;
-
+			int v1 = indices[i][(j + 1) % 3];
+
+			// YOUR CODE HERE (R4): compute the position for odd (= new) vertex.
+			// You will need to use the neighbor information to find the correct vertices and then combine the four corner vertices with the correct weights.
+			// Be sure to see section 3.2 in the handout for an in depth explanation of the neighbor index tables; the scheme is somewhat involved.
+
+			// Only do this if "R3 & R4" or the full subdivision mode are selected in the UI
+			// (this allows you to see the different stages separately)
+			bool edge_is_boundary = (neighborTris[i][j] == -1);
+			if (mode < DrawMode::Subdivision_R3_R4 || (!crude_boundaries && edge_is_boundary)) {
+				// The default implementation, and the proper boundary rule: the new vertex sits at the edge midpoint.
+				row.push_back({ v0, 0.5f });
+				row.push_back({ v1, 0.5f });
+			} else {
+				// Interior edge rule (or crude handling): 3/8 endpoints + 1/8 opposites.
+				// A crude boundary edge has only one opposite vertex; the missing one counts as zero.
+				const float w_end = 3.0f / 8.0f;
+				const float w_opp = 1.0f / 8.0f;
+				row.push_back({ v0, w_end });
+				row.push_back({ v1, w_end });
+				row.push_back({ indices[i][(j + 2) % 3], w_opp });
+				if (!edge_is_boundary)
+					row.push_back({ indices[neighborTris[i][j]][(neighborEdges[i][j] + 2) % 3], w_opp });
+			}
+		} else {
+			int v0 = r;
 
 			// YOUR CODE HERE (R5): reposition the old vertices
-
-			// This default implementation just passes the data through unchanged.
-			// You need to replace these three lines with the loop over the 1-ring
-			// around vertex v0, and compute the new position as a weighted average
-			// of the other vertices as described in the handout.
-
+			// The new position is a weighted average of the vertex and its 1-ring as described in the handout.
 			// If you're having a difficult time, you can try debugging your implementation
 			// with the debug highlight mode. If you press alt, traverseOneRing will be called
 			// for only the vertex under your mouse cursor, which should help with debugging.
 
-			Vector3f pos(Vector3f::Zero());
-			Vector3f norm(Vector3f::Zero());
-			Vector3f col(Vector3f::Zero());
-
-                pos = positions[v0];
-                col = colors[v0];
-                norm = normals[v0];
-
-                // Only do this if the full subdivision mode is selected in the UI
-                if (mode == DrawMode::Subdivision) {
-					if (isBoundaryVertex[v0]) {
-                        if (!crude_boundaries) {
-                            // Proper boundary rule for even (old) vertices on boundary:
-                            // v' = 3/4 v + 1/8 (v_prev + v_next)
-							// Prefer connectivity-based neighbors; fall back to precomputed if needed
-							auto nbs = findBoundaryNeighbors(v0, i, j);
-							int b0 = (nbs.first  != -1) ? nbs.first  : boundaryNeighbors[v0].first;
-							int b1 = (nbs.second != -1) ? nbs.second : boundaryNeighbors[v0].second;
-                            if (b0 != -1 && b1 != -1) {
-                                const float w_c = 3.0f / 4.0f;
-                                const float w_b = 1.0f / 8.0f;
-                                pos = w_c * positions[v0] + w_b * (positions[b0] + positions[b1]);
-                                col = w_c * colors[v0]    + w_b * (colors[b0]    + colors[b1]);
-                                norm = w_c * normals[v0]   + w_b * (normals[b0]   + normals[b1]);
-                                if (norm.norm() > 1e-8f) norm.normalize();
-                            }
-                            // if missing neighbors (degenerate), keep original
-                        } // else crude: keep original (no change)
-                    } else {
-                        // Interior vertex: use standard Loop even-vertex rule via one-ring traversal
-                        traverseOneRing(i, j, pos, norm, col, nullptr);
-                    }
-                }
-
-			new_positions[v0] = pos;
-			new_colors[v0] = col;
-			new_normals[v0] = norm;
-			// Age: even vertices survive to next level, increment age if present
-			if (v0 >= 0 && v0 < (int)ages.size()) new_ages[v0] = ages[v0] + 1; else new_ages[v0] = 1;
+			// Vertices that no triangle uses are passed through unchanged, and so is everything
+			// unless the full subdivision mode is selected in the UI.
+			row.push_back({ v0, 1.0f });
+			if (mode != DrawMode::Subdivision || first_corner[v0] == -1)
+				return;
+			int i = first_corner[v0] / 3;
+			int j = first_corner[v0] % 3;
+
+			if (isBoundaryVertex[v0]) {
+				if (crude_boundaries)
+					return; // crude: keep original (no change)
+				// Proper boundary rule for even (old) vertices on boundary:
+				// v' = 3/4 v + 1/8 (v_prev + v_next)
+				// Prefer connectivity-based neighbors; fall back to precomputed if needed.
+				// The walk only goes one way around v0, so it may find just one of the two;
+				// the pair must then come from the precomputed neighbors as a whole, since
+				// mixing the two sources can pick the same neighbor twice.
+				auto nbs = findBoundaryNeighbors(v0, i, j);
+				if (nbs.first == -1 || nbs.second == -1)
+					nbs = boundaryNeighbors[v0];
+				int b0 = nbs.first;
+				int b1 = nbs.second;
+				// if missing neighbors (degenerate), keep original
+				if (b0 != -1 && b1 != -1) {
+					row[0].second = 3.0f / 4.0f;
+					row.push_back({ b0, 1.0f / 8.0f });
+					row.push_back({ b1, 1.0f / 8.0f });
+				}
+			} else if (collectOneRing(i, j, ring)) {
+				// Interior vertex: standard Loop even-vertex rule over the one-ring
+				float nf = float(ring.size());
+				const float PI = 3.14159265358979323846f;
+				float theta = 2.0f * PI / nf;
+				float beta = (5.0f/8.0f - std::pow(3.0f/8.0f + 0.25f * std::cos(theta), 2.0f)) / nf;
+				row[0].second = 1.0f - nf * beta;
+				for (int v : ring)
+					row.push_back({ v, beta });
+			}
 		}
-	}
 
+		// Eigen wants the columns of a row sorted and unique.
+		std::sort(row.begin(), row.end(), [](const Weight& a, const Weight& b) { return a.first < b.first; });
+		size_t n = 0;
+		for (size_t k = 0; k < row.size(); ++k) {
+			if (n > 0 && row[n - 1].first == row[k].first)
+				row[n - 1].second += row[k].second;
+			else
+				row[n++] = row[k];
+		}
+		row.resize(n);
+	};
 
+	// Fill the compressed row storage directly: count the entries of every row, prefix sum,
+	// then write each row in parallel. This avoids sorting a big triplet list.
+	const int num_rows = num_verts + num_edges;
+	SubdivisionStencil stencil(num_rows, num_verts);
+	int* row_start = stencil.outerIndexPtr();
+#pragma omp parallel
+	{
+		vector<Weight> row;
+		vector<int> ring;
+#pragma omp for
+		for (int r = 0; r < num_rows; ++r) {
+			stencilRow(r, row, ring);
+			row_start[r + 1] = (int)row.size();
+		}
+#pragma omp single
+		{
+			row_start[0] = 0;
+			for (int r = 0; r < num_rows; ++r)
+				row_start[r + 1] += row_start[r];
+			stencil.resizeNonZeros(row_start[num_rows]);
+		}
+#pragma omp for
+		for (int r = 0; r < num_rows; ++r) {
+			stencilRow(r, row, ring);
+			for (size_t k = 0; k < row.size(); ++k) {
+				stencil.innerIndexPtr()[row_start[r] + k] = row[k].first;
+				stencil.valuePtr()[row_start[r] + k] = row[k].second;
+			}
+		}
+	}
 
 	// and then, finally, regenerate topology
 	// every triangle turns into four new ones
-	std::vector<Vector3i> new_indices;
-	new_indices.reserve(indices.size()*4);
-	for (size_t i = 0; i < indices.size(); ++i) {
+	new_indices.resize(indices.size() * 4);
+#pragma omp parallel for
+	for (int i = 0; i < num_tris; ++i) {
 		Vector3i even = indices[i]; // start vertices of e_0, e_1, e_2
 
-		// YOUR CODE HERE (R3):
-		// fill in X and Y (it's the same for both)
-		int X, Y;
-		// edge a between even[0] and even[1]
-		X = even[0]; Y = even[1];
-		auto edge_a = std::make_pair(min(X, Y), max(X, Y));
-		// edge b between even[1] and even[2]
-		X = even[1]; Y = even[2];
-		auto edge_b = std::make_pair(min(X, Y), max(X, Y));
-		// edge c between even[2] and even[0]
-		X = even[2]; Y = even[0];
-		auto edge_c = std::make_pair(min(X, Y), max(X, Y));
-
-		// The edges edge_a, edge_b and edge_c now define the vertex indices via new_vertices.
-		// (The mapping is done in the loop above.)
-		// The indices define the smaller triangle inside the indices defined by "even", in order.
-		// Read the vertex indices out of new_vertices to build the small triangle "odd"
-
-		Vector3i odd = Vector3i{ new_vertices[edge_a], new_vertices[edge_b], new_vertices[edge_c] };
+		// The new vertices on edges a (even[0]-even[1]), b (even[1]-even[2]) and c (even[2]-even[0])
+		// define the smaller triangle "odd" inside the one defined by "even", in order.
+		Vector3i odd = edge_vertices[i];
 
 		// Then, construct the four smaller triangles from the surrounding big triangle  "even"
-		// and the inner one, "odd". Push them to "new_indices".
+		// and the inner one, "odd".
 
 		// Maintain winding consistent with original: split into 3 outer + 1 inner triangle
-		new_indices.push_back(Vector3i(even[0], odd[0], odd[2]));
-		new_indices.push_back(Vector3i(even[1], odd[1], odd[0]));
-		new_indices.push_back(Vector3i(even[2], odd[2], odd[1]));
-		new_indices.push_back(Vector3i(odd[0], odd[1], odd[2]));
+		new_indices[4 * i + 0] = Vector3i(even[0], odd[0], odd[2]);
+		new_indices[4 * i + 1] = Vector3i(even[1], odd[1], odd[0]);
+		new_indices[4 * i + 2] = Vector3i(even[2], odd[2], odd[1]);
+		new_indices[4 * i + 3] = Vector3i(odd[0], odd[1], odd[2]);
 	}
 
+	return stencil;
+}
+
+void MeshWithConnectivity::LoopSubdivision(DrawMode mode, bool crude_boundaries, SubdivisionStencil* stencil) {
+	// The subdivision rules only depend on the topology, so they are collected into a sparse
+	// stencil first and then applied to each vertex attribute.
+	std::vector<Vector3i> new_indices;
+	SubdivisionStencil weights = buildSubdivisionStencil(mode, crude_boundaries, new_indices);
+
+	// The new data must be doublebuffered or otherwise some of the calculations below would
+	// not read the original positions but the newly changed ones, which is slightly wrong.
+	vector<Vector3f> new_positions;
+	vector<Vector3f> new_normals;
+	vector<Vector3f> new_colors;
+	applyStencil(weights, positions, new_positions);
+	applyStencil(weights, normals, new_normals);
+	applyStencil(weights, colors, new_colors);
+
+	// Age: even vertices survive to next level, odd vertices are newly created this level
+	vector<int> new_ages(weights.rows(), 0);
+	for (size_t v0 = 0; v0 < positions.size(); ++v0)
+		new_ages[v0] = (v0 < ages.size()) ? ages[v0] + 1 : 1;
+
+
 	// ADD THESE LINES when R3 is finished. Replace the originals with the repositioned data.
 	indices = std::move(new_indices);
 	positions = std::move(new_positions);
@@ -422,6 +550,9 @@ void MeshWithConnectivity::LoopSubdivision(DrawMode mode, bool crude_boundaries)
 	if (!showAgePalette) {
 		colorizeByCurvature();
 	}
+
+	if (stencil)
+		*stencil = std::move(weights);
 }
 
 void MeshWithConnectivity::colorizeByCurvature(float gamma, float percentile)
@@ -631,11 +762,23 @@ MeshWithConnectivity* MeshWithConnectivity::loadOBJ(const string& filename, bool
 	return pMesh;
 }
 
+namespace
+{
+	// index of the corner of triangle tri that is closest to hit
+	int closestCorner(const MeshWithConnectivity& m, int tri, const Vector3f& hit)
+	{
+		const Vector3f& p0 = m.positions[m.indices[tri](0)];
+		const Vector3f& p1 = m.positions[m.indices[tri](1)];
+		const Vector3f& p2 = m.positions[m.indices[tri](2)];
+		int retind = (p0-hit).norm()<(p1-hit).norm()?0:1;
+		return std::min((p0-hit).norm(), (p1-hit).norm())<(p2-hit).norm()?retind:2;
+	}
+}
+
 std::tuple<int,int> MeshWithConnectivity::pickTriangle(const Vector3f& o, const Vector3f& d) const
 {
 	float mint = FLT_MAX;
 	int rettri = -1;
-	int retind = -1;
 	for (size_t i = 0; i < indices.size(); ++i)
 	{
 		const Vector3f& p0 = positions[indices[i](0)];
@@ -659,11 +802,22 @@ std::tuple<int,int> MeshWithConnectivity::pickTriangle(const Vector3f& o, const
 		{
 			mint = t;
 			rettri = i;
-
-			Vector3f hit = o+t*d;
-			retind = (p0-hit).norm()<(p1-hit).norm()?0:1;
-			retind = std::min((p0-hit).norm(), (p1-hit).norm())<(p2-hit).norm()?retind:2;
 		}
 	}
-	return std::make_tuple(rettri, retind);
+	if (rettri == -1)
+		return std::make_tuple(-1, -1);
+	return std::make_tuple(rettri, closestCorner(*this, rettri, o + mint * d));
+}
+
+std::tuple<int,int> MeshWithConnectivity::pickTriangle(const Vector3f& o, const Vector3f& d, RayQuery& query) const
+{
+	if (query.numTriangles() != indices.size())
+		query.build(positions, indices);
+	else if (query.stale)
+		query.refit(positions, indices);
+
+	RayHit hit;
+	if (!query.closestHit(o, d, 1.0f, hit))
+		return std::make_tuple(-1, -1);
+	return std::make_tuple(hit.triangle, closestCorner(*this, hit.triangle, o + hit.t * d));
 }
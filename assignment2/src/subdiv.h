@@ -1,7 +1,31 @@
 #pragma once
 
 #include "app.h"
+#include "ray_query.h"
 #include <map>
+#include <Eigen/Sparse>
+
+// How face normals are weighted when they are averaged into vertex normals:
+// by triangle area (the plain sum of cross products), or by the corner angle.
+enum class NormalWeighting
+{
+	Area,
+	Angle
+};
+
+// Loop subdivision written as a sparse matrix: row r holds the weights with which the vertices
+// of the coarse mesh are combined into vertex r of the refined mesh. The weights depend only on
+// the topology, so a stencil is built once and can be reapplied whenever the coarse positions
+// change. Stencils of consecutive levels multiply into one that maps the control mesh directly
+// to any level.
+using SubdivisionStencil = Eigen::SparseMatrix<float, Eigen::RowMajor>;
+
+// Evaluates out[r] = sum over c of stencil(r, c) * in[c], in parallel over the rows.
+// in and out must not be the same vector.
+void applyStencil(const SubdivisionStencil& stencil, const vector<Vector3f>& in, vector<Vector3f>& out);
+
+// Bytes held by the nonzeros and the row starts of a stencil.
+size_t stencilBytes(const SubdivisionStencil& stencil);
 
 // This class converts a regular mesh into a form suitable for performing subdivision.
 // In particular, it computes neighbor information that determines, for each triangle,
@@ -10,13 +34,24 @@ struct MeshWithConnectivity
 {
 	static MeshWithConnectivity* loadOBJ		(const string& filename, bool crude_boundary = false);
 
-	// This is where all of the subdivision requirements happen.
-	void LoopSubdivision(DrawMode mode, bool crude_boundaries);
+	// This is where all of the subdivision requirements happen. If stencil is given, it receives
+	// the weights that map the vertices before the subdivision to the ones after it.
+	void LoopSubdivision(DrawMode mode, bool crude_boundaries, SubdivisionStencil* stencil = nullptr);
+
+	// The topology-only half of LoopSubdivision(): the refinement weights and the new triangles.
+	// Needs the connectivity.
+	SubdivisionStencil buildSubdivisionStencil(DrawMode mode, bool crude_boundaries, vector<Vector3i>& new_indices) const;
 
 	void colorizeByCurvature(float gamma = 0.6f, float percentile = 0.9f);
 
 	// Supporting functionality.
 	void computeConnectivity();
+	// Frees neighborTris and neighborEdges. They are only needed to refine the mesh or to inspect
+	// it, so levels that are merely drawn can do without; computeConnectivity() brings them back.
+	void releaseConnectivity();
+	bool hasConnectivity() const { return !indices.empty() && neighborTris.size() == indices.size(); }
+	// Bytes held by the vertex, index and connectivity arrays.
+	size_t memoryBytes() const;
 	void computeVertexNormals();
 	void traverseOneRing(int i, int j, Vector3f& position, Vector3f& normal, Vector3f& color, vector<int>* debug_indices) const;
 
@@ -30,6 +65,9 @@ struct MeshWithConnectivity
 	// age of each vertex (0 for newly created this level, increases with each subdivision step)
 	vector<int>		ages;
 
+	// used by computeVertexNormals(); carried over to subdivided copies
+	NormalWeighting	normal_weighting = NormalWeighting::Area;
+
 	// index data
 	// (for each triangle, a triplet of indices into the above vertex data arrays)
 	vector<Vector3i>	indices;
@@ -47,7 +85,11 @@ struct MeshWithConnectivity
 		}
 	};
 
+	// Closest triangle hit by o + t * d for 0 < t < 1, and which of its corners is closest to the
+	// hit, or (-1, -1). The first tests every triangle; the second goes through query, which is built
+	// if it was built for a different number of triangles, and refitted if it is marked stale.
 	std::tuple<int,int> pickTriangle(const Vector3f& o, const Vector3f& d) const;
+	std::tuple<int,int> pickTriangle(const Vector3f& o, const Vector3f& d, RayQuery& query) const;
 
 
 };
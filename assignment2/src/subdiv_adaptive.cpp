@@ -0,0 +1,258 @@
+#include "app.h"
+
+#include "subdiv_adaptive.h"
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cstdint>
+
+namespace
+{
+    struct Triangle
+    {
+        Vector3i        v;                  // vertex indices
+        Eigen::Vector2f uv[3];              // where the corners lie in control triangle face
+        int             face;
+        int             level;              // red splits since the control mesh
+        int             sibling = -1;       // the other half of a green split, -1 if not green
+        bool            first_half = false; // green halves are (a, m, c) and (m, b, c) of parent (a, b, c)
+        bool            alive = true;
+    };
+
+    // A new vertex halfway along an edge of control triangle face, still to be evaluated.
+    struct Midpoint
+    {
+        int             face;
+        Eigen::Vector2f uv;
+        int             vertex;
+    };
+
+    uint64_t edgeKey(int a, int b)
+    {
+        if (a > b)
+            std::swap(a, b);
+        return (uint64_t(uint32_t(a)) << 32) | uint64_t(uint32_t(b));
+    }
+}
+
+MeshWithConnectivity* adaptiveLoopSubdivision(const LoopLimitEvaluator& limit, const AdaptiveSubdivisionSettings& settings)
+{
+    const MeshWithConnectivity& control = limit.control();
+    const int num_control_verts = (int)control.positions.size();
+
+    vector<Vector3f> positions(num_control_verts);
+    vector<Vector3f> normals(num_control_verts);
+#pragma omp parallel for
+    for (int v = 0; v < num_control_verts; ++v)
+        limit.evaluateVertex(v, positions[v], normals[v]);
+
+    Vector3f lo = Vector3f::Constant(FLT_MAX), hi = Vector3f::Constant(-FLT_MAX);
+    for (const auto& p : control.positions) {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    const float tolerance = settings.tolerance * (hi - lo).norm();
+
+    vector<Triangle> tris(control.indices.size());
+    for (size_t i = 0; i < tris.size(); ++i) {
+        tris[i].v = control.indices[i];
+        tris[i].uv[0] = Eigen::Vector2f(0.0f, 0.0f);
+        tris[i].uv[1] = Eigen::Vector2f(1.0f, 0.0f);
+        tris[i].uv[2] = Eigen::Vector2f(0.0f, 1.0f);
+        tris[i].face = int(i);
+        tris[i].level = 0;
+    }
+
+    auto needsRefinement = [&](const Triangle& t) {
+        if (t.level >= settings.max_level)
+            return false;
+        for (int j = 0; j < 3; ++j) {
+            int a = t.v[j], b = t.v[(j + 1) % 3];
+            if (std::abs((normals[b] - normals[a]).dot(positions[b] - positions[a])) > 8.0f * tolerance)
+                return true;
+        }
+        if (settings.max_pixels > 0.0f) {
+            Eigen::Vector2f screen[3];
+            for (int j = 0; j < 3; ++j) {
+                Vector4f clip = settings.world_to_clip * positions[t.v[j]].homogeneous();
+                if (clip.w() <= 0.0f)
+                    return false;
+                screen[j] = Eigen::Vector2f(clip.x() / clip.w() * 0.5f * settings.viewport_width,
+                                            clip.y() / clip.w() * 0.5f * settings.viewport_height);
+            }
+            for (int j = 0; j < 3; ++j)
+                if ((screen[(j + 1) % 3] - screen[j]).norm() > settings.max_pixels)
+                    return true;
+        }
+        return false;
+    };
+
+    // every edge that has been split, and the vertex that splits it
+    std::unordered_map<uint64_t, int> split_edges;
+    vector<Midpoint> pending;
+    auto midpoint = [&](const Triangle& t, int j) {
+        auto it = split_edges.find(edgeKey(t.v[j], t.v[(j + 1) % 3]));
+        return it == split_edges.end() ? -1 : it->second;
+    };
+    auto splitEdges = [&](const Triangle& t) {
+        for (int j = 0; j < 3; ++j) {
+            auto inserted = split_edges.emplace(edgeKey(t.v[j], t.v[(j + 1) % 3]), int(positions.size()));
+            if (inserted.second) {
+                pending.push_back(Midpoint{ t.face, 0.5f * (t.uv[j] + t.uv[(j + 1) % 3]), int(positions.size()) });
+                positions.emplace_back();
+                normals.emplace_back();
+            }
+        }
+    };
+    // merges a green pair back into its parent, which takes the place of the first half
+    auto mergeGreen = [&](int t) {
+        int first = tris[t].first_half ? t : tris[t].sibling;
+        int second = tris[first].sibling;
+        tris[first].v[1] = tris[second].v[1];
+        tris[first].uv[1] = tris[second].uv[1];
+        tris[first].sibling = -1;
+        tris[second].alive = false;
+        return first;
+    };
+
+    vector<char> red;
+    for (;;) {
+        red.assign(tris.size(), 0);
+        int marked = 0;
+#pragma omp parallel for reduction(+:marked)
+        for (int t = 0; t < (int)tris.size(); ++t)
+            if (tris[t].alive && needsRefinement(tris[t])) {
+                red[t] = 1;
+                ++marked;
+            }
+        if (marked == 0)
+            break;
+
+        pending.clear();
+        for (size_t t = 0; t < tris.size(); ++t)
+            if (red[t] && tris[t].alive && tris[t].sibling != -1)
+                red[mergeGreen(int(t))] = 1;
+        for (size_t t = 0; t < tris.size(); ++t)
+            if (red[t] && tris[t].alive)
+                splitEdges(tris[t]);
+
+        for (;;) {
+            // Closure: a triangle with two or three split edges goes red, and so does the parent
+            // of a green triangle with any split edge. Their new splits can spread further.
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (size_t t = 0; t < tris.size(); ++t) {
+                    if (!tris[t].alive || red[t])
+                        continue;
+                    int count = int(midpoint(tris[t], 0) != -1) + int(midpoint(tris[t], 1) != -1) + int(midpoint(tris[t], 2) != -1);
+                    if (count == 0 || (count == 1 && tris[t].sibling == -1))
+                        continue;
+                    int r = tris[t].sibling != -1 ? mergeGreen(int(t)) : int(t);
+                    red[r] = 1;
+                    splitEdges(tris[r]);
+                    changed = true;
+                }
+            }
+
+            // Split the red triangles. A child can already have split edges where the neighbor
+            // is two levels finer, so the closure runs again on the children.
+            const size_t num_tris = tris.size();
+            bool split_any = false;
+            for (size_t t = 0; t < num_tris; ++t) {
+                if (!red[t] || !tris[t].alive)
+                    continue;
+                Triangle parent = tris[t];
+                int m[3];
+                Eigen::Vector2f muv[3];
+                for (int j = 0; j < 3; ++j) {
+                    m[j] = midpoint(parent, j);
+                    muv[j] = 0.5f * (parent.uv[j] + parent.uv[(j + 1) % 3]);
+                }
+                Triangle child = parent;
+                child.level = parent.level + 1;
+                child.v = Vector3i(m[0], m[1], m[2]);
+                child.uv[0] = muv[0]; child.uv[1] = muv[1]; child.uv[2] = muv[2];
+                tris[t] = child;
+                red[t] = 0;
+                for (int j = 0; j < 3; ++j) {
+                    // corner j keeps vertex j and the midpoints of the two edges that meet there
+                    child.v = Vector3i(parent.v[j], m[j], m[(j + 2) % 3]);
+                    child.uv[0] = parent.uv[j]; child.uv[1] = muv[j]; child.uv[2] = muv[(j + 2) % 3];
+                    tris.push_back(child);
+                    red.push_back(0);
+                }
+                split_any = true;
+            }
+            if (!split_any)
+                break;
+        }
+
+        // What is left with a single split edge is cut in two.
+        const size_t num_tris = tris.size();
+        for (size_t t = 0; t < num_tris; ++t) {
+            if (!tris[t].alive)
+                continue;
+            for (int j = 0; j < 3; ++j) {
+                int mid = midpoint(tris[t], j);
+                if (mid == -1)
+                    continue;
+                Triangle parent = tris[t];
+                int a = (j + 1) % 3, c = (j + 2) % 3;
+                Eigen::Vector2f muv = 0.5f * (parent.uv[j] + parent.uv[a]);
+                Triangle first = parent, second = parent;
+                first.v = Vector3i(parent.v[j], mid, parent.v[c]);
+                first.uv[0] = parent.uv[j]; first.uv[1] = muv; first.uv[2] = parent.uv[c];
+                first.first_half = true;
+                first.sibling = int(tris.size());
+                second.v = Vector3i(mid, parent.v[a], parent.v[c]);
+                second.uv[0] = muv; second.uv[1] = parent.uv[a]; second.uv[2] = parent.uv[c];
+                second.first_half = false;
+                second.sibling = int(t);
+                tris[t] = first;
+                tris.push_back(second);
+                break;
+            }
+        }
+
+        // Place the new vertices on the limit surface, batched per control triangle so that the
+        // local subdivision steps are shared.
+        std::sort(pending.begin(), pending.end(), [](const Midpoint& a, const Midpoint& b) { return a.face < b.face; });
+        vector<int> group_start;
+        for (size_t k = 0; k < pending.size(); ++k)
+            if (k == 0 || pending[k].face != pending[k - 1].face)
+                group_start.push_back(int(k));
+        group_start.push_back(int(pending.size()));
+#pragma omp parallel
+        {
+            vector<Eigen::Vector2f> uv;
+            vector<Vector3f> p, n;
+#pragma omp for schedule(dynamic)
+            for (int g = 0; g < (int)group_start.size() - 1; ++g) {
+                uv.clear();
+                for (int k = group_start[g]; k < group_start[g + 1]; ++k)
+                    uv.push_back(pending[k].uv);
+                limit.evaluate(pending[group_start[g]].face, uv, p, n);
+                for (int k = group_start[g]; k < group_start[g + 1]; ++k) {
+                    positions[pending[k].vertex] = p[k - group_start[g]];
+                    normals[pending[k].vertex] = n[k - group_start[g]];
+                }
+            }
+        }
+    }
+
+    MeshWithConnectivity* pMesh = new MeshWithConnectivity();
+    pMesh->normal_weighting = control.normal_weighting;
+    for (const auto& t : tris)
+        if (t.alive)
+            pMesh->indices.push_back(t.v);
+    pMesh->positions = std::move(positions);
+    pMesh->normals = std::move(normals);
+    pMesh->colors.assign(pMesh->positions.size(), Vector3f{ 0.75f, 0.75f, 0.75f });
+    pMesh->ages.assign(pMesh->positions.size(), 0);
+    pMesh->computeConnectivity();
+    pMesh->colorizeByCurvature();
+    return pMesh;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "app.h"
+#include "subdiv.h"
+#include "subdiv_patch.h"
+
+struct AdaptiveSubdivisionSettings
+{
+    int         max_level = 4;          // no triangle is refined deeper than this many red splits
+    float       tolerance = 1e-3f;      // allowed distance to the limit surface, relative to the bounding box diagonal
+    float       max_pixels = 0.0f;      // if positive, triangles with longer edges on screen are refined too
+    Matrix4f    world_to_clip = Matrix4f::Identity();
+    float       viewport_width = 0.0f;
+    float       viewport_height = 0.0f;
+};
+
+// Loop subdivision that only refines where it is needed. In each pass, triangles that are still
+// further from the limit surface than the tolerance, or too large on screen, are split in four
+// (red). Any triangle left with two or three split edges is split red too, and one with a single
+// split edge is cut in two (green), so that no T-junctions remain. Green triangles are never split
+// again: when one needs refining, it is merged with its other half and the parent is split red,
+// which keeps repeated passes from producing slivers.
+// The distance to the limit surface is estimated per edge as |(n1 - n0) . (p1 - p0)| / 8, the
+// sagitta of a circular arc through the endpoints with normals n0 and n1.
+// All vertices are placed on the limit surface with the evaluator. A vertex is then at the same
+// place no matter at which level it was created, so regions of different levels meet without
+// cracks and no restricted hierarchy of levels has to be kept.
+MeshWithConnectivity*   adaptiveLoopSubdivision(const LoopLimitEvaluator& limit, const AdaptiveSubdivisionSettings& settings);
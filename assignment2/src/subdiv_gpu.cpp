@@ -0,0 +1,173 @@
+#include "app.h"
+
+#include "subdiv_gpu.h"
+
+#include <vector>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+    GLuint makeBufferTexture(GLuint buffer, GLenum format)
+    {
+        GLuint texture = 0;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        return texture;
+    }
+}
+
+GpuStencilEvaluator::~GpuStencilEvaluator()
+{
+    if (m_vao != 0) {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteTextures(1, &m_control_texture);
+        glDeleteTextures(1, &m_row_texture);
+        glDeleteTextures(1, &m_weight_texture);
+        glDeleteBuffers(1, &m_control_buffer);
+        glDeleteBuffers(1, &m_row_buffer);
+        glDeleteBuffers(1, &m_weight_buffer);
+    }
+}
+
+bool GpuStencilEvaluator::upload(const SubdivisionStencil& stencil)
+{
+    GLint max_texels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    if (stencil.nonZeros() > max_texels || stencil.rows() + 1 > max_texels || 2 * stencil.cols() > max_texels) {
+        std::cerr << "Subdivision stencil with " << stencil.nonZeros() << " weights exceeds GL_MAX_TEXTURE_BUFFER_SIZE (" << max_texels << ")" << std::endl;
+        return false;
+    }
+
+    // Each weight is stored next to its column in one RG32I texel so that the shader
+    // fetches an entry with a single lookup. The weight travels as raw integer bits: going
+    // the other way, most columns would be denormal floats that GPUs may flush to zero.
+    std::vector<int> weights(2 * size_t(stencil.nonZeros()));
+    for (Eigen::Index k = 0; k < stencil.nonZeros(); ++k) {
+        weights[2 * k] = stencil.innerIndexPtr()[k];
+        std::memcpy(&weights[2 * k + 1], &stencil.valuePtr()[k], sizeof(int));
+    }
+
+    glGenBuffers(1, &m_row_buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, m_row_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * (stencil.rows() + 1), stencil.outerIndexPtr(), GL_STATIC_DRAW);
+    glGenBuffers(1, &m_weight_buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, m_weight_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * weights.size(), weights.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &m_control_buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, m_control_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, 2 * sizeof(Vector4f) * stencil.cols(), nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    m_row_texture = makeBufferTexture(m_row_buffer, GL_R32I);
+    m_weight_texture = makeBufferTexture(m_weight_buffer, GL_RG32I);
+    m_control_texture = makeBufferTexture(m_control_buffer, GL_RGBA32F);
+
+    // the pass has no vertex attributes, but the core profile needs a VAO to draw
+    glGenVertexArrays(1, &m_vao);
+
+    m_rows = int(stencil.rows());
+    m_columns = int(stencil.cols());
+    return true;
+}
+
+void GpuStencilEvaluator::evaluate(const vector<Vector3f>& control_positions, const vector<Vector3f>& control_normals, GLuint vertex_buffer) const
+{
+    if (m_rows == 0)
+        return;
+
+    // RGB32F buffer textures need GL 4.0, so each control vertex takes two RGBA texels.
+    static vector<Vector4f> control;
+    control.resize(2 * size_t(m_columns));
+    for (int c = 0; c < m_columns; ++c) {
+        control[2 * c] << control_positions[c], 1.0f;
+        control[2 * c + 1] << control_normals[c], 0.0f;
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, m_control_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(Vector4f) * control.size(), control.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    glUseProgram(program());
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, m_control_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, m_row_texture);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, m_weight_texture);
+
+    // positions and normals go to their own ranges of the vertex buffer; colors are left alone
+    GLsizeiptr bytes = sizeof(Vector3f) * GLsizeiptr(m_rows);
+    glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vertex_buffer, 0, bytes);
+    glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 1, vertex_buffer, bytes, bytes);
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(m_vao);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, m_rows);
+    glEndTransformFeedback();
+    glBindVertexArray(0);
+    glDisable(GL_RASTERIZER_DISCARD);
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 1, 0);
+    for (int unit = 2; unit >= 0; --unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+    glUseProgram(0);
+}
+
+GLuint GpuStencilEvaluator::program()
+{
+    static GLuint s_program = 0;
+    if (s_program != 0)
+        return s_program;
+
+    // ShaderProgram links right away, and the transform feedback outputs have to be declared
+    // before linking, so the program is put together by hand from its helpers.
+    GLuint vertex_shader = ShaderProgram::createGLShader(GL_VERTEX_SHADER, "GL_VERTEX_SHADER",
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            uniform samplerBuffer uControl;     // position and normal of each control vertex
+            uniform isamplerBuffer uRowStart;   // first stencil entry of each refined vertex
+            uniform isamplerBuffer uWeights;    // (column, weight bits) per stencil entry
+
+            out vec3 outPosition;
+            out vec3 outNormal;
+
+            void main()
+            {
+                int begin = texelFetch(uRowStart, gl_VertexID).x;
+                int end = texelFetch(uRowStart, gl_VertexID + 1).x;
+                vec3 p = vec3(0.0);
+                vec3 n = vec3(0.0);
+                for (int k = begin; k < end; ++k)
+                {
+                    ivec2 entry = texelFetch(uWeights, k).xy;
+                    int c = entry.x;
+                    float w = intBitsToFloat(entry.y);
+                    p += w * texelFetch(uControl, 2 * c).xyz;
+                    n += w * texelFetch(uControl, 2 * c + 1).xyz;
+                }
+                outPosition = p;
+                outNormal = length(n) > 1e-8 ? normalize(n) : n;
+            }
+        ));
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    const char* varyings[] = { "outPosition", "outNormal" };
+    glTransformFeedbackVaryings(program, 2, varyings, GL_SEPARATE_ATTRIBS);
+    ShaderProgram::linkGLProgram(program);
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "uControl"), 0);
+    glUniform1i(glGetUniformLocation(program, "uRowStart"), 1);
+    glUniform1i(glGetUniformLocation(program, "uWeights"), 2);
+    glUseProgram(0);
+
+    s_program = program;
+    return s_program;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "app.h"
+#include "subdiv.h"
+
+// Evaluates a subdivision stencil on the GPU with transform feedback. The control vertices and
+// the stencil weights live in buffer textures, and a vertex shader runs once per refined vertex:
+// it gathers its row of the stencil and writes the position and normal straight into the vertex
+// buffer that renderMesh() draws from, so a deformed mesh never goes through the CPU.
+// Normals are the stencil applied to the control normals, which is smooth but not the exact
+// normal of the refined triangles that computeVertexNormals() gives.
+class GpuStencilEvaluator
+{
+public:
+                            GpuStencilEvaluator() = default;
+                            ~GpuStencilEvaluator();
+                            GpuStencilEvaluator(const GpuStencilEvaluator&) = delete;
+    GpuStencilEvaluator&    operator=(const GpuStencilEvaluator&) = delete;
+
+    // Uploads the stencil. Returns false if it does not fit in a buffer texture.
+    bool                    upload(const SubdivisionStencil& stencil);
+
+    // Writes the refined positions and normals into vertex_buffer, which must hold rows()
+    // positions followed by rows() normals, as laid out by uploadGeometryToGPU().
+    void                    evaluate(const vector<Vector3f>& control_positions, const vector<Vector3f>& control_normals, GLuint vertex_buffer) const;
+
+    int                     rows() const { return m_rows; }
+
+private:
+    static GLuint           program();
+
+    GLuint                  m_control_buffer = 0;
+    GLuint                  m_control_texture = 0;
+    GLuint                  m_row_buffer = 0;
+    GLuint                  m_row_texture = 0;
+    GLuint                  m_weight_buffer = 0;
+    GLuint                  m_weight_texture = 0;
+    GLuint                  m_vao = 0;
+
+    int                     m_rows = 0;
+    int                     m_columns = 0;
+};
@@ -0,0 +1,441 @@
+#include "app.h"
+
+#include "subdiv_patch.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const float PI = 3.14159265358979323846f;
+
+    // The 12 basis functions of the regular Loop patch times 12, as coefficients of the
+    // monomials u^i v^j in the order (i, j) = (0,0) (0,1) (0,2) (0,3) (0,4) (1,0) (1,1)
+    // (1,2) (1,3) (2,0) (2,1) (2,2) (3,0) (3,1) (4,0). They are Stam's box spline basis
+    // expanded into monomials. The control points are numbered by their lattice position
+    // (a, b), where the patch's triangle is (0,0) (1,0) (0,1) and the point (u, v) lies at
+    // lattice position (u, v):
+    //   0 (0,0)   1 (1,0)   2 (0,1)   3 (-1,1)   4 (-1,0)   5 (0,-1)
+    //   6 (1,-1)  7 (2,-1)  8 (2,0)   9 (1,1)   10 (0,2)   11 (-1,2)
+    const int boxSplineBasis[12][15] = {
+        { 6,  0, -12,  8, -1,  0, -12,  12, -2, -12,  12, 0,  8, -2, -1 },
+        { 1,  2,   0, -4,  2,  4,   6, -12,  4,   6,  -6, 0, -4, -2, -1 },
+        { 1,  4,   6, -4, -1,  2,   6,  -6, -2,   0, -12, 0, -4,  4,  2 },
+        { 1,  2,   0, -4,  2, -2,  -6,   0,  4,   0,   6, 0,  2, -2, -1 },
+        { 1, -2,   0,  2, -1, -4,   6,   0, -2,   6,  -6, 0, -4,  2,  1 },
+        { 1, -4,   6, -4,  1, -2,   6,  -6,  2,   0,   0, 0,  2, -2, -1 },
+        { 1, -2,   0,  2, -1,  2,  -6,   6, -2,   0,   0, 0, -4,  4,  2 },
+        { 0,  0,   0,  0,  0,  0,   0,   0,  0,   0,   0, 0,  2, -2, -1 },
+        { 0,  0,   0,  0,  0,  0,   0,   0,  0,   0,   0, 0,  0,  2,  1 },
+        { 0,  0,   0,  2, -1,  0,   0,   6, -2,   0,   6, 0,  2, -2, -1 },
+        { 0,  0,   0,  0,  1,  0,   0,   0,  2,   0,   0, 0,  0,  0,  0 },
+        { 0,  0,   0,  2, -1,  0,   0,   0, -2,   0,   0, 0,  0,  0,  0 },
+    };
+
+    // Position and normal of the regular patch with control points p at (u, v).
+    void evaluateBoxSpline(const Vector3f p[12], float u, float v, Vector3f& position, Vector3f& normal)
+    {
+        float up[5] = { 1.0f, u, u * u, u * u * u, u * u * u * u };
+        float vp[5] = { 1.0f, v, v * v, v * v * v, v * v * v * v };
+        float m[15], du[15], dv[15];
+        int k = 0;
+        for (int i = 0; i <= 4; ++i)
+            for (int j = 0; j <= 4 - i; ++j, ++k) {
+                m[k] = up[i] * vp[j];
+                du[k] = i > 0 ? float(i) * up[i - 1] * vp[j] : 0.0f;
+                dv[k] = j > 0 ? float(j) * up[i] * vp[j - 1] : 0.0f;
+            }
+
+        Vector3f s = Vector3f::Zero();
+        Vector3f su = Vector3f::Zero();
+        Vector3f sv = Vector3f::Zero();
+        for (int b = 0; b < 12; ++b) {
+            float w = 0.0f, wu = 0.0f, wv = 0.0f;
+            for (k = 0; k < 15; ++k) {
+                w += float(boxSplineBasis[b][k]) * m[k];
+                wu += float(boxSplineBasis[b][k]) * du[k];
+                wv += float(boxSplineBasis[b][k]) * dv[k];
+            }
+            s += w * p[b];
+            su += wu * p[b];
+            sv += wv * p[b];
+        }
+        position = s / 12.0f;
+        normal = su.cross(sv).normalized();
+    }
+
+    // Collects the one-ring of vertex indices[i][j] counterclockwise, starting from the
+    // other end of edge j. Returns false if the walk runs into the boundary.
+    bool collectOneRing(const MeshWithConnectivity& mesh, int i, int j, vector<int>& ring)
+    {
+        ring.clear();
+        int ct = i, ce = j;
+        do {
+            ring.push_back(mesh.indices[ct][(ce + 1) % 3]);
+            int e_in = (ce + 2) % 3;
+            int nt = mesh.neighborTris[ct][e_in];
+            int ne = mesh.neighborEdges[ct][e_in];
+            if (nt == -1 || ne == -1)
+                return false;
+            ct = nt;
+            ce = ne;
+        } while (!(ct == i && ce == j) && ring.size() <= mesh.positions.size());
+        return true;
+    }
+
+    // Looks up the 12 control points of face's patch in the order of boxSplineBasis.
+    // Returns false if the patch is not regular.
+    bool regularPatch(const MeshWithConnectivity& mesh, int face, Vector3f p[12])
+    {
+        vector<int> rings[3];
+        for (int j = 0; j < 3; ++j)
+            if (!collectOneRing(mesh, face, j, rings[j]) || rings[j].size() != 6)
+                return false;
+
+        // each ring starts at the next corner of the face and runs counterclockwise
+        const int points[12] = {
+            mesh.indices[face][0], mesh.indices[face][1], mesh.indices[face][2],
+            rings[0][2], rings[0][3], rings[0][4], rings[0][5],
+            rings[1][3], rings[1][4], rings[1][5],
+            rings[2][3], rings[2][4]
+        };
+        for (int b = 0; b < 12; ++b)
+            p[b] = mesh.positions[points[b]];
+        return true;
+    }
+
+    // Limit position and normal of vertex indices[i][j] from the Loop limit masks. Returns false
+    // at the boundary, where the position is exact but the normal is only an approximation.
+    bool limitVertex(const MeshWithConnectivity& mesh, int i, int j, Vector3f& position, Vector3f& normal)
+    {
+        const Vector3f& c = mesh.positions[mesh.indices[i][j]];
+        vector<int> ring;
+        if (collectOneRing(mesh, i, j, ring)) {
+            // Interior: the limit point weighs the ring by 1/(n + 3/(8 beta)), and the
+            // tangents are the first Fourier components of the ring.
+            float n = float(ring.size());
+            float beta = (5.0f/8.0f - std::pow(3.0f/8.0f + 0.25f * std::cos(2.0f * PI / n), 2.0f)) / n;
+            float chi = 1.0f / (n + 3.0f / (8.0f * beta));
+            Vector3f sum = Vector3f::Zero();
+            Vector3f t1 = Vector3f::Zero();
+            Vector3f t2 = Vector3f::Zero();
+            for (size_t k = 0; k < ring.size(); ++k) {
+                const Vector3f& q = mesh.positions[ring[k]];
+                sum += q;
+                t1 += std::cos(2.0f * PI * float(k) / n) * q;
+                t2 += std::sin(2.0f * PI * float(k) / n) * q;
+            }
+            position = (1.0f - n * chi) * c + chi * sum;
+            normal = t1.cross(t2).normalized();
+            return true;
+        }
+
+        // Boundary: turn clockwise to the first triangle of the fan, then collect the ring
+        // counterclockwise from one boundary neighbor to the other.
+        int ct = i, ce = j;
+        for (size_t guard = 0; mesh.neighborTris[ct][ce] != -1 && guard < mesh.indices.size(); ++guard) {
+            int nt = mesh.neighborTris[ct][ce];
+            int ne = mesh.neighborEdges[ct][ce];
+            ct = nt;
+            ce = (ne + 1) % 3;
+        }
+        collectOneRing(mesh, ct, ce, ring);
+        for (int guard = 0; guard < int(mesh.indices.size()); ++guard) {
+            int e_in = (ce + 2) % 3;
+            if (mesh.neighborTris[ct][e_in] == -1)
+                break;
+            int nt = mesh.neighborTris[ct][e_in];
+            ce = mesh.neighborEdges[ct][e_in];
+            ct = nt;
+        }
+        ring.push_back(mesh.indices[ct][(ce + 2) % 3]);
+
+        // The boundary curve is a cubic B-spline, whose limit mask is (1, 4, 1) / 6 and whose
+        // tangent is the difference of the two boundary neighbors. The tangent across the
+        // boundary uses the masks of Hoppe et al. 1994, which depend on the number of triangles k.
+        const Vector3f& b0 = mesh.positions[ring.front()];
+        const Vector3f& b1 = mesh.positions[ring.back()];
+        position = (2.0f / 3.0f) * c + (1.0f / 6.0f) * (b0 + b1);
+        int k = int(ring.size()) - 1;
+        Vector3f across;
+        if (k == 1)
+            across = b0 + b1 - 2.0f * c;
+        else if (k == 2)
+            across = mesh.positions[ring[1]] - c;
+        else {
+            float theta = PI / float(k);
+            across = std::sin(theta) * (b0 + b1);
+            for (int r = 1; r < k; ++r)
+                across += (2.0f * std::cos(theta) - 2.0f) * std::sin(float(r) * theta) * mesh.positions[ring[r]];
+        }
+        normal = (b0 - b1).cross(across);
+
+        // The masks fix the tangent plane but not its orientation; take that from the fan.
+        Vector3f fan = Vector3f::Zero();
+        for (size_t r = 0; r + 1 < ring.size(); ++r)
+            fan += (mesh.positions[ring[r]] - c).cross(mesh.positions[ring[r + 1]] - c);
+        if (normal.dot(fan) < 0.0f)
+            normal = -normal;
+        if (normal.squaredNorm() == 0.0f)
+            normal = fan;
+        normal.normalize();
+        return false;
+    }
+
+    // Copies the triangles that touch a vertex of face into local. One subdivision step of
+    // local is exact for every vertex that the children of face and their neighborhoods use.
+    int extractNeighborhood(const MeshWithConnectivity& mesh, const LoopLimitEvaluator::VertexTriangles& incident, int face, MeshWithConnectivity& local)
+    {
+        vector<int> triangles;
+        for (int j = 0; j < 3; ++j) {
+            int v = mesh.indices[face][j];
+            for (int k = incident.start[v]; k < incident.start[v + 1]; ++k)
+                if (std::find(triangles.begin(), triangles.end(), incident.triangles[k]) == triangles.end())
+                    triangles.push_back(incident.triangles[k]);
+        }
+
+        vector<int> vertices;
+        local.indices.resize(triangles.size());
+        int local_face = -1;
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            if (triangles[t] == face)
+                local_face = int(t);
+            for (int j = 0; j < 3; ++j) {
+                int v = mesh.indices[triangles[t]][j];
+                auto it = std::find(vertices.begin(), vertices.end(), v);
+                local.indices[t][j] = int(it - vertices.begin());
+                if (it == vertices.end())
+                    vertices.push_back(v);
+            }
+        }
+        local.positions.resize(vertices.size());
+        for (size_t v = 0; v < vertices.size(); ++v)
+            local.positions[v] = mesh.positions[vertices[v]];
+        local.computeConnectivity();
+        return local_face;
+    }
+}
+
+void LoopLimitEvaluator::VertexTriangles::build(const MeshWithConnectivity& mesh)
+{
+    start.assign(mesh.positions.size() + 1, 0);
+    for (const auto& tri : mesh.indices)
+        for (int j = 0; j < 3; ++j)
+            ++start[tri[j] + 1];
+    for (size_t v = 0; v + 1 < start.size(); ++v)
+        start[v + 1] += start[v];
+    triangles.resize(start.back());
+    vector<int> cursor(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < mesh.indices.size(); ++i)
+        for (int j = 0; j < 3; ++j)
+            triangles[cursor[mesh.indices[i][j]]++] = int(i);
+}
+
+LoopLimitEvaluator::LoopLimitEvaluator(const MeshWithConnectivity& control)
+    : m_control(control)
+{
+    m_incident.build(control);
+}
+
+void LoopLimitEvaluator::evaluateVertex(int v, Vector3f& position, Vector3f& normal) const
+{
+    if (m_incident.start[v] == m_incident.start[v + 1]) {
+        // not used by any triangle
+        position = m_control.positions[v];
+        normal = m_control.normals[v];
+        return;
+    }
+    int i = m_incident.triangles[m_incident.start[v]];
+    int j = m_control.indices[i][0] == v ? 0 : (m_control.indices[i][1] == v ? 1 : 2);
+    if (!limitVertex(m_control, i, j, position, normal)) {
+        // The cross-boundary masks assume slightly different rules than ours, so the normal
+        // depends on the level it is taken at. Refine towards the vertex like the samples
+        // on the boundary do, so that both agree.
+        evaluate(i, j == 1 ? 1.0f : 0.0f, j == 2 ? 1.0f : 0.0f, position, normal);
+    }
+}
+
+void LoopLimitEvaluator::evaluate(int face, float u, float v, Vector3f& position, Vector3f& normal) const
+{
+    vector<Vector3f> positions(1);
+    vector<Vector3f> normals(1);
+    evaluateSamples(m_control, m_incident, face, { Sample{ u, v, 0 } }, 0, positions, normals);
+    position = positions[0];
+    normal = normals[0];
+}
+
+void LoopLimitEvaluator::evaluate(int face, const vector<Eigen::Vector2f>& uv, vector<Vector3f>& positions, vector<Vector3f>& normals) const
+{
+    vector<Sample> samples(uv.size());
+    for (size_t k = 0; k < uv.size(); ++k)
+        samples[k] = Sample{ uv[k].x(), uv[k].y(), int(k) };
+    positions.resize(uv.size());
+    normals.resize(uv.size());
+    evaluateSamples(m_control, m_incident, face, samples, 0, positions, normals);
+}
+
+void LoopLimitEvaluator::evaluateSamples(const MeshWithConnectivity& mesh, const VertexTriangles& incident, int face,
+                                         const vector<Sample>& samples, int depth,
+                                         vector<Vector3f>& positions, vector<Vector3f>& normals) const
+{
+    Vector3f p[12];
+    if (regularPatch(mesh, face, p)) {
+        for (const auto& s : samples)
+            evaluateBoxSpline(p, s.u, s.v, positions[s.index], normals[s.index]);
+        return;
+    }
+
+    if (depth == MaxDepth) {
+        Vector3f corner_positions[3], corner_normals[3];
+        for (int j = 0; j < 3; ++j)
+            limitVertex(mesh, face, j, corner_positions[j], corner_normals[j]);
+        for (const auto& s : samples) {
+            float w = 1.0f - s.u - s.v;
+            positions[s.index] = w * corner_positions[0] + s.u * corner_positions[1] + s.v * corner_positions[2];
+            normals[s.index] = (w * corner_normals[0] + s.u * corner_normals[1] + s.v * corner_normals[2]).normalized();
+        }
+        return;
+    }
+
+    // Samples that sit on an interior vertex never reach a regular patch; the limit masks give
+    // them exactly.
+    vector<Sample> remaining;
+    remaining.reserve(samples.size());
+    for (const auto& s : samples) {
+        int j = (s.u == 0.0f && s.v == 0.0f) ? 0 : (s.u == 1.0f ? 1 : (s.v == 1.0f ? 2 : -1));
+        if (j == -1 || !limitVertex(mesh, face, j, positions[s.index], normals[s.index]))
+            remaining.push_back(s);
+    }
+    if (remaining.empty())
+        return;
+
+    // Subdivide the neighborhood once and hand each sample to the child triangle that holds it,
+    // in the child's own coordinates. LoopSubdivision makes children 4i..4i+3 of triangle i:
+    // (v0, m01, m20), (v1, m12, m01), (v2, m20, m12) and (m01, m12, m20).
+    MeshWithConnectivity local;
+    int local_face = extractNeighborhood(mesh, incident, face, local);
+
+    MeshWithConnectivity refined;
+    SubdivisionStencil stencil = local.buildSubdivisionStencil(DrawMode::Subdivision, false, refined.indices);
+    applyStencil(stencil, local.positions, refined.positions);
+    refined.computeConnectivity();
+    VertexTriangles refined_incident;
+    refined_incident.build(refined);
+
+    vector<Sample> children[4];
+    for (const auto& s : remaining) {
+        float w = 1.0f - s.u - s.v;
+        if (w >= 0.5f)
+            children[0].push_back(Sample{ 2.0f * s.u, 2.0f * s.v, s.index });
+        else if (s.u >= 0.5f)
+            children[1].push_back(Sample{ 2.0f * s.v, 2.0f * w, s.index });
+        else if (s.v >= 0.5f)
+            children[2].push_back(Sample{ 2.0f * w, 2.0f * s.u, s.index });
+        else
+            children[3].push_back(Sample{ 1.0f - 2.0f * w, 1.0f - 2.0f * s.u, s.index });
+    }
+    for (int c = 0; c < 4; ++c)
+        if (!children[c].empty())
+            evaluateSamples(refined, refined_incident, 4 * local_face + c, children[c], depth + 1, positions, normals);
+}
+
+MeshWithConnectivity* LoopLimitEvaluator::tessellate(int rate) const
+{
+    rate = std::max(rate, 1);
+    const MeshWithConnectivity& m = m_control;
+    const int num_tris = (int)m.indices.size();
+    const int num_verts = (int)m.positions.size();
+
+    // Number the edges like LoopSubdivision does: each edge belongs to the lower-indexed of its
+    // triangles, and the owner evaluates the samples on it.
+    auto ownsEdge = [&](int i, int j) {
+        int nt = m.neighborTris[i][j];
+        return nt == -1 || nt > i || (nt == i && m.neighborEdges[i][j] > j);
+    };
+    vector<Vector3i> edge_ids(num_tris);
+    int num_edges = 0;
+    for (int i = 0; i < num_tris; ++i)
+        for (int j = 0; j < 3; ++j)
+            if (ownsEdge(i, j))
+                edge_ids[i][j] = num_edges++;
+    for (int i = 0; i < num_tris; ++i)
+        for (int j = 0; j < 3; ++j)
+            if (!ownsEdge(i, j))
+                edge_ids[i][j] = edge_ids[m.neighborTris[i][j]][m.neighborEdges[i][j]];
+
+    // Output vertices: the control vertices, then rate-1 samples per edge counted from the
+    // owner's start vertex, then the samples inside each triangle.
+    const int per_edge = rate - 1;
+    const int per_face = (rate - 1) * (rate - 2) / 2;
+    const int edge_base = num_verts;
+    const int face_base = edge_base + num_edges * per_edge;
+    const int total = face_base + num_tris * per_face;
+
+    // vertex at lattice position (a, b) of triangle i, where (rate, 0) and (0, rate) are its
+    // second and third corner
+    auto edgeVertex = [&](int i, int j, int k) {
+        if (ownsEdge(i, j))
+            return edge_base + edge_ids[i][j] * per_edge + (k - 1);
+        return edge_base + edge_ids[i][j] * per_edge + (rate - k - 1);
+    };
+    auto vertexAt = [&](int i, int a, int b) {
+        if (b == 0 && a == 0)       return m.indices[i][0];
+        if (b == 0 && a == rate)    return m.indices[i][1];
+        if (a == 0 && b == rate)    return m.indices[i][2];
+        if (b == 0)                 return edgeVertex(i, 0, a);
+        if (a + b == rate)          return edgeVertex(i, 1, b);
+        if (a == 0)                 return edgeVertex(i, 2, rate - b);
+        // rows b = 1 .. rate-2 hold rate-1-b interior samples each
+        int row_start = (b - 1) * (rate - 1) - (b - 1) * b / 2;
+        return face_base + i * per_face + row_start + (a - 1);
+    };
+
+    MeshWithConnectivity* pMesh = new MeshWithConnectivity();
+    pMesh->positions.resize(total);
+    pMesh->normals.resize(total);
+    pMesh->normal_weighting = m.normal_weighting;
+
+#pragma omp parallel for
+    for (int v = 0; v < num_verts; ++v)
+        evaluateVertex(v, pMesh->positions[v], pMesh->normals[v]);
+
+#pragma omp parallel
+    {
+        vector<Sample> samples;
+#pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < num_tris; ++i) {
+            samples.clear();
+            float step = 1.0f / float(rate);
+            for (int b = 0; b <= rate; ++b)
+                for (int a = 0; a <= rate - b; ++a) {
+                    bool corner = (a == 0 && b == 0) || (a == rate) || (b == rate);
+                    bool on_edge = b == 0 || a == 0 || a + b == rate;
+                    int j = b == 0 ? 0 : (a + b == rate ? 1 : 2);
+                    if (corner || (on_edge && !ownsEdge(i, j)))
+                        continue;
+                    samples.push_back(Sample{ a * step, b * step, vertexAt(i, a, b) });
+                }
+            if (!samples.empty())
+                evaluateSamples(m, m_incident, i, samples, 0, pMesh->positions, pMesh->normals);
+        }
+    }
+
+    pMesh->indices.resize(size_t(num_tris) * rate * rate);
+#pragma omp parallel for
+    for (int i = 0; i < num_tris; ++i) {
+        size_t t = size_t(i) * rate * rate;
+        for (int b = 0; b < rate; ++b)
+            for (int a = 0; a < rate - b; ++a) {
+                pMesh->indices[t++] = Vector3i(vertexAt(i, a, b), vertexAt(i, a + 1, b), vertexAt(i, a, b + 1));
+                if (a + b < rate - 1)
+                    pMesh->indices[t++] = Vector3i(vertexAt(i, a + 1, b), vertexAt(i, a + 1, b + 1), vertexAt(i, a, b + 1));
+            }
+    }
+
+    pMesh->colors.assign(total, Vector3f{ 0.75f, 0.75f, 0.75f });
+    pMesh->ages.assign(total, 0);
+    pMesh->computeConnectivity();
+    pMesh->colorizeByCurvature();
+    return pMesh;
+}
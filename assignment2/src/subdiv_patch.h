@@ -0,0 +1,63 @@
+#pragma once
+
+#include "app.h"
+#include "subdiv.h"
+
+// Evaluates the Loop limit surface straight from a control mesh, so that a smooth surface can
+// be shown without materializing every subdivision level. Control vertices use the Loop limit
+// masks. Other points follow Stam: the patch of a triangle whose vertices are all interior and
+// of valence 6 is a quartic box spline over 12 control points, and any other triangle turns into
+// such patches after a few subdivision steps of its own neighborhood. Instead of jumping there
+// with the eigenvectors of the subdivision matrix, the neighborhood is subdivided explicitly with
+// buildSubdivisionStencil(), which is exact and does not need tables for every valence.
+// The rules are those of the full subdivision mode with proper boundary handling.
+class LoopLimitEvaluator
+{
+public:
+    // The control mesh needs its connectivity and must outlive the evaluator.
+    explicit                LoopLimitEvaluator(const MeshWithConnectivity& control);
+
+    // Limit position and normal of a control vertex.
+    void                    evaluateVertex(int v, Vector3f& position, Vector3f& normal) const;
+
+    // Limit position and normal at the point of triangle face whose barycentric coordinates
+    // with respect to the triangle's three vertices are (1-u-v, u, v).
+    void                    evaluate(int face, float u, float v, Vector3f& position, Vector3f& normal) const;
+
+    // The same for many points of one triangle at once, which shares the local subdivision steps
+    // between them. uv holds (u, v) for each point.
+    void                    evaluate(int face, const vector<Eigen::Vector2f>& uv, vector<Vector3f>& positions, vector<Vector3f>& normals) const;
+
+    // Splits every control triangle into rate^2 triangles whose vertices lie on the limit
+    // surface and carry its normals. Samples on shared edges and vertices are shared.
+    MeshWithConnectivity*   tessellate(int rate) const;
+
+    // Patches that never become regular because they touch the boundary are approximated from
+    // the limit positions of their corners after this many local subdivision steps.
+    static const int        MaxDepth = 10;
+
+    const MeshWithConnectivity& control() const { return m_control; }
+
+    // Triangles incident to each vertex, in compressed rows.
+    struct VertexTriangles
+    {
+        void                build(const MeshWithConnectivity& mesh);
+        vector<int>         start;
+        vector<int>         triangles;
+    };
+
+private:
+    struct Sample
+    {
+        float   u;
+        float   v;
+        int     index;
+    };
+
+    void                    evaluateSamples(const MeshWithConnectivity& mesh, const VertexTriangles& incident, int face,
+                                            const vector<Sample>& samples, int depth,
+                                            vector<Vector3f>& positions, vector<Vector3f>& normals) const;
+
+    const MeshWithConnectivity& m_control;
+    VertexTriangles         m_incident;
+};
@@ -0,0 +1,73 @@
+#include "app.h"
+
+#include "subdiv_prefetch.h"
+
+SubdivisionPrefetcher::~SubdivisionPrefetcher()
+{
+    cancel();
+    reapRetired(true);
+}
+
+void SubdivisionPrefetcher::start(const MeshWithConnectivity& parent, int level, DrawMode mode, bool crude_boundaries)
+{
+    cancel();
+
+    // The copy is made here rather than on the worker, as the parent may be changed or evicted
+    // while the worker runs.
+    m_job = std::make_unique<Job>();
+    m_job->level = level;
+    m_job->mode = mode;
+    m_job->crude_boundaries = crude_boundaries;
+    m_job->mesh = std::make_unique<MeshWithConnectivity>(parent);
+    m_job->worker = std::thread(&SubdivisionPrefetcher::build, m_job.get());
+}
+
+void SubdivisionPrefetcher::build(Job* job)
+{
+    MeshWithConnectivity& mesh = *job->mesh;
+    auto cancelled = [job]() { return job->cancel.load(std::memory_order_relaxed); };
+
+    if (!mesh.hasConnectivity())
+        mesh.computeConnectivity();
+    if (!cancelled())
+        mesh.LoopSubdivision(job->mode, job->crude_boundaries, &job->stencil);
+    if (!cancelled())
+        mesh.computeConnectivity();
+    job->done.store(true, std::memory_order_release);
+}
+
+bool SubdivisionPrefetcher::take(int level, unique_ptr<MeshWithConnectivity>& mesh, SubdivisionStencil& stencil)
+{
+    reapRetired(false);
+    if (!m_job || m_job->level != level)
+        return false;
+
+    // the worker has a head start, so waiting for it beats building the level again
+    m_job->worker.join();
+    mesh = std::move(m_job->mesh);
+    stencil = std::move(m_job->stencil);
+    m_job.reset();
+    return true;
+}
+
+void SubdivisionPrefetcher::cancel()
+{
+    if (!m_job)
+        return;
+    m_job->cancel = true;
+    m_retired.push_back(std::move(m_job));
+    reapRetired(false);
+}
+
+void SubdivisionPrefetcher::reapRetired(bool wait)
+{
+    for (size_t k = 0; k < m_retired.size(); ) {
+        Job& job = *m_retired[k];
+        if (wait || job.done.load(std::memory_order_acquire)) {
+            job.worker.join();
+            m_retired.erase(m_retired.begin() + k);
+        }
+        else
+            ++k;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "app.h"
+#include "subdiv.h"
+
+#include <thread>
+#include <atomic>
+
+// Builds the next subdivision level on a background thread, so that it is usually ready by the
+// time it is asked for. start() copies the current finest level, and the worker subdivides the
+// copy, which recomputes its normals, and then computes the connectivity that refining it once
+// more needs. The result is published with a single atomic flag once everything is written, and
+// take() hands it over.
+// Cancelling does not wait for the worker: it is told to stop at the next step and is joined
+// once it has, so the thread that cancels never blocks on a half-built level.
+class SubdivisionPrefetcher
+{
+public:
+                            SubdivisionPrefetcher() = default;
+                            ~SubdivisionPrefetcher();
+                            SubdivisionPrefetcher(const SubdivisionPrefetcher&) = delete;
+    SubdivisionPrefetcher&  operator=(const SubdivisionPrefetcher&) = delete;
+
+    // Starts building level from parent, which is one level coarser. Cancels any earlier build.
+    void                    start(const MeshWithConnectivity& parent, int level, DrawMode mode, bool crude_boundaries);
+
+    // If level is being built, waits for it to finish and moves the mesh and the stencil that
+    // maps the parent to it out. Returns false if some other level, or nothing, is being built.
+    bool                    take(int level, unique_ptr<MeshWithConnectivity>& mesh, SubdivisionStencil& stencil);
+
+    void                    cancel();
+
+    int                     level() const   { return m_job ? m_job->level : -1; }
+    bool                    ready() const   { return m_job && m_job->done.load(std::memory_order_acquire); }
+
+private:
+    struct Job
+    {
+        int                                 level = -1;
+        DrawMode                            mode;
+        bool                                crude_boundaries = false;
+        unique_ptr<MeshWithConnectivity>    mesh;
+        SubdivisionStencil                  stencil;
+        std::thread                         worker;
+        std::atomic<bool>                   cancel{false};
+        std::atomic<bool>                   done{false};    // set when the worker returns; unless cancelled, mesh and stencil are complete
+    };
+
+    static void             build(Job* job);
+    void                    reapRetired(bool wait);
+
+    unique_ptr<Job>         m_job;
+    vector<unique_ptr<Job>> m_retired;      // cancelled jobs whose worker may still be running
+};
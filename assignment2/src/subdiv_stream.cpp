@@ -0,0 +1,168 @@
+#include "app.h"
+
+#include "subdiv_stream.h"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <cassert>
+
+namespace
+{
+    // Keeps the first num_region triangles of mesh and every other triangle that touches one of
+    // their vertices, and drops the vertices that are no longer used. The region stays in front,
+    // and its vertices are renumbered first, in the order in which the region uses them.
+    void trimToRegion(MeshWithConnectivity& mesh, int num_region)
+    {
+        const int num_verts = (int)mesh.positions.size();
+        vector<char> in_region(num_verts, 0);
+        for (int t = 0; t < num_region; ++t)
+            for (int j = 0; j < 3; ++j)
+                in_region[mesh.indices[t][j]] = 1;
+
+        vector<Vector3i> kept;
+        kept.reserve(mesh.indices.size());
+        for (size_t t = 0; t < mesh.indices.size(); ++t) {
+            const Vector3i& tri = mesh.indices[t];
+            if (int(t) < num_region || in_region[tri[0]] || in_region[tri[1]] || in_region[tri[2]])
+                kept.push_back(tri);
+        }
+
+        vector<int> remap(num_verts, -1);
+        int used = 0;
+        for (auto& tri : kept)
+            for (int j = 0; j < 3; ++j) {
+                if (remap[tri[j]] == -1)
+                    remap[tri[j]] = used++;
+                tri[j] = remap[tri[j]];
+            }
+
+        vector<Vector3f> positions(used), normals(used), colors(used);
+        vector<int> ages(used);
+        for (int v = 0; v < num_verts; ++v)
+            if (remap[v] != -1) {
+                positions[remap[v]] = mesh.positions[v];
+                normals[remap[v]] = mesh.normals[v];
+                colors[remap[v]] = mesh.colors[v];
+                ages[remap[v]] = mesh.ages[v];
+            }
+        mesh.indices = std::move(kept);
+        mesh.positions = std::move(positions);
+        mesh.normals = std::move(normals);
+        mesh.colors = std::move(colors);
+        mesh.ages = std::move(ages);
+    }
+}
+
+PatchStreamer::PatchStreamer(const MeshWithConnectivity& control, DrawMode mode, bool crude_boundaries)
+    : m_control(control), m_mode(mode), m_crude_boundaries(crude_boundaries)
+{
+    m_incident.build(control);
+}
+
+void PatchStreamer::subdividePatch(int face, int depth, Vector3f* positions, Vector3f* normals, Vector3f* colors, Vector3i* indices, int first_vertex) const
+{
+    // The patch starts as its control triangle plus the triangles around its vertices, which is
+    // everything one step of subdivision reads to produce the children of the triangle.
+    vector<int> triangles(1, face);
+    for (int j = 0; j < 3; ++j) {
+        int v = m_control.indices[face][j];
+        for (int k = m_incident.start[v]; k < m_incident.start[v + 1]; ++k)
+            if (std::find(triangles.begin(), triangles.end(), m_incident.triangles[k]) == triangles.end())
+                triangles.push_back(m_incident.triangles[k]);
+    }
+
+    MeshWithConnectivity local;
+    local.normal_weighting = m_control.normal_weighting;
+    local.indices.resize(triangles.size());
+    vector<int> vertices;
+    for (size_t t = 0; t < triangles.size(); ++t)
+        for (int j = 0; j < 3; ++j) {
+            int v = m_control.indices[triangles[t]][j];
+            auto it = std::find(vertices.begin(), vertices.end(), v);
+            local.indices[t][j] = int(it - vertices.begin());
+            if (it == vertices.end())
+                vertices.push_back(v);
+        }
+    for (int v : vertices) {
+        local.positions.push_back(m_control.positions[v]);
+        local.normals.push_back(m_control.normals[v]);
+        local.colors.push_back(m_control.colors[v]);
+        local.ages.push_back(v < (int)m_control.ages.size() ? m_control.ages[v] : 0);
+    }
+
+    // LoopSubdivision makes children 4i..4i+3 of triangle i, so the region stays in front.
+    // The vertices of the region and their one-rings are exact after each step; anything
+    // further out is cut away before it can spoil them.
+    int num_region = 1;
+    for (int d = 0; d < depth; ++d) {
+        local.computeConnectivity();
+        local.LoopSubdivision(m_mode, m_crude_boundaries);
+        num_region *= 4;
+        trimToRegion(local, num_region);
+    }
+
+    // trimToRegion() numbers the region's own vertices first
+    const int num_patch_vertices = (int)patchVertices(depth);
+    assert((int)local.positions.size() >= num_patch_vertices);
+    for (int v = 0; v < num_patch_vertices; ++v) {
+        positions[first_vertex + v] = local.positions[v];
+        normals[first_vertex + v] = local.normals[v];
+        colors[first_vertex + v] = local.colors[v];
+    }
+    Vector3i* out = indices + size_t(face) * patchTriangles(depth);
+    for (int t = 0; t < num_region; ++t)
+        out[t] = local.indices[t] + Vector3i::Constant(first_vertex);
+}
+
+void PatchStreamer::subdivide(int depth, Vector3f* positions, Vector3f* normals, Vector3f* colors, Vector3i* indices) const
+{
+    const int num_tris = (int)m_control.indices.size();
+    const size_t num_patch_vertices = patchVertices(depth);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_tris; ++i)
+        subdividePatch(i, depth, positions, normals, colors, indices, int(size_t(i) * num_patch_vertices));
+}
+
+bool PatchStreamer::streamToGPU(int depth, GLuint vertex_buffer, GLuint index_buffer) const
+{
+    const size_t num_verts = numVertices(depth);
+    const size_t num_tris = numTriangles(depth);
+    if (num_verts > size_t(std::numeric_limits<int>::max()) || 3 * num_tris > size_t(std::numeric_limits<GLsizei>::max())) {
+        std::cerr << "Subdivision level " << depth << " has too many vertices to stream." << std::endl;
+        return false;
+    }
+
+    // Invalidating the whole buffer lets the driver hand out fresh memory instead of waiting for
+    // draws that still use the old contents. GL_COPY_WRITE_BUFFER is used for the indices so that
+    // no vertex array object needs to be bound.
+    GLsizeiptr vertex_bytes = GLsizeiptr(3 * num_verts * sizeof(Vector3f));
+    GLsizeiptr index_bytes = GLsizeiptr(num_tris * sizeof(Vector3i));
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertex_bytes, nullptr, GL_STATIC_DRAW);
+    Vector3f* vertices = (Vector3f*)glMapBufferRange(GL_ARRAY_BUFFER, 0, vertex_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, index_buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, index_bytes, nullptr, GL_STATIC_DRAW);
+    Vector3i* indices = (Vector3i*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, index_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+    bool ok = vertices != nullptr && indices != nullptr;
+    if (ok)
+        subdivide(depth, vertices, vertices + num_verts, vertices + 2 * num_verts, indices);
+    else
+        std::cerr << "Failed to map " << (vertex_bytes + index_bytes) / (1 << 20) << " MB of buffers for subdivision level " << depth << std::endl;
+
+    // unmapping can fail if the driver lost the memory in the meantime, in which case the
+    // contents are undefined
+    if (vertices != nullptr && glUnmapBuffer(GL_ARRAY_BUFFER) == GL_FALSE && ok) {
+        std::cerr << "Vertex buffer was lost while streaming subdivision patches." << std::endl;
+        ok = false;
+    }
+    if (indices != nullptr && glUnmapBuffer(GL_COPY_WRITE_BUFFER) == GL_FALSE && ok) {
+        std::cerr << "Index buffer was lost while streaming subdivision patches." << std::endl;
+        ok = false;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return ok;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "app.h"
+#include "subdiv.h"
+#include "subdiv_patch.h"
+
+// Subdivides a control mesh depth first instead of level by level. Each control triangle is
+// refined on its own, together with the triangles around its vertices, all the way to the
+// target depth; after every step the local mesh is cut back to the triangles that the next
+// step still needs. Working memory is therefore proportional to one patch rather than to the
+// whole refined mesh, and patches are independent, so they run in parallel.
+// Every patch has the same number of vertices and triangles, so each one writes into a fixed
+// range of the output, which can be a mapped GL buffer. Vertices on the border between two
+// patches are computed by both; the copies agree up to rounding.
+class PatchStreamer
+{
+public:
+    // The control mesh needs its connectivity and must outlive the streamer.
+                            PatchStreamer(const MeshWithConnectivity& control, DrawMode mode, bool crude_boundaries);
+
+    static size_t           patchVertices(int depth)    { size_t n = (size_t(1) << depth) + 1; return n * (n + 1) / 2; }
+    static size_t           patchTriangles(int depth)   { return size_t(1) << (2 * depth); }
+    size_t                  numVertices(int depth) const    { return m_control.indices.size() * patchVertices(depth); }
+    size_t                  numTriangles(int depth) const   { return m_control.indices.size() * patchTriangles(depth); }
+
+    // Writes numVertices(depth) positions, normals and colors and numTriangles(depth) triangles.
+    void                    subdivide(int depth, Vector3f* positions, Vector3f* normals, Vector3f* colors, Vector3i* indices) const;
+
+    // Same, straight into vertex_buffer and index_buffer, which are resized to hold the result.
+    // The vertex buffer gets all positions, then all normals, then all colors, like
+    // uploadGeometryToGPU() lays it out. Prints a message to std::cerr and returns false if the
+    // result does not fit or the buffers cannot be mapped.
+    bool                    streamToGPU(int depth, GLuint vertex_buffer, GLuint index_buffer) const;
+
+private:
+    void                    subdividePatch(int face, int depth, Vector3f* positions, Vector3f* normals, Vector3f* colors, Vector3i* indices, int first_vertex) const;
+
+    const MeshWithConnectivity&             m_control;
+    DrawMode                                m_mode;
+    bool                                    m_crude_boundaries;
+    LoopLimitEvaluator::VertexTriangles     m_incident;
+};
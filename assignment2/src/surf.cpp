@@ -15,6 +15,7 @@
 #include <algorithm>
 #include <fstream>
 #include <cstdint>
+#include <map>
 
 using namespace std;        // enables writing "string" instead of std::string, etc.
 using namespace Eigen;      // enables writing "Vector3f" instead of "Eigen::Vector3f", etc.
@@ -49,30 +50,16 @@ namespace
         return Vector3f(0.0f, 0.0f, 1.0f);
     }
 
-    struct VolumeView {
-        const uint8_t*  u8  = nullptr;
-        const uint16_t* u16 = nullptr;
-        const float*    f32 = nullptr;
-        Vector3i dims;
-        std::string dtype;
-        inline float at(int x,int y,int z) const {
-            size_t idx = size_t(x) + size_t(dims.x())*(size_t(y) + size_t(dims.y())*size_t(z));
-            if (dtype == "uint8") return float(u8[idx]) / 255.0f;
-            else if (dtype == "uint16") return float(u16[idx]) / 65535.0f;
-            else return f32[idx];
-        }
-    };
-
     inline Vector3f gridToWorld(const Vector3i& ijk, const Vector3f& spacing, const Vector3f& origin) {
         return origin + spacing.cwiseProduct(Vector3f(float(ijk.x()), float(ijk.y()), float(ijk.z())));
     }
 
     // Estimate gradient by central differences for normals
-    Vector3f gradientAt(const VolumeView& V, int x, int y, int z) {
+    Vector3f gradientAt(const RawVolume& V, int x, int y, int z) {
         auto clampi = [&](int v, int lo, int hi){ return std::max(lo, std::min(hi, v)); };
-        int xm = clampi(x-1, 0, V.dims.x()-1), xp = clampi(x+1, 0, V.dims.x()-1);
-        int ym = clampi(y-1, 0, V.dims.y()-1), yp = clampi(y+1, 0, V.dims.y()-1);
-        int zm = clampi(z-1, 0, V.dims.z()-1), zp = clampi(z+1, 0, V.dims.z()-1);
+        int xm = clampi(x-1, 0, V.dims().x()-1), xp = clampi(x+1, 0, V.dims().x()-1);
+        int ym = clampi(y-1, 0, V.dims().y()-1), yp = clampi(y+1, 0, V.dims().y()-1);
+        int zm = clampi(z-1, 0, V.dims().z()-1), zp = clampi(z+1, 0, V.dims().z()-1);
         float gx = 0.5f * (V.at(xp,y,z) - V.at(xm,y,z));
         float gy = 0.5f * (V.at(x,yp,z) - V.at(x,ym,z));
         float gz = 0.5f * (V.at(x,y,zp) - V.at(x,y,zm));
@@ -738,65 +725,219 @@ GeneratedSurface makeGenCylPiecewise(const std::vector<CurvePoint>& profile, con
     return merged;
 }
 
-GeneratedSurface makeIsoSurfaceRAW(const std::string& rawPath,
-                                   const Vector3i& dims,
-                                   float iso,
-                                   const Vector3f& spacing,
-                                   const Vector3f& origin,
-                                   const std::string& dtype)
+
+namespace
 {
-    GeneratedSurface surface;
-    if (dims.x() < 2 || dims.y() < 2 || dims.z() < 2) return surface;
-
-    // Load volume
-    std::vector<uint8_t>  buf8;
-    std::vector<uint16_t> buf16;
-    std::vector<float>    buf32;
-    size_t voxelCount = size_t(dims.x()) * size_t(dims.y()) * size_t(dims.z());
-    if (dtype == "uint8") buf8.resize(voxelCount);
-    else if (dtype == "uint16") buf16.resize(voxelCount);
-    else if (dtype == "float32") buf32.resize(voxelCount);
-    else {
-        std::cerr << "Unsupported dtype: " << dtype << std::endl;
-        return surface;
-    }
+    // Marching cubes case tables. Rather than typing in the classic 256-entry table, the
+    // tables are generated once from the per-face contour rules: every face of the cell
+    // contributes oriented contour segments between its crossed edges, the segments are
+    // chained into closed loops, and every loop is fan-triangulated. Faces with alternating
+    // corners are ambiguous; they get both possible segment pairings, one table entry per
+    // combination, and the asymptotic decider picks the entry at extraction time. Since both
+    // cells sharing a face evaluate the decider on the same four values, no cracks appear.
+    //
+    // Corner c of a cell is at (c&1, (c>>1)&1, (c>>2)&1), like in cubeTets above.
+    const int mcEdgeCorners[12][2] = {
+        {0,1}, {2,3}, {4,5}, {6,7},     // along x
+        {0,2}, {1,3}, {4,6}, {5,7},     // along y
+        {0,4}, {1,5}, {2,6}, {3,7},     // along z
+    };
+
+    struct McTables
     {
-        std::ifstream f(rawPath, std::ios::binary);
-        if (!f) {
-            std::cerr << "Failed to open RAW volume: " << rawPath << std::endl;
-            return surface;
+        int                     faceCorners[6][4];      // counterclockwise seen from outside the cell
+        uint8_t                 ambiguousFaces[256];    // bit f set if face f is ambiguous for this config
+        uint16_t                edgeMask[256];          // bit e set if edge e is crossed
+        std::vector<uint32_t>   offsets;                // per (config*64 + face bits), into edges
+        std::vector<uint16_t>   centerMask;             // per (config*64 + face bits), see below
+        std::vector<uint8_t>    edges;                  // triangle corners, three per triangle
+
+        // Some long loops that wrap around the cell cannot be triangulated without a
+        // diagonal on a cell face. Those are fanned around an extra vertex at the loop's
+        // center instead; it is referenced as edge index 12, and centerMask holds the
+        // edges of the loop it is averaged from. A cell has at most one such loop.
+        static const int        CenterVertex = 12;
+
+        McTables()
+        {
+            static const int faces[6][4] = {
+                {0,2,6,4}, {1,3,7,5}, {0,1,5,4}, {2,3,7,6}, {0,1,3,2}, {4,5,7,6}
+            };
+            static const Vector3f outward[6] = {
+                Vector3f(-1,0,0), Vector3f(1,0,0), Vector3f(0,-1,0), Vector3f(0,1,0), Vector3f(0,0,-1), Vector3f(0,0,1)
+            };
+            auto cornerPos = [](int c) { return Vector3f(float(c & 1), float((c >> 1) & 1), float((c >> 2) & 1)); };
+            for (int f = 0; f < 6; ++f) {
+                Vector3f n = (cornerPos(faces[f][1]) - cornerPos(faces[f][0])).cross(cornerPos(faces[f][2]) - cornerPos(faces[f][1]));
+                bool flip = n.dot(outward[f]) < 0.0f;
+                for (int k = 0; k < 4; ++k)
+                    faceCorners[f][k] = flip ? faces[f][3 - k] : faces[f][k];
+            }
+
+            int edgeOf[8][8];
+            for (int e = 0; e < 12; ++e) {
+                edgeOf[mcEdgeCorners[e][0]][mcEdgeCorners[e][1]] = e;
+                edgeOf[mcEdgeCorners[e][1]][mcEdgeCorners[e][0]] = e;
+            }
+
+            bool onFace[12][6] = {};
+            for (int f = 0; f < 6; ++f)
+                for (int k = 0; k < 4; ++k)
+                    onFace[edgeOf[faceCorners[f][k]][faceCorners[f][(k + 1) % 4]]][f] = true;
+            for (int e0 = 0; e0 < 12; ++e0)
+                for (int e1 = 0; e1 < 12; ++e1) {
+                    m_shares_face[e0][e1] = false;
+                    for (int f = 0; f < 6; ++f)
+                        m_shares_face[e0][e1] = m_shares_face[e0][e1] || (onFace[e0][f] && onFace[e1][f]);
+                }
+
+            offsets.assign(256 * 64 + 1, 0);
+            centerMask.assign(256 * 64, 0);
+            for (int config = 0; config < 256; ++config) {
+                auto inside = [&](int c) { return (config >> c) & 1; };
+
+                edgeMask[config] = 0;
+                for (int e = 0; e < 12; ++e)
+                    if (inside(mcEdgeCorners[e][0]) != inside(mcEdgeCorners[e][1]))
+                        edgeMask[config] |= uint16_t(1 << e);
+
+                ambiguousFaces[config] = 0;
+                for (int f = 0; f < 6; ++f) {
+                    const int* c = faceCorners[f];
+                    if (inside(c[0]) == inside(c[2]) && inside(c[1]) == inside(c[3]) && inside(c[0]) != inside(c[1]))
+                        ambiguousFaces[config] |= uint8_t(1 << f);
+                }
+
+                for (int bits = 0; bits < 64; ++bits) {
+                    int entry = config * 64 + bits;
+                    offsets[entry] = uint32_t(edges.size());
+                    // Only the bits of ambiguous faces are meaningful; other entries stay empty.
+                    if ((bits & ~ambiguousFaces[config]) != 0)
+                        continue;
+
+                    // Each segment runs from an in->out crossing to an out->in crossing along
+                    // the counterclockwise face boundary, which keeps the inside on its left.
+                    int next[12];
+                    std::fill(next, next + 12, -1);
+                    for (int f = 0; f < 6; ++f) {
+                        const int* c = faceCorners[f];
+                        int crossing[4], count = 0;
+                        bool leaving[4];
+                        for (int k = 0; k < 4; ++k) {
+                            int a = c[k], b = c[(k + 1) % 4];
+                            if (inside(a) != inside(b)) {
+                                leaving[count] = inside(a) != 0;
+                                crossing[count++] = edgeOf[a][b];
+                            }
+                        }
+                        for (int i = 0; i < count; ++i) {
+                            if (!leaving[i]) continue;
+                            // With four crossings, pairing with the next crossing cuts off an
+                            // outside corner, i.e. keeps the inside corners connected.
+                            int j = (count == 2 || (bits >> f) & 1) ? (i + 1) % count : (i + count - 1) % count;
+                            next[crossing[i]] = crossing[j];
+                        }
+                    }
+
+                    bool visited[12] = {};
+                    for (int e = 0; e < 12; ++e) {
+                        if (next[e] < 0 || visited[e]) continue;
+                        std::vector<int> loop;
+                        for (int k = e; !visited[k]; k = next[k]) {
+                            visited[k] = true;
+                            loop.push_back(k);
+                        }
+                        std::vector<uint8_t> tris;
+                        if (!triangulate(loop, tris)) {
+                            tris.clear();
+                            for (size_t k = 0; k < loop.size(); ++k) {
+                                tris.insert(tris.end(), { uint8_t(CenterVertex), uint8_t(loop[k]), uint8_t(loop[(k + 1) % loop.size()]) });
+                                centerMask[entry] |= uint16_t(1 << loop[k]);
+                            }
+                        }
+                        // The loop winds counterclockwise around the inside; emit the triangles
+                        // reversed so that they face away from it like the tetrahedra path.
+                        for (size_t k = 0; k < tris.size(); k += 3)
+                            edges.insert(edges.end(), { tris[k], tris[k + 2], tris[k + 1] });
+                    }
+                }
+            }
+            offsets[256 * 64] = uint32_t(edges.size());
         }
-        if (dtype == "uint8") f.read(reinterpret_cast<char*>(buf8.data()), std::streamsize(buf8.size()));
-        else if (dtype == "uint16") f.read(reinterpret_cast<char*>(buf16.data()), std::streamsize(buf16.size()*sizeof(uint16_t)));
-        else f.read(reinterpret_cast<char*>(buf32.data()), std::streamsize(buf32.size()*sizeof(float)));
-        if (!f) {
-            std::cerr << "Failed to read expected number of bytes from RAW volume." << std::endl;
-            return surface;
+
+    private:
+        bool                            m_shares_face[12][12];
+        std::map<std::vector<int>, bool> m_unsolvable;
+
+        // Splits a loop recursively along diagonals that do not lie on a cell face.
+        // A plain fan would sometimes put a triangle flat on a face where the
+        // neighboring cell has geometry too, which makes the mesh non-manifold.
+        bool triangulate(const std::vector<int>& loop, std::vector<uint8_t>& out)
+        {
+            int len = int(loop.size());
+            if (len == 3) {
+                out.insert(out.end(), { uint8_t(loop[0]), uint8_t(loop[1]), uint8_t(loop[2]) });
+                return true;
+            }
+            if (m_unsolvable.count(loop))
+                return false;
+            for (int i = 0; i < len; ++i)
+            for (int j = i + 2; j < len; ++j) {
+                if ((i == 0 && j == len - 1) || m_shares_face[loop[i]][loop[j]])
+                    continue;
+                std::vector<int> a(loop.begin() + i, loop.begin() + j + 1), b;
+                for (int k = j; k != i; k = (k + 1) % len) b.push_back(loop[k]);
+                b.push_back(loop[i]);
+                size_t mark = out.size();
+                if (triangulate(a, out) && triangulate(b, out))
+                    return true;
+                out.resize(mark);
+            }
+            m_unsolvable[loop] = true;
+            return false;
         }
+    };
+
+    const McTables& mcTables()
+    {
+        static const McTables tables;
+        return tables;
     }
+}
 
-    VolumeView V;
-    V.dims = dims;
-    V.dtype = dtype;
-    V.u8  = buf8.empty() ? nullptr : buf8.data();
-    V.u16 = buf16.empty() ? nullptr : buf16.data();
-    V.f32 = buf32.empty() ? nullptr : buf32.data();
+void extractIsoSurface(const RawVolume& volume,
+                       const std::vector<float>& isos,
+                       const Vector3f& spacing,
+                       const Vector3f& origin,
+                       IsoSurfaceSink& sink,
+                       IsoMethod method)
+{
+    const Vector3i& dims = volume.dims();
+    // The case tables are only built the first time marching cubes is used.
+    const McTables* mcp = method == IsoMethod::MarchingCubes ? &mcTables() : nullptr;
+    if (!volume.isOpen() || dims.x() < 2 || dims.y() < 2 || dims.z() < 2 || isos.empty()) return;
+
+    // Isovalues in ascending order, so that the ones crossing a cell form a contiguous
+    // range that two binary searches on the cell's min/max find. Cells that no isovalue
+    // crosses then cost the same no matter how many isovalues were requested.
+    std::vector<int> order(isos.size());
+    for (size_t k = 0; k < order.size(); ++k) order[k] = int(k);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return isos[a] < isos[b]; });
+    std::vector<float> sorted(isos.size());
+    for (size_t k = 0; k < order.size(); ++k) sorted[k] = isos[order[k]];
 
     auto cubeCorner = [](int corner)->Vector3i{
         return Vector3i( (corner & 1) ? 1:0, (corner & 2) ? 1:0, (corner & 4) ? 1:0 );
     };
 
-    // Marching tetrahedra
-    std::vector<Vector3f>& outV = surface.positions;
-    std::vector<Vector3f>& outN = surface.normals;
-    std::vector<Vector3i>& outI = surface.indices;
+    int level = 0;
+    float iso = 0.0f;
 
     auto emitTri = [&](const Vector3f& a, const Vector3f& b, const Vector3f& c,
                        const Vector3f& na, const Vector3f& nb, const Vector3f& nc){
-        int base = (int)outV.size();
-        outV.push_back(a); outV.push_back(b); outV.push_back(c);
-        outN.push_back(na); outN.push_back(nb); outN.push_back(nc);
-        outI.emplace_back(base+0, base+1, base+2);
+        const Vector3f p[3] = { a, b, c };
+        const Vector3f n[3] = { na, nb, nc };
+        sink.triangle(level, p, n);
     };
 
     auto interp = [&](const Vector3f& p0, const Vector3f& p1, float s0, float s1) -> Vector3f {
@@ -805,94 +946,456 @@ GeneratedSurface makeIsoSurfaceRAW(const std::string& rawPath,
         return lerp(p0, p1, t);
     };
 
+    // One z-slab of cells at a time. The gradients of slab z read slices
+    // z-1 .. z+2, so once slab z is done slice z-1 is never touched again.
+    volume.rewind();
     for (int z = 0; z < dims.z()-1; ++z)
-    for (int y = 0; y < dims.y()-1; ++y)
-    for (int x = 0; x < dims.x()-1; ++x)
-    {
-        // Cube 8 corners
-        Vector3f Pc[8]; float Sc[8]; Vector3f Nc[8];
-        for (int c = 0; c < 8; ++c) {
-            Vector3i off = cubeCorner(c);
-            int xi = x + off.x();
-            int yi = y + off.y();
-            int zi = z + off.z();
-            Pc[c] = gridToWorld(Vector3i(xi,yi,zi), spacing, origin);
-            Sc[c] = V.at(xi,yi,zi);
-            Nc[c] = gradientAt(V, xi, yi, zi);
-        }
-
-        // Process 6 tetrahedra
-        for (int t = 0; t < 6; ++t) {
-            int i0 = cubeTets[t].v[0];
-            int i1 = cubeTets[t].v[1];
-            int i2 = cubeTets[t].v[2];
-            int i3 = cubeTets[t].v[3];
-            int ids[4] = { i0, i1, i2, i3 };
-            float s[4] = { Sc[i0], Sc[i1], Sc[i2], Sc[i3] };
-            Vector3f p[4] = { Pc[i0], Pc[i1], Pc[i2], Pc[i3] };
-            Vector3f n[4] = { Nc[i0], Nc[i1], Nc[i2], Nc[i3] };
-
-            int mask = 0; for (int k=0;k<4;++k) if (s[k] >= iso) mask |= (1<<k);
-            if (mask == 0 || mask == 15) continue; // no intersection
-
-            auto edgeP = [&](int a,int b)->Vector3f{ return interp(p[a], p[b], s[a], s[b]); };
-            auto edgeN = [&](int a,int b)->Vector3f{ return safe_normalize(lerp(n[a], n[b], 0.5f)); };
-
-            switch (mask) {
-                case 1: case 14: {
-                    bool inv = (mask==14);
-                    int a=0,b=1,c=2,d=3;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
-                    Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                case 2: case 13: {
-                    bool inv = (mask==13);
-                    int a=1,b=0,c=2,d=3;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
-                    Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                case 3: case 12: {
-                    bool inv = (mask==12);
-                    int a=0,b=2,c=1,d=3;
-                    Vector3f v0 = edgeP(a,c), v1 = edgeP(b,c), v2 = edgeP(a,d);
-                    Vector3f v3 = edgeP(b,d);
-                    Vector3f n0 = edgeN(a,c), n1 = edgeN(b,c), n2 = edgeN(a,d), n3 = edgeN(b,d);
-                    if (!inv) { emitTri(v0,v1,v2, n0,n1,n2); emitTri(v1,v3,v2, n1,n3,n2);} else { emitTri(v0,v2,v1, n0,n2,n1); emitTri(v1,v2,v3, n1,n2,n3);} 
-                } break;
-                case 4: case 11: {
-                    bool inv = (mask==11);
-                    int a=2,b=0,c=1,d=3;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
-                    Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                case 5: case 10: {
-                    bool inv = (mask==10);
-                    int a=0,b=1,c=2,d=3;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(b,c), v2 = edgeP(c,a);
-                    Vector3f na = edgeN(a,b), nb = edgeN(b,c), nc = edgeN(c,a);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                case 6: case 9: {
-                    bool inv = (mask==9);
-                    int a=1,b=0,c=2,d=3;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(b,c), v2 = edgeP(c,a);
-                    Vector3f na = edgeN(a,b), nb = edgeN(b,c), nc = edgeN(c,a);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                case 7: case 8: {
-                    bool inv = (mask==8);
-                    int a=3,b=0,c=1,d=2;
-                    Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
-                    Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
-                    if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
-                } break;
-                default: break;
+    {
+        if (sink.cancelled())
+            return;
+        for (int y = 0; y < dims.y()-1; ++y)
+        for (int x = 0; x < dims.x()-1; ++x)
+        {
+            // Cube 8 corners. Classify first; the positions and gradients are only
+            // needed for the small fraction of cells that the surface passes through.
+            float Sc[8];
+            float lo = std::numeric_limits<float>::max(), hi = -std::numeric_limits<float>::max();
+            for (int c = 0; c < 8; ++c) {
+                Vector3i off = cubeCorner(c);
+                Sc[c] = volume.at(x + off.x(), y + off.y(), z + off.z());
+                lo = std::min(lo, Sc[c]);
+                hi = std::max(hi, Sc[c]);
+            }
+            // An isovalue crosses the cell iff lo < iso <= hi.
+            size_t first = std::upper_bound(sorted.begin(), sorted.end(), lo) - sorted.begin();
+            size_t last = std::upper_bound(sorted.begin() + first, sorted.end(), hi) - sorted.begin();
+            if (first == last) continue;
+
+            Vector3f Pc[8]; Vector3f Nc[8];
+            for (int c = 0; c < 8; ++c) {
+                Vector3i off = cubeCorner(c);
+                int xi = x + off.x();
+                int yi = y + off.y();
+                int zi = z + off.z();
+                Pc[c] = gridToWorld(Vector3i(xi,yi,zi), spacing, origin);
+                Nc[c] = gradientAt(volume, xi, yi, zi);
+            }
+
+            for (size_t k = first; k < last; ++k)
+            {
+                iso = sorted[k];
+                level = order[k];
+                int config = 0;
+                for (int c = 0; c < 8; ++c)
+                    if (Sc[c] >= iso) config |= (1 << c);
+
+                if (mcp) {
+                    const McTables& mc = *mcp;
+                    // Asymptotic decider: the inside corners of an ambiguous face are connected
+                    // if the bilinear interpolant's saddle point is inside as well.
+                    int bits = 0;
+                    for (int f = 0; f < 6; ++f) {
+                        if (!((mc.ambiguousFaces[config] >> f) & 1)) continue;
+                        const int* fc = mc.faceCorners[f];
+                        float a = Sc[fc[0]], b = Sc[fc[1]], c = Sc[fc[2]], d = Sc[fc[3]];
+                        float saddle = (a * c - b * d) / ((a + c) - (b + d));
+                        if (saddle >= iso) bits |= (1 << f);
+                    }
+
+                    int entry = config * 64 + bits;
+                    Vector3f Pe[13], Ne[13];
+                    Pe[McTables::CenterVertex] = Ne[McTables::CenterVertex] = Vector3f::Zero();
+                    int centerCount = 0;
+                    for (int e = 0; e < 12; ++e) {
+                        if (!((mc.edgeMask[config] >> e) & 1)) continue;
+                        int a = mcEdgeCorners[e][0], b = mcEdgeCorners[e][1];
+                        float t = std::clamp((iso - Sc[a]) / (Sc[b] - Sc[a] + 1e-20f), 0.0f, 1.0f);
+                        Pe[e] = lerp(Pc[a], Pc[b], t);
+                        Ne[e] = safe_normalize(lerp(Nc[a], Nc[b], t));
+                        if ((mc.centerMask[entry] >> e) & 1) {
+                            Pe[McTables::CenterVertex] += Pe[e];
+                            Ne[McTables::CenterVertex] += Ne[e];
+                            ++centerCount;
+                        }
+                    }
+                    if (centerCount > 0) {
+                        Pe[McTables::CenterVertex] /= float(centerCount);
+                        Ne[McTables::CenterVertex] = safe_normalize(Ne[McTables::CenterVertex]);
+                    }
+
+                    uint32_t begin = mc.offsets[entry], end = mc.offsets[entry + 1];
+                    for (uint32_t k = begin; k < end; k += 3) {
+                        int e0 = mc.edges[k], e1 = mc.edges[k + 1], e2 = mc.edges[k + 2];
+                        emitTri(Pe[e0], Pe[e1], Pe[e2], Ne[e0], Ne[e1], Ne[e2]);
+                    }
+                    continue;
+                }
+
+                // Marching tetrahedra: process 6 tetrahedra
+                for (int t = 0; t < 6; ++t) {
+                    int i0 = cubeTets[t].v[0];
+                    int i1 = cubeTets[t].v[1];
+                    int i2 = cubeTets[t].v[2];
+                    int i3 = cubeTets[t].v[3];
+                    float s[4] = { Sc[i0], Sc[i1], Sc[i2], Sc[i3] };
+                    Vector3f p[4] = { Pc[i0], Pc[i1], Pc[i2], Pc[i3] };
+                    Vector3f n[4] = { Nc[i0], Nc[i1], Nc[i2], Nc[i3] };
+
+                    int mask = 0; for (int k=0;k<4;++k) if (s[k] >= iso) mask |= (1<<k);
+                    if (mask == 0 || mask == 15) continue; // no intersection
+
+                    auto edgeP = [&](int a,int b)->Vector3f{ return interp(p[a], p[b], s[a], s[b]); };
+                    auto edgeN = [&](int a,int b)->Vector3f{ return safe_normalize(lerp(n[a], n[b], 0.5f)); };
+
+                    switch (mask) {
+                        case 1: case 14: {
+                            bool inv = (mask==14);
+                            int a=0,b=1,c=2,d=3;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
+                            Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        case 2: case 13: {
+                            bool inv = (mask==13);
+                            int a=1,b=0,c=2,d=3;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
+                            Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        case 3: case 12: {
+                            bool inv = (mask==12);
+                            int a=0,b=2,c=1,d=3;
+                            Vector3f v0 = edgeP(a,c), v1 = edgeP(b,c), v2 = edgeP(a,d);
+                            Vector3f v3 = edgeP(b,d);
+                            Vector3f n0 = edgeN(a,c), n1 = edgeN(b,c), n2 = edgeN(a,d), n3 = edgeN(b,d);
+                            if (!inv) { emitTri(v0,v1,v2, n0,n1,n2); emitTri(v1,v3,v2, n1,n3,n2);} else { emitTri(v0,v2,v1, n0,n2,n1); emitTri(v1,v2,v3, n1,n2,n3);} 
+                        } break;
+                        case 4: case 11: {
+                            bool inv = (mask==11);
+                            int a=2,b=0,c=1,d=3;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
+                            Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        case 5: case 10: {
+                            bool inv = (mask==10);
+                            int a=0,b=1,c=2;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(b,c), v2 = edgeP(c,a);
+                            Vector3f na = edgeN(a,b), nb = edgeN(b,c), nc = edgeN(c,a);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        case 6: case 9: {
+                            bool inv = (mask==9);
+                            int a=1,b=0,c=2;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(b,c), v2 = edgeP(c,a);
+                            Vector3f na = edgeN(a,b), nb = edgeN(b,c), nc = edgeN(c,a);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        case 7: case 8: {
+                            bool inv = (mask==8);
+                            int a=3,b=0,c=1,d=2;
+                            Vector3f v0 = edgeP(a,b), v1 = edgeP(a,c), v2 = edgeP(a,d);
+                            Vector3f na = edgeN(a,b), nb = edgeN(a,c), nc = edgeN(a,d);
+                            if (!inv) emitTri(v0,v1,v2, na,nb,nc); else emitTri(v0,v2,v1, na,nc,nb);
+                        } break;
+                        default: break;
+                    }
+                }
             }
         }
+
+        sink.endSlab(z);
+        volume.releaseSlicesBelow(z);
     }
+}
 
-    return surface;
+namespace
+{
+    // Collects the streamed triangles into one in-memory mesh per isovalue.
+    struct GeneratedSurfaceSink : IsoSurfaceSink
+    {
+        std::vector<GeneratedSurface>& surfaces;
+        explicit GeneratedSurfaceSink(std::vector<GeneratedSurface>& s) : surfaces(s) {}
+
+        void triangle(int level, const Vector3f p[3], const Vector3f n[3]) override
+        {
+            GeneratedSurface& surface = surfaces[level];
+            int base = (int)surface.positions.size();
+            for (int k = 0; k < 3; ++k) {
+                surface.positions.push_back(p[k]);
+                surface.normals.push_back(n[k]);
+            }
+            surface.indices.emplace_back(base+0, base+1, base+2);
+        }
+    };
+
+    // Writes binary STL, one file per isovalue. Triangles are buffered per slab and appended
+    // to the files at the end of each slab; the triangle counts in the headers are patched at the end.
+    struct StlSink : IsoSurfaceSink
+    {
+        struct Output
+        {
+            std::ofstream       out;
+            std::vector<char>   buffer;
+            uint32_t            count = 0;
+        };
+        std::vector<Output>&    outputs;
+        explicit StlSink(std::vector<Output>& o) : outputs(o) {}
+
+        void triangle(int level, const Vector3f p[3], const Vector3f n[3]) override
+        {
+            (void)n;
+            Vector3f fn = safe_normalize((p[1] - p[0]).cross(p[2] - p[0]));
+            float rec[12] = { fn.x(), fn.y(), fn.z(),
+                              p[0].x(), p[0].y(), p[0].z(),
+                              p[1].x(), p[1].y(), p[1].z(),
+                              p[2].x(), p[2].y(), p[2].z() };
+            const char* bytes = reinterpret_cast<const char*>(rec);
+            Output& o = outputs[level];
+            o.buffer.insert(o.buffer.end(), bytes, bytes + sizeof(rec));
+            o.buffer.push_back(0); o.buffer.push_back(0);   // attribute byte count
+            ++o.count;
+        }
+
+        void endSlab(int z) override
+        {
+            (void)z;
+            for (Output& o : outputs) {
+                o.out.write(o.buffer.data(), std::streamsize(o.buffer.size()));
+                o.buffer.clear();
+            }
+        }
+    };
+}
+
+bool parseIsoMethod(const std::string& name, IsoMethod& method)
+{
+    if (name.empty() || name == "mt") method = IsoMethod::MarchingTetrahedra;
+    else if (name == "mc")            method = IsoMethod::MarchingCubes;
+    else return false;
+    return true;
+}
+
+std::vector<GeneratedSurface> makeIsoSurfacesRAW(const std::string& rawPath,
+                                                 const Vector3i& dims,
+                                                 const std::vector<float>& isos,
+                                                 const Vector3f& spacing,
+                                                 const Vector3f& origin,
+                                                 const std::string& dtype,
+                                                 const std::string& method)
+{
+    std::vector<GeneratedSurface> surfaces(isos.size());
+    if (dims.x() < 2 || dims.y() < 2 || dims.z() < 2) return surfaces;
+
+    VoxelType type;
+    if (!parseVoxelType(dtype, type)) {
+        std::cerr << "Unsupported dtype: " << dtype << std::endl;
+        return surfaces;
+    }
+    IsoMethod iso_method;
+    if (!parseIsoMethod(method, iso_method)) {
+        std::cerr << "Unsupported isosurface method: " << method << std::endl;
+        return surfaces;
+    }
+
+    RawVolume volume;
+    if (!volume.open(rawPath, dims, type))
+        return surfaces;
+
+    GeneratedSurfaceSink sink(surfaces);
+    extractIsoSurface(volume, isos, spacing, origin, sink, iso_method);
+
+    return surfaces;
+}
+
+std::string isoSurfaceOutputPath(const std::string& path, size_t level, size_t count)
+{
+    if (count <= 1)
+        return path;
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+    return path.substr(0, dot) + "_" + std::to_string(level) + path.substr(dot);
+}
+
+int64_t writeIsoSurfaceSTL(const std::string& rawPath,
+                           const Vector3i& dims,
+                           const std::vector<float>& isos,
+                           const Vector3f& spacing,
+                           const Vector3f& origin,
+                           const std::string& dtype,
+                           const std::string& stlPath,
+                           const std::string& method)
+{
+    VoxelType type;
+    if (!parseVoxelType(dtype, type)) {
+        std::cerr << "Unsupported dtype: " << dtype << std::endl;
+        return -1;
+    }
+    IsoMethod iso_method;
+    if (!parseIsoMethod(method, iso_method)) {
+        std::cerr << "Unsupported isosurface method: " << method << std::endl;
+        return -1;
+    }
+
+    RawVolume volume;
+    if (!volume.open(rawPath, dims, type))
+        return -1;
+
+    char header[80] = "binary STL isosurface";
+    uint32_t count = 0;
+
+    std::vector<StlSink::Output> outputs(isos.size());
+    for (size_t k = 0; k < outputs.size(); ++k) {
+        std::string path = isoSurfaceOutputPath(stlPath, k, outputs.size());
+        outputs[k].out.open(path, std::ios::binary);
+        if (!outputs[k].out) {
+            std::cerr << "Failed to open STL output: " << path << std::endl;
+            return -1;
+        }
+        outputs[k].out.write(header, sizeof(header));
+        outputs[k].out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    }
+
+    StlSink sink(outputs);
+    extractIsoSurface(volume, isos, spacing, origin, sink, iso_method);
+
+    int64_t total = 0;
+    for (size_t k = 0; k < outputs.size(); ++k) {
+        count = outputs[k].count;
+        outputs[k].out.seekp(sizeof(header));
+        outputs[k].out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        if (!outputs[k].out) {
+            std::cerr << "Failed to write STL output: " << isoSurfaceOutputPath(stlPath, k, outputs.size()) << std::endl;
+            return -1;
+        }
+        total += count;
+    }
+
+    return total;
+}
+
+namespace
+{
+    struct CancellableSurfaceSink : GeneratedSurfaceSink
+    {
+        const std::atomic<bool>& cancel;
+        CancellableSurfaceSink(std::vector<GeneratedSurface>& s, const std::atomic<bool>& c) : GeneratedSurfaceSink(s), cancel(c) {}
+        bool cancelled() const override { return cancel.load(std::memory_order_relaxed); }
+    };
+}
+
+ProgressiveIsoSurface::~ProgressiveIsoSurface()
+{
+    cancel();
+}
+
+bool ProgressiveIsoSurface::start(const std::string& rawPath,
+                                  const Vector3i& dims,
+                                  const std::vector<float>& isos,
+                                  const Vector3f& spacing,
+                                  const Vector3f& origin,
+                                  const std::string& dtype,
+                                  const std::string& method,
+                                  size_t preview_voxels)
+{
+    cancel();
+    m_levels.clear();
+    m_spacings.clear();
+    m_origins.clear();
+    m_surfaces.assign(isos.size(), GeneratedSurface());
+    m_isos = isos;
+    m_level = 0;
+
+    VoxelType type;
+    if (!parseVoxelType(dtype, type)) {
+        std::cerr << "Unsupported dtype: " << dtype << std::endl;
+        return false;
+    }
+    if (!parseIsoMethod(method, m_method)) {
+        std::cerr << "Unsupported isosurface method: " << method << std::endl;
+        return false;
+    }
+
+    auto base = std::make_unique<RawVolume>();
+    if (!base->open(rawPath, dims, type))
+        return false;
+    m_levels.push_back(std::move(base));
+    m_spacings.push_back(spacing);
+    m_origins.push_back(origin);
+
+    // Halve until the preview budget is met, but keep enough cells for a recognizable shape.
+    // Only the grids are laid out here: averaging even the first level reads the whole file,
+    // so refine() builds the levels in the background and the preview is subsampled.
+    Vector3i level_dims = dims;
+    while (size_t(level_dims.prod()) > preview_voxels && level_dims.minCoeff() >= 8) {
+        level_dims = (level_dims.array() + 1) / 2;
+        m_origins.push_back(m_origins.back() + 0.5f * m_spacings.back());
+        m_spacings.push_back(2.0f * m_spacings.back());
+        m_levels.push_back(nullptr);
+    }
+
+    m_level = int(m_levels.size()) - 1;
+    if (m_level > 0) {
+        m_levels[m_level] = std::make_unique<RawVolume>();
+        subsampleVolume(*m_levels[0], m_level, *m_levels[m_level]);
+    }
+    m_surfaces = extract(m_level);
+
+    if (m_level > 0)
+        m_worker = std::thread(&ProgressiveIsoSurface::refine, this);
+    return true;
+}
+
+std::vector<GeneratedSurface> ProgressiveIsoSurface::extract(int level) const
+{
+    std::vector<GeneratedSurface> surfaces(m_isos.size());
+    CancellableSurfaceSink sink(surfaces, m_cancel);
+    extractIsoSurface(*m_levels[level], m_isos, m_spacings[level], m_origins[level], sink, m_method);
+    return surfaces;
+}
+
+void ProgressiveIsoSurface::refine()
+{
+    // the levels between the file and the preview
+    for (int level = 1; level < m_level; ++level) {
+        auto coarse = std::make_unique<RawVolume>();
+        if (!downsampleVolume(*m_levels[level - 1], *coarse, &m_cancel))
+            return;
+        m_levels[level] = std::move(coarse);
+    }
+
+    for (int level = m_level - 1; level >= 0; --level) {
+        auto surfaces = extract(level);
+        if (m_cancel)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ready = std::move(surfaces);
+        m_ready_level = level;
+    }
+}
+
+bool ProgressiveIsoSurface::update()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_ready_level < 0 || m_ready_level >= m_level)
+        return false;
+    m_surfaces = std::move(m_ready);
+    m_level = m_ready_level;
+    m_ready_level = -1;
+    if (m_level == 0 && m_worker.joinable())
+        m_worker.join();
+    return true;
+}
+
+void ProgressiveIsoSurface::cancel()
+{
+    m_cancel = true;
+    if (m_worker.joinable())
+        m_worker.join();
+    m_cancel = false;
+    m_ready_level = -1;
+    m_ready.clear();
 }
@@ -1,8 +1,12 @@
 #pragma once
 
 #include "curve.h"
+#include "volume.h"
 
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 
 struct ParsedSurface {
@@ -11,10 +15,13 @@ struct ParsedSurface {
     // For isosurface extraction from a volume file (RAW)
     std::string volume_file;     // path to RAW file
     Vector3i    dims = Vector3i(0,0,0); // Nx, Ny, Nz
-    float       iso = 0.0f;      // isovalue (normalized if dtype is uint8)
+    std::vector<float> isos;     // isovalues (normalized if dtype is uint8); one surface is extracted per value
     Vector3f    spacing = Vector3f(1.0f,1.0f,1.0f); // voxel spacing
     Vector3f    origin  = Vector3f(0.0f,0.0f,0.0f); // grid origin
     std::string dtype;           // "uint8" (default), "uint16", or "float32"
+    std::string method;          // "mt" (marching tetrahedra, default) or "mc" (marching cubes)
+    std::string output_file;     // optional: stream triangles to this binary STL instead of displaying them
+    std::string render;          // "mesh" (extract triangles, default) or "raymarch" (GPU ray marching, no mesh)
 };
 
 // GeneratedSurface is just a struct that contains vertices, normals, and
@@ -55,10 +62,14 @@ static inline void to_json(json& j, const ParsedSurface& s) {
     } else if (s.type == "isosurface") {
         j["volume_file"] = s.volume_file;
         j["dims"] = std::vector<int>{ s.dims.x(), s.dims.y(), s.dims.z() };
-        j["iso"] = s.iso;
+        if (s.isos.size() == 1) j["iso"] = s.isos[0];
+        else j["iso"] = s.isos;
         j["spacing"] = std::vector<float>{ s.spacing.x(), s.spacing.y(), s.spacing.z() };
         j["origin"]  = std::vector<float>{ s.origin.x(),  s.origin.y(),  s.origin.z() };
         j["dtype"] = s.dtype;
+        if (!s.method.empty()) j["method"] = s.method;
+        if (!s.output_file.empty()) j["output_file"] = s.output_file;
+        if (!s.render.empty()) j["render"] = s.render;
     }
 }
 
@@ -71,7 +82,11 @@ static inline void from_json(const json& j, ParsedSurface& s) {
         auto dimsVec = j.at("dims").get<std::vector<int>>();
         if (dimsVec.size() != 3) throw std::runtime_error("isosurface dims must be [nx,ny,nz]");
         s.dims = Vector3i(dimsVec[0], dimsVec[1], dimsVec[2]);
-        s.iso = j.value("iso", 0.5f);
+        // "iso" is either a single value or a list of them
+        if (!j.contains("iso"))               s.isos = { 0.5f };
+        else if (j.at("iso").is_array())      j.at("iso").get_to(s.isos);
+        else                                  s.isos = { j.at("iso").get<float>() };
+        if (s.isos.empty()) throw std::runtime_error("isosurface iso list must not be empty");
         if (j.contains("spacing")) {
             auto sp = j.at("spacing").get<std::vector<float>>();
             if (sp.size() == 3) s.spacing = Vector3f(sp[0], sp[1], sp[2]);
@@ -81,13 +96,121 @@ static inline void from_json(const json& j, ParsedSurface& s) {
             if (org.size() == 3) s.origin = Vector3f(org[0], org[1], org[2]);
         }
     s.dtype = j.value("dtype", std::string("uint16"));
+        s.method = j.value("method", std::string());
+        s.output_file = j.value("output_file", std::string());
+        s.render = j.value("render", std::string());
     }
 }
 
-// Build an isosurface mesh from a RAW volume file using marching tetrahedra
-GeneratedSurface makeIsoSurfaceRAW(const std::string& rawPath,
-                                   const Vector3i& dims,
-                                   float iso,
-                                   const Vector3f& spacing = Vector3f(1,1,1),
-                                   const Vector3f& origin = Vector3f(0,0,0),
-                                   const std::string& dtype = std::string("uint8"));
+// Receives isosurface triangles as they are produced by the streaming extractor.
+// level is the index of the isovalue the triangle belongs to. endSlab(z) is called
+// once all cells between slices z and z+1 have been processed, which is the point
+// where a sink can flush its buffered triangles (to a file, or to a GPU upload
+// queue) without holding on to the whole mesh.
+struct IsoSurfaceSink
+{
+    virtual         ~IsoSurfaceSink() = default;
+    virtual void    triangle(int level, const Vector3f p[3], const Vector3f n[3]) = 0;
+    virtual void    endSlab(int z) { (void)z; }
+    // Polled once per slab; returning true stops the extraction early.
+    virtual bool    cancelled() const { return false; }
+};
+
+// Marching tetrahedra splits every cell into six tetrahedra; marching cubes works on
+// whole cells from case tables and produces roughly half as many triangles.
+enum class IsoMethod
+{
+    MarchingTetrahedra,
+    MarchingCubes
+};
+
+// Parses "mt" (or an empty string) and "mc". Returns false for anything else.
+bool parseIsoMethod(const std::string& name, IsoMethod& method);
+
+// Streaming isosurface extraction over a memory mapped volume. Cells are visited slab
+// by slab in z, and slices that are no longer needed for gradients are released,
+// so the resident set stays at a few slices regardless of the volume size.
+// All isovalues are extracted in the same pass; each cell is read and classified once.
+void extractIsoSurface(const RawVolume& volume,
+                       const std::vector<float>& isos,
+                       const Vector3f& spacing,
+                       const Vector3f& origin,
+                       IsoSurfaceSink& sink,
+                       IsoMethod method = IsoMethod::MarchingTetrahedra);
+
+// Build isosurface meshes from a RAW volume file using marching tetrahedra ("mt")
+// or marching cubes ("mc"), one mesh per isovalue in the order given.
+std::vector<GeneratedSurface> makeIsoSurfacesRAW(const std::string& rawPath,
+                                                 const Vector3i& dims,
+                                                 const std::vector<float>& isos,
+                                                 const Vector3f& spacing = Vector3f(1,1,1),
+                                                 const Vector3f& origin = Vector3f(0,0,0),
+                                                 const std::string& dtype = std::string("uint8"),
+                                                 const std::string& method = std::string("mt"));
+
+// Same as above, but writes the triangles to a binary STL file as they are extracted
+// instead of keeping them in memory. With several isovalues, isovalue k goes to
+// stlPath with "_k" inserted before the extension.
+// Returns the total number of triangles written, or -1 on error.
+int64_t writeIsoSurfaceSTL(const std::string& rawPath,
+                           const Vector3i& dims,
+                           const std::vector<float>& isos,
+                           const Vector3f& spacing,
+                           const Vector3f& origin,
+                           const std::string& dtype,
+                           const std::string& stlPath,
+                           const std::string& method = std::string("mt"));
+
+// File name used for isovalue `level` when writing `count` isosurfaces to path.
+std::string isoSurfaceOutputPath(const std::string& path, size_t level, size_t count);
+
+// Progressive isosurface extraction over a volume pyramid. start() subsamples the coarsest
+// level from a small part of the file and extracts it right away, so there is something to
+// show within a frame or two; a background thread then builds the finer levels and extracts
+// them one by one. Call update() once per frame: it returns true when a finer level has
+// become available in surfaces().
+class ProgressiveIsoSurface
+{
+public:
+                        ProgressiveIsoSurface() = default;
+                        ~ProgressiveIsoSurface();
+                        ProgressiveIsoSurface(const ProgressiveIsoSurface&) = delete;
+    ProgressiveIsoSurface& operator=(const ProgressiveIsoSurface&) = delete;
+
+    // The coarsest level has at most preview_voxels voxels. Returns false if the volume
+    // could not be opened; messages go to std::cerr like for makeIsoSurfacesRAW.
+    bool                start(const std::string& rawPath,
+                              const Vector3i& dims,
+                              const std::vector<float>& isos,
+                              const Vector3f& spacing,
+                              const Vector3f& origin,
+                              const std::string& dtype,
+                              const std::string& method,
+                              size_t preview_voxels = 48 * 48 * 48);
+
+    bool                update();
+    void                cancel();
+
+    // One mesh per isovalue, from the finest level extracted so far.
+    const std::vector<GeneratedSurface>& surfaces() const { return m_surfaces; }
+    int                 level() const { return m_level; }       // 0 is full resolution
+    bool                finished() const { return m_level == 0; }
+
+private:
+    void                refine();
+    std::vector<GeneratedSurface> extract(int level) const;
+
+    std::vector<std::unique_ptr<RawVolume>> m_levels;       // [0] is the mapped file; the others are null until built
+    std::vector<Vector3f>   m_spacings, m_origins;
+    std::vector<float>      m_isos;
+    IsoMethod               m_method = IsoMethod::MarchingTetrahedra;
+
+    std::vector<GeneratedSurface> m_surfaces;
+    int                     m_level = 0;
+
+    std::thread             m_worker;
+    std::atomic<bool>       m_cancel{false};
+    std::mutex              m_mutex;                        // guards the two below
+    std::vector<GeneratedSurface> m_ready;
+    int                     m_ready_level = -1;
+};
@@ -0,0 +1,297 @@
+#include "volume.h"
+
+#include <algorithm>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool parseVoxelType(const std::string& name, VoxelType& type)
+{
+    if (name == "uint8")        type = VoxelType::UInt8;
+    else if (name == "uint16")  type = VoxelType::UInt16;
+    else if (name == "float32") type = VoxelType::Float32;
+    else return false;
+    return true;
+}
+
+size_t voxelSize(VoxelType type)
+{
+    switch (type) {
+        case VoxelType::UInt8:  return 1;
+        case VoxelType::UInt16: return 2;
+        default:                return 4;
+    }
+}
+
+namespace
+{
+    size_t pageSize()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return size_t(info.dwPageSize);
+#else
+        return size_t(sysconf(_SC_PAGESIZE));
+#endif
+    }
+}
+
+RawVolume::~RawVolume()
+{
+    close();
+}
+
+bool RawVolume::open(const std::string& path, const Eigen::Vector3i& dims, VoxelType type)
+{
+    close();
+
+    if (dims.x() < 1 || dims.y() < 1 || dims.z() < 1) {
+        std::cerr << "Invalid RAW volume dimensions for " << path << std::endl;
+        return false;
+    }
+
+    m_dims = dims;
+    m_type = type;
+    m_slice_bytes = size_t(dims.x()) * size_t(dims.y()) * voxelSize(type);
+    size_t expected = m_slice_bytes * size_t(dims.z());
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::cerr << "Failed to open RAW volume: " << path << std::endl;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size_t(size.QuadPart) < expected) {
+        std::cerr << "Failed to read expected number of bytes from RAW volume." << std::endl;
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        std::cerr << "Failed to map RAW volume: " << path << std::endl;
+        CloseHandle(file);
+        return false;
+    }
+    void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, expected);
+    if (ptr == nullptr) {
+        std::cerr << "Failed to map RAW volume: " << path << std::endl;
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Failed to open RAW volume: " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < expected) {
+        std::cerr << "Failed to read expected number of bytes from RAW volume." << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, expected, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "Failed to map RAW volume: " << path << std::endl;
+        ::close(fd);
+        return false;
+    }
+    // We walk the volume front to back, so let the kernel read ahead aggressively
+    // and reclaim pages behind us.
+    posix_madvise(ptr, expected, POSIX_MADV_SEQUENTIAL);
+    m_fd = fd;
+#endif
+
+    m_data = static_cast<const uint8_t*>(ptr);
+    m_mapped_bytes = expected;
+    m_released_bytes = 0;
+    return true;
+}
+
+void RawVolume::assign(std::vector<float>&& voxels, const Eigen::Vector3i& dims)
+{
+    close();
+    m_voxels = std::move(voxels);
+    m_dims = dims;
+    m_type = VoxelType::Float32;
+    m_slice_bytes = size_t(dims.x()) * size_t(dims.y()) * sizeof(float);
+    m_mapped_bytes = m_voxels.size() * sizeof(float);
+    m_data = reinterpret_cast<const uint8_t*>(m_voxels.data());
+}
+
+void RawVolume::close()
+{
+    if (m_data == nullptr)
+        return;
+
+    if (!m_voxels.empty()) {
+        m_voxels.clear();
+        m_voxels.shrink_to_fit();
+        m_data = nullptr;
+        m_mapped_bytes = 0;
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(static_cast<HANDLE>(m_mapping));
+    CloseHandle(static_cast<HANDLE>(m_file));
+    m_mapping = nullptr;
+    m_file = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(m_data), m_mapped_bytes);
+    ::close(m_fd);
+    m_fd = -1;
+#endif
+
+    m_data = nullptr;
+    m_mapped_bytes = 0;
+    m_released_bytes = 0;
+}
+
+void RawVolume::readRow(int y, int z, float* out) const
+{
+    size_t begin = size_t(m_dims.x()) * (size_t(y) + size_t(m_dims.y()) * size_t(z));
+    int n = m_dims.x();
+    switch (m_type) {
+        case VoxelType::UInt8: {
+            const uint8_t* src = m_data + begin;
+            for (int x = 0; x < n; ++x) out[x] = float(src[x]) * (1.0f / 255.0f);
+        } break;
+        case VoxelType::UInt16: {
+            const uint16_t* src = reinterpret_cast<const uint16_t*>(m_data) + begin;
+            for (int x = 0; x < n; ++x) out[x] = float(src[x]) * (1.0f / 65535.0f);
+        } break;
+        default:
+            std::copy_n(reinterpret_cast<const float*>(m_data) + begin, n, out);
+    }
+}
+
+void RawVolume::releaseSlicesBelow(int z) const
+{
+    if (m_data == nullptr || z <= 0 || !m_voxels.empty())
+        return;
+
+    // Only whole pages can be released; a partial page at the end stays resident
+    // until the next call covers it.
+    size_t page = pageSize();
+    size_t end = std::min(m_slice_bytes * size_t(z), m_mapped_bytes);
+    end -= end % page;
+    if (end <= m_released_bytes)
+        return;
+
+    uint8_t* begin = const_cast<uint8_t*>(m_data) + m_released_bytes;
+#ifdef _WIN32
+    // Unlocking pages that were never locked removes them from the working set.
+    VirtualUnlock(begin, end - m_released_bytes);
+#else
+    madvise(begin, end - m_released_bytes, MADV_DONTNEED);
+#endif
+    m_released_bytes = end;
+}
+
+bool downsampleVolume(const RawVolume& fine, RawVolume& coarse, const std::atomic<bool>* cancel)
+{
+    const Eigen::Vector3i& fd = fine.dims();
+    Eigen::Vector3i cd((fd.x() + 1) / 2, (fd.y() + 1) / 2, (fd.z() + 1) / 2);
+    std::vector<float> voxels(size_t(cd.prod()));
+    fine.rewind();
+    bool cancelled = false;
+
+#pragma omp parallel
+    {
+        // Four fine rows (y0/y1 x z0/z1) as floats, padded to an even length so the
+        // reduction below is a branch-free loop the compiler can vectorize.
+        int padded = 2 * cd.x();
+        std::vector<float> rows(4 * size_t(padded));
+
+        // Slices go one at a time, with the rows of each split among the threads, so that
+        // the fine slices behind the pass can be released.
+        for (int z = 0; z < cd.z() && !cancelled; ++z)
+        {
+#pragma omp for
+            for (int y = 0; y < cd.y(); ++y)
+            {
+                int zs[2] = { 2 * z, std::min(2 * z + 1, fd.z() - 1) };
+                int ys[2] = { 2 * y, std::min(2 * y + 1, fd.y() - 1) };
+                for (int r = 0; r < 4; ++r) {
+                    float* row = rows.data() + r * padded;
+                    fine.readRow(ys[r & 1], zs[r >> 1], row);
+                    if (padded > fd.x())
+                        row[padded - 1] = row[fd.x() - 1];
+                }
+
+                const float* r0 = rows.data();
+                const float* r1 = r0 + padded;
+                const float* r2 = r1 + padded;
+                const float* r3 = r2 + padded;
+                float* out = voxels.data() + size_t(cd.x()) * (size_t(y) + size_t(cd.y()) * size_t(z));
+                for (int x = 0; x < cd.x(); ++x)
+                    out[x] = 0.125f * (r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] +
+                                       r2[2*x] + r2[2*x+1] + r3[2*x] + r3[2*x+1]);
+            }
+            // The barrier at the end of the loop above guarantees that no thread still reads
+            // the released slices, and the one after this block that all threads see the same
+            // cancelled flag.
+#pragma omp single
+            {
+                fine.releaseSlicesBelow(2 * z + 2);
+                cancelled = cancel != nullptr && cancel->load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    if (cancelled)
+        return false;
+    coarse.assign(std::move(voxels), cd);
+    return true;
+}
+
+void subsampleVolume(const RawVolume& fine, int levels, RawVolume& coarse)
+{
+    const Eigen::Vector3i& fd = fine.dims();
+    Eigen::Vector3i cd = fd;
+    for (int i = 0; i < levels; ++i)
+        cd = (cd.array() + 1) / 2;
+    std::vector<float> voxels(size_t(cd.prod()));
+    fine.rewind();
+
+    // Coarse voxel i covers fine voxels [i * block, (i + 1) * block), and its center lies
+    // between the two in the middle.
+    const int block = 1 << levels;
+    auto center = [&](int i, int k, int axis) { return std::min(i * block + block / 2 - 1 + k, fd[axis] - 1); };
+
+    for (int z = 0; z < cd.z(); ++z)
+    {
+#pragma omp parallel for
+        for (int y = 0; y < cd.y(); ++y)
+        {
+            float* out = voxels.data() + size_t(cd.x()) * (size_t(y) + size_t(cd.y()) * size_t(z));
+            for (int x = 0; x < cd.x(); ++x)
+            {
+                float sum = 0.0f;
+                for (int k = 0; k < 8; ++k)
+                    sum += fine.at(center(x, k & 1, 0), center(y, (k >> 1) & 1, 1), center(z, k >> 2, 2));
+                out[x] = 0.125f * sum;
+            }
+        }
+        fine.releaseSlicesBelow(center(z, 1, 2) + 1);
+    }
+
+    coarse.assign(std::move(voxels), cd);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+#include <string>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Voxel storage formats supported for RAW volumes.
+enum class VoxelType
+{
+    UInt8,
+    UInt16,
+    Float32
+};
+
+// Parses "uint8", "uint16" or "float32". Returns false for anything else.
+bool        parseVoxelType(const std::string& name, VoxelType& type);
+size_t      voxelSize(VoxelType type);
+
+// Read-only view of a RAW volume file that is memory mapped instead of read into memory.
+// The OS pages voxels in on demand, so volumes larger than RAM can be processed as long as
+// the consumer walks through them in z order and calls releaseSlicesBelow() for slices it
+// no longer needs. Samples are normalized to [0,1] for integer voxel types, like before.
+// A RawVolume can also hold float voxels in memory; the coarse levels of a volume
+// pyramid are stored this way so the same extraction code runs on all levels.
+class RawVolume
+{
+public:
+                        RawVolume() = default;
+                        ~RawVolume();
+                        RawVolume(const RawVolume&) = delete;
+    RawVolume&          operator=(const RawVolume&) = delete;
+
+    // Maps the file and checks that it holds at least dims.prod() voxels.
+    // Prints a message to std::cerr and returns false on failure.
+    bool                open(const std::string& path, const Eigen::Vector3i& dims, VoxelType type);
+    void                close();
+    // Takes ownership of in-memory float voxels instead of mapping a file.
+    void                assign(std::vector<float>&& voxels, const Eigen::Vector3i& dims);
+    bool                isOpen() const { return m_data != nullptr; }
+
+    const Eigen::Vector3i& dims() const { return m_dims; }
+    VoxelType           type() const { return m_type; }
+    size_t              sliceBytes() const { return m_slice_bytes; }
+    const void*         slice(int z) const { return m_data + m_slice_bytes * size_t(z); }
+
+    inline float at(int x, int y, int z) const
+    {
+        size_t idx = size_t(x) + size_t(m_dims.x()) * (size_t(y) + size_t(m_dims.y()) * size_t(z));
+        switch (m_type) {
+            case VoxelType::UInt8:  return float(m_data[idx]) / 255.0f;
+            case VoxelType::UInt16: return float(reinterpret_cast<const uint16_t*>(m_data)[idx]) / 65535.0f;
+            default:                return reinterpret_cast<const float*>(m_data)[idx];
+        }
+    }
+
+    // Converts the voxels of row (y, z) to normalized floats.
+    void                readRow(int y, int z, float* out) const;
+
+    // Tells the OS that the pages holding slices [0, z) will not be touched again,
+    // so they can be dropped from the resident set. This is what keeps peak RSS
+    // bounded by a few slices during streaming extraction. Call rewind() before
+    // starting another front to back pass over the same volume.
+    void                releaseSlicesBelow(int z) const;
+    void                rewind() const { m_released_bytes = 0; }
+
+private:
+    const uint8_t*      m_data = nullptr;
+    size_t              m_mapped_bytes = 0;
+    size_t              m_slice_bytes = 0;
+    mutable size_t      m_released_bytes = 0;
+    Eigen::Vector3i     m_dims = Eigen::Vector3i(0, 0, 0);
+    VoxelType           m_type = VoxelType::UInt8;
+    std::vector<float>  m_voxels;           // in-memory volumes only
+
+#ifdef _WIN32
+    void*               m_file = nullptr;
+    void*               m_mapping = nullptr;
+#else
+    int                 m_fd = -1;
+#endif
+};
+
+// Halves the resolution of a volume by averaging 2x2x2 blocks of voxels; odd sizes round up
+// and repeat the last voxel. The result is an in-memory float volume. Coarse voxel i sits at
+// fine coordinate 2i + 0.5, so the coarse grid has twice the spacing and is offset by half
+// a fine voxel. The fine volume is read front to back and its slices are released as the
+// pass goes, so a mapped volume never becomes fully resident. Returns false, leaving coarse
+// alone, if cancel is set before the pass is over.
+bool downsampleVolume(const RawVolume& fine, RawVolume& coarse, const std::atomic<bool>* cancel = nullptr);
+
+// The grid that `levels` calls to downsampleVolume() would give, but each coarse voxel only
+// averages the 2x2x2 fine voxels at the center of its block. Only a small fraction of a
+// mapped volume is read, which makes this a quick stand-in for the coarse levels of a large
+// volume; it equals downsampleVolume() for levels = 1.
+void subsampleVolume(const RawVolume& fine, int levels, RawVolume& coarse);
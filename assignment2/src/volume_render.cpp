@@ -0,0 +1,330 @@
+#include "app.h"
+
+#include "volume_render.h"
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+namespace
+{
+    // Unit cube, wound counterclockwise when seen from outside.
+    const float cubeCorners[8][3] = {
+        {0,0,0}, {1,0,0}, {0,1,0}, {1,1,0}, {0,0,1}, {1,0,1}, {0,1,1}, {1,1,1}
+    };
+    const int cubeTriangles[12][3] = {
+        {0,4,6}, {0,6,2},   // -x
+        {1,3,7}, {1,7,5},   // +x
+        {0,1,5}, {0,5,4},   // -y
+        {2,6,7}, {2,7,3},   // +y
+        {0,2,3}, {0,3,1},   // -z
+        {4,5,7}, {4,7,6},   // +z
+    };
+}
+
+RaymarchedVolume::~RaymarchedVolume()
+{
+    if (m_vao != 0) {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_vertex_buffer);
+        glDeleteTextures(1, &m_volume_texture);
+        glDeleteTextures(1, &m_occupancy_texture);
+    }
+}
+
+bool RaymarchedVolume::upload(const RawVolume& volume, const Vector3f& spacing, const Vector3f& origin)
+{
+    const Vector3i& dims = volume.dims();
+    if (!volume.isOpen() || dims.x() < 2 || dims.y() < 2 || dims.z() < 2)
+        return false;
+
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+    if (dims.maxCoeff() > max_size) {
+        std::cerr << "Volume of size " << dims.transpose() << " exceeds GL_MAX_3D_TEXTURE_SIZE (" << max_size << ")" << std::endl;
+        return false;
+    }
+
+    m_dims = dims;
+    m_spacing = spacing;
+    m_origin = origin;
+    // Brick b covers voxels [b*BrickSize, (b+1)*BrickSize], one voxel of overlap,
+    // so that every trilinear sample taken inside it only touches voxels of the brick.
+    m_bricks = Vector3i((dims.x() - 2) / BrickSize + 1, (dims.y() - 2) / BrickSize + 1, (dims.z() - 2) / BrickSize + 1);
+
+    GLenum internal_format, type;
+    switch (volume.type()) {
+        case VoxelType::UInt8:  internal_format = GL_R8;    type = GL_UNSIGNED_BYTE;  break;
+        case VoxelType::UInt16: internal_format = GL_R16;   type = GL_UNSIGNED_SHORT; break;
+        default:                internal_format = GL_R32F;  type = GL_FLOAT;          break;
+    }
+
+    glGenTextures(1, &m_volume_texture);
+    glBindTexture(GL_TEXTURE_3D, m_volume_texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, internal_format, dims.x(), dims.y(), dims.z(), 0, GL_RED, type, nullptr);
+
+    std::vector<Eigen::Vector2f> ranges(size_t(m_bricks.prod()));
+    m_min_value = std::numeric_limits<float>::max();
+    m_max_value = -std::numeric_limits<float>::max();
+
+    // Walk the volume one layer of bricks at a time: upload its slices, compute the
+    // brick ranges, and let the OS drop the pages behind us.
+    for (int bz = 0; bz < m_bricks.z(); ++bz)
+    {
+        int z0 = bz * BrickSize;
+        int z1 = std::min(z0 + BrickSize, dims.z() - 1);       // inclusive
+        int upload_end = (bz == m_bricks.z() - 1) ? dims.z() : z0 + BrickSize;
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z0, dims.x(), dims.y(), upload_end - z0, GL_RED, type, volume.slice(z0));
+
+        float layer_min = std::numeric_limits<float>::max();
+        float layer_max = -std::numeric_limits<float>::max();
+#pragma omp parallel for reduction(min:layer_min) reduction(max:layer_max)
+        for (int by = 0; by < m_bricks.y(); ++by)
+        for (int bx = 0; bx < m_bricks.x(); ++bx)
+        {
+            int y0 = by * BrickSize, y1 = std::min(y0 + BrickSize, dims.y() - 1);
+            int x0 = bx * BrickSize, x1 = std::min(x0 + BrickSize, dims.x() - 1);
+            float lo = std::numeric_limits<float>::max(), hi = -std::numeric_limits<float>::max();
+            for (int z = z0; z <= z1; ++z)
+            for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x) {
+                float v = volume.at(x, y, z);
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+            ranges[size_t(bx) + size_t(m_bricks.x()) * (size_t(by) + size_t(m_bricks.y()) * size_t(bz))] = Eigen::Vector2f(lo, hi);
+            layer_min = std::min(layer_min, lo);
+            layer_max = std::max(layer_max, hi);
+        }
+        m_min_value = std::min(m_min_value, layer_min);
+        m_max_value = std::max(m_max_value, layer_max);
+
+        volume.releaseSlicesBelow(upload_end);
+    }
+
+    glGenTextures(1, &m_occupancy_texture);
+    glBindTexture(GL_TEXTURE_3D, m_occupancy_texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG32F, m_bricks.x(), m_bricks.y(), m_bricks.z(), 0, GL_RG, GL_FLOAT, ranges.data());
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // Bounding box proxy geometry
+    std::vector<Vector3f> vertices;
+    for (const auto& tri : cubeTriangles)
+        for (int k = 0; k < 3; ++k)
+            vertices.emplace_back(cubeCorners[tri[k]][0], cubeCorners[tri[k]][1], cubeCorners[tri[k]][2]);
+
+    glGenVertexArrays(1, &m_vao);
+    glGenBuffers(1, &m_vertex_buffer);
+    glBindVertexArray(m_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vector3f) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vector3f), (GLvoid*)0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return true;
+}
+
+void RaymarchedVolume::render(const Camera& cam, float iso, float step) const
+{
+    if (m_vao == 0)
+        return;
+
+    ShaderProgram* prog = shader();
+
+    // Voxel index space -> world space
+    Matrix4f index_to_world = Matrix4f::Identity();
+    index_to_world.block(0, 0, 3, 3) = m_spacing.asDiagonal();
+    index_to_world.block(0, 3, 3, 1) = m_origin;
+
+    Matrix4f world_to_view = cam.GetModelview();
+    Matrix4f world_to_clip = cam.GetPerspective() * world_to_view;
+    Vector3f camera_world = world_to_view.inverse().block(0, 3, 3, 1);
+    Vector3f camera_index = (camera_world - m_origin).cwiseQuotient(m_spacing);
+
+    prog->use();
+    prog->setUniform("uIndexToClip", Matrix4f(world_to_clip * index_to_world));
+    prog->setUniform("uIndexToWorld", index_to_world);
+    prog->setUniform("uDims", Vector3f(m_dims.cast<float>()));
+    prog->setUniform("uCameraIndex", camera_index);
+    prog->setUniform("uCameraWorldPosition", camera_world);
+    prog->setUniform("uSpacing", m_spacing);
+    prog->setUniform("uIso", iso);
+    prog->setUniform("uStep", std::max(step, 0.05f));
+    prog->setUniform("uVolume", 0);
+    prog->setUniform("uOccupancy", 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_volume_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, m_occupancy_texture);
+
+    // Rasterize the back faces of the box so that rays start correctly even when
+    // the camera is inside the volume.
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glCullFace(GL_FRONT);
+    glBindVertexArray(m_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+    glBindVertexArray(0);
+    glCullFace(GL_BACK);
+
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glUseProgram(0);
+}
+
+ShaderProgram* RaymarchedVolume::shader()
+{
+    static ShaderProgram* program = nullptr;
+    if (program)
+        return program;
+
+    program = new ShaderProgram(
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+            layout(location = 0) in vec3 aPosition;
+
+            uniform mat4 uIndexToClip;
+            uniform vec3 uDims;
+
+            out vec3 vIndexPos;
+
+            void main()
+            {
+                vIndexPos = aPosition * (uDims - 1.0);
+                gl_Position = uIndexToClip * vec4(vIndexPos, 1.0);
+            }
+        ),
+        "#version 330\n"
+        "#define BRICK_SIZE 8.0\n"
+        FW_GL_SHADER_SOURCE(
+            in vec3 vIndexPos;
+
+            uniform sampler3D uVolume;
+            uniform sampler3D uOccupancy;
+            uniform mat4 uIndexToClip;
+            uniform mat4 uIndexToWorld;
+            uniform vec3 uDims;
+            uniform vec3 uCameraIndex;
+            uniform vec3 uCameraWorldPosition;
+            uniform vec3 uSpacing;
+            uniform float uIso;
+            uniform float uStep;
+
+            const vec3 cLightDirection1 = normalize(vec3(0.5, 0.5, 0.6));
+            const vec3 cLightDirection2 = normalize(vec3(-1, 0, 0));
+            const vec3 cLightColor1 = vec3(1, 1, 1);
+            const vec3 cLightColor2 = vec3(0.4, 0.3, 0.4);
+            const vec3 cBaseColor = vec3(0.7, 0.7, 0.7);
+
+            out vec4 fColor;
+
+            float sampleVolume(vec3 p)
+            {
+                return texture(uVolume, (p + 0.5) / uDims).r;
+            }
+
+            vec3 shade(vec3 p)
+            {
+                // Central differences in index space, scaled to a world space gradient.
+                vec3 g = vec3(sampleVolume(p + vec3(1, 0, 0)) - sampleVolume(p - vec3(1, 0, 0)),
+                              sampleVolume(p + vec3(0, 1, 0)) - sampleVolume(p - vec3(0, 1, 0)),
+                              sampleVolume(p + vec3(0, 0, 1)) - sampleVolume(p - vec3(0, 0, 1))) / uSpacing;
+                vec3 worldPos = (uIndexToWorld * vec4(p, 1.0)).xyz;
+                vec3 viewDir = normalize(uCameraWorldPosition - worldPos);
+                vec3 n = dot(g, g) > 0.0 ? normalize(g) : viewDir;
+                if (dot(n, viewDir) < 0.0)
+                    n = -n;
+
+                float diff1 = max(dot(n, cLightDirection1), 0.0);
+                float diff2 = max(dot(n, cLightDirection2), 0.0);
+                float spec1 = diff1 > 0.0 ? pow(max(dot(n, normalize(cLightDirection1 + viewDir)), 0.0), 48.0) : 0.0;
+                float spec2 = diff2 > 0.0 ? pow(max(dot(n, normalize(cLightDirection2 + viewDir)), 0.0), 48.0) : 0.0;
+                float rim = pow(clamp(1.0 - max(dot(n, viewDir), 0.0), 0.0, 1.0), 2.0) * 0.35;
+
+                vec3 color = cBaseColor * 0.2
+                           + cBaseColor * (diff1 * cLightColor1 + diff2 * cLightColor2)
+                           + vec3(1.0) * (spec1 + spec2) * 0.55
+                           + vec3(0.55, 0.70, 0.90) * rim;
+                return clamp(color, 0.0, 1.0);
+            }
+
+            void main()
+            {
+                vec3 o = uCameraIndex;
+                vec3 d = normalize(vIndexPos - o);
+                vec3 invD = 1.0 / (d + vec3(equal(d, vec3(0.0))) * 1e-7);
+
+                vec3 t0 = -o * invD;
+                vec3 t1 = (uDims - 1.0 - o) * invD;
+                vec3 tmin = min(t0, t1);
+                vec3 tmax = max(t0, t1);
+                float tNear = max(max(tmin.x, tmin.y), tmin.z);
+                float tFar = min(min(tmax.x, tmax.y), tmax.z);
+
+                ivec3 bricks = textureSize(uOccupancy, 0);
+                float t = max(tNear, 0.0);
+                bool hasPrev = false;
+                float prevT = t;
+                float prevV = 0.0;
+
+                for (int i = 0; i < 16384 && t <= tFar; ++i)
+                {
+                    vec3 p = o + t * d;
+                    float v = sampleVolume(p);
+
+                    if (hasPrev && (v >= uIso) != (prevV >= uIso))
+                    {
+                        // Refine the crossing between the last two samples.
+                        float a = prevT;
+                        float b = t;
+                        float va = prevV;
+                        float vb = v;
+                        for (int k = 0; k < 4; ++k) {
+                            float m = mix(a, b, clamp((uIso - va) / (vb - va), 0.05, 0.95));
+                            float vm = sampleVolume(o + m * d);
+                            if ((vm >= uIso) == (va >= uIso)) { a = m; va = vm; }
+                            else                              { b = m; vb = vm; }
+                        }
+                        vec3 hit = o + mix(a, b, clamp((uIso - va) / (vb - va), 0.0, 1.0)) * d;
+
+                        vec4 clip = uIndexToClip * vec4(hit, 1.0);
+                        gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;
+                        fColor = vec4(shade(hit), 1.0);
+                        return;
+                    }
+
+                    hasPrev = true;
+                    prevV = v;
+                    prevT = t;
+
+                    // Empty space skipping: if the isovalue is outside the brick's range,
+                    // jump straight to where the ray leaves the brick.
+                    ivec3 b = clamp(ivec3(floor(p / BRICK_SIZE)), ivec3(0), bricks - 1);
+                    vec2 range = texelFetch(uOccupancy, b, 0).rg;
+                    if (uIso < range.x || uIso > range.y) {
+                        vec3 exitPlanes = (vec3(b) + step(0.0, d)) * BRICK_SIZE;
+                        vec3 tExit = (exitPlanes - o) * invD;
+                        t = max(min(min(tExit.x, tExit.y), tExit.z), t) + 1e-3;
+                    }
+                    else
+                        t += uStep;
+                }
+                discard;
+            }
+        ));
+
+    return program;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "app.h"
+#include "volume.h"
+
+// GPU isosurface rendering of a RAW volume. The voxels are uploaded once into a
+// 3D texture and the isosurface is found per pixel by ray marching through it in a
+// fragment shader, so changing the isovalue costs nothing and no mesh is built.
+// A coarse occupancy texture holds the min/max value of each brick of voxels;
+// bricks whose range does not contain the isovalue are skipped in one step.
+class RaymarchedVolume
+{
+public:
+                        RaymarchedVolume() = default;
+                        ~RaymarchedVolume();
+                        RaymarchedVolume(const RaymarchedVolume&) = delete;
+    RaymarchedVolume&   operator=(const RaymarchedVolume&) = delete;
+
+    // Uploads the volume and builds the occupancy texture. Slices are streamed to the
+    // GPU straight from the mapping. Returns false if the volume does not fit.
+    bool                upload(const RawVolume& volume, const Vector3f& spacing, const Vector3f& origin);
+
+    // Draws the volume's bounding box and ray marches the isosurface inside it.
+    // step is the ray marching step length in voxels.
+    void                render(const Camera& cam, float iso, float step) const;
+
+    float               minValue() const { return m_min_value; }
+    float               maxValue() const { return m_max_value; }
+
+    static const int    BrickSize = 8;
+
+private:
+    static ShaderProgram* shader();
+
+    GLuint              m_volume_texture = 0;
+    GLuint              m_occupancy_texture = 0;
+    GLuint              m_vao = 0;
+    GLuint              m_vertex_buffer = 0;
+
+    Vector3i            m_dims = Vector3i(0, 0, 0);
+    Vector3i            m_bricks = Vector3i(0, 0, 0);
+    Vector3f            m_spacing = Vector3f(1, 1, 1);
+    Vector3f            m_origin = Vector3f(0, 0, 0);
+    float               m_min_value = 0.0f;
+    float               m_max_value = 1.0f;
+};
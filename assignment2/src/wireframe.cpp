@@ -0,0 +1,122 @@
+#include "app.h"
+
+#include "wireframe.h"
+
+namespace
+{
+    GLint s_viewport_uniform = -1;
+    GLint s_highlight_uniform = -1;
+
+    GLuint wireframeProgram()
+    {
+        static GLuint s_program = 0;
+        if (s_program != 0)
+            return s_program;
+
+        GLuint vertex_shader = ShaderProgram::createGLShader(GL_VERTEX_SHADER, "GL_VERTEX_SHADER",
+            "#version 330\n"
+            FW_GL_SHADER_SOURCE(
+                layout(location = 0) in vec3 aPosition;
+
+                out vec3 vPosition;
+
+                void main()
+                {
+                    vPosition = aPosition;
+                }
+            ));
+        GLuint geometry_shader = ShaderProgram::createGLShader(GL_GEOMETRY_SHADER, "GL_GEOMETRY_SHADER",
+            "#version 330\n"
+            FRAME_UNIFORMS_GLSL
+            FW_GL_SHADER_SOURCE(
+                layout(triangles) in;
+                layout(triangle_strip, max_vertices = 12) out;
+
+                in vec3 vPosition[];
+
+                uniform vec2 uViewport;
+                uniform int uHighlight;
+
+                flat out vec3 gColor;
+
+                // a quad of the given width in pixels around the segment from a to b
+                void edge(vec4 a, vec4 b, float width, vec3 color)
+                {
+                    if (a.w <= 0.0 || b.w <= 0.0)
+                        return;
+                    vec2 d = b.xy / b.w - a.xy / a.w;
+                    d *= uViewport;
+                    if (dot(d, d) < 1e-12)
+                        return;
+                    vec2 side = normalize(vec2(-d.y, d.x)) * width / uViewport;
+                    gColor = color;
+                    gl_Position = a - vec4(side * a.w, 0.0, 0.0); EmitVertex();
+                    gl_Position = a + vec4(side * a.w, 0.0, 0.0); EmitVertex();
+                    gl_Position = b - vec4(side * b.w, 0.0, 0.0); EmitVertex();
+                    gl_Position = b + vec4(side * b.w, 0.0, 0.0); EmitVertex();
+                    EndPrimitive();
+                }
+
+                void main()
+                {
+                    vec3 n = cross(vPosition[1] - vPosition[0], vPosition[2] - vPosition[0]);
+                    vec3 lift = length(n) > 0.0 ? normalize(n) * 0.01 : vec3(0.0);
+                    vec3 center = (vPosition[0] + vPosition[1] + vPosition[2]) / 3.0;
+                    vec4 p[3];
+                    for (int i = 0; i < 3; ++i)
+                        p[i] = uWorldToClip * vec4(mix(center, vPosition[i], 0.95) + lift, 1.0);
+
+                    float width = gl_PrimitiveIDIn == uHighlight ? 8.0 : 2.0;
+                    edge(p[0], p[1], width, vec3(1.0, 0.0, 0.0));
+                    edge(p[1], p[2], width, vec3(0.0, 1.0, 0.0));
+                    edge(p[2], p[0], width, vec3(0.0, 0.0, 1.0));
+                }
+            ));
+        GLuint fragment_shader = ShaderProgram::createGLShader(GL_FRAGMENT_SHADER, "GL_FRAGMENT_SHADER",
+            "#version 330\n"
+            FW_GL_SHADER_SOURCE(
+                flat in vec3 gColor;
+
+                out vec4 fColor;
+
+                void main()
+                {
+                    fColor = vec4(gColor, 1.0);
+                }
+            ));
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vertex_shader);
+        glAttachShader(program, geometry_shader);
+        glAttachShader(program, fragment_shader);
+        ShaderProgram::linkGLProgram(program);
+        glUniformBlockBinding(program, glGetUniformBlockIndex(program, "FrameUniforms"), FrameUniformBinding);
+        s_viewport_uniform = glGetUniformLocation(program, "uViewport");
+        s_highlight_uniform = glGetUniformLocation(program, "uHighlight");
+
+        s_program = program;
+        return s_program;
+    }
+}
+
+void drawWireframe(GLuint vao, size_t num_triangles, int highlight_triangle)
+{
+    if (num_triangles == 0)
+        return;
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    GLuint program = wireframeProgram();
+    glUseProgram(program);
+    glUniform2f(s_viewport_uniform, float(viewport[2]), float(viewport[3]));
+    glUniform1i(s_highlight_uniform, highlight_triangle);
+
+    // the quads face either way depending on the direction of their edge
+    glDisable(GL_CULL_FACE);
+    glBindVertexArray(vao);
+    glDrawElements(GL_TRIANGLES, GLsizei(3 * num_triangles), GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+    glEnable(GL_CULL_FACE);
+    glUseProgram(0);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "app.h"
+
+// Draws the edges of the first num_triangles triangles of an indexed mesh straight from its
+// buffers: positions must be attribute 0 of vao, and the index buffer must be bound to it. A
+// geometry shader shrinks every triangle slightly towards its center and lifts it off the
+// surface, like the Im3d wireframe of renderMesh() did, and turns each edge into a screen
+// space quad colored by its index in the triangle: red, green, blue. The triangle
+// highlight_triangle gets wider lines. Nothing is generated or uploaded on the CPU. The camera
+// comes from the FrameUniforms block.
+void    drawWireframe(GLuint vao, size_t num_triangles, int highlight_triangle);